@@ -5,6 +5,14 @@
 
 #include "torflow.h"
 
+/* how often we log the progress of a round */
+#define TORFLOW_AUTHORITY_PROGRESS_INTERVAL_SECONDS 10
+/* how long to wait before asking again for descriptors tor refused to give us */
+#define TORFLOW_AUTHORITY_DESCRIPTOR_RETRY_SECONDS 30
+/* consensuses come every hour. if no full one came for this long, we may have
+ * missed events, so a new round fetches everything again. */
+#define TORFLOW_AUTHORITY_MAX_CONSENSUS_AGE_SECONDS (3*60*60)
+
 struct _TorFlowAuthority {
     gchar* id;
 
@@ -13,19 +21,38 @@ struct _TorFlowAuthority {
     TorFlowDatabase* database;
     TorFlowTorCtlClient* torctl;
     TorFlowFileListener* listener;
+    TorFlowTimer* scanPauseTimer;
+    TorFlowTimer* progressTimer;
+    TorFlowTimer* descriptorRetryTimer;
 
+    /* slices we still choose relays from, and slices that only wait for their running probes */
     GQueue* slices;
+    GQueue* finishingSlices;
     GHashTable* probes;
+    /* ids of probes whose circuit is built, waiting for one of the download slots */
+    GQueue* readyProbes;
+    guint numDownloadingProbes;
+    /* probe id to the slice its relays came from, the slices are owned by the queues above */
+    GHashTable* probeSlices;
     guint workerIDCounter;
+    guint roundNumber;
+    /* kept up to date as probes are launched and complete, so progress is cheap to report */
     guint totalProbesThisRound;
     guint completeProbesThisRound;
+    guint remainingProbesThisRound;
+    TorFlowEventCounters countersAtRoundStart;
 
     gboolean isTorControllerSetup;
+    /* consensus events keep the database current once it has a full consensus */
+    gboolean hasConsensus;
+    gint64 consensusTime;
+    gboolean isWaitingForDescriptors;
 };
 
 /* necessary forward declarations */
 static void _torflowauthority_launchProbes(TorFlowAuthority* authority);
 static void _torflowauthority_getDescriptors(TorFlowAuthority* authority);
+static void _torflowauthority_logProgress(TorFlowAuthority* authority);
 
 static void _torflowauthority_resumeScanning(TorFlowAuthority* authority, gpointer userData) {
     g_assert(authority);
@@ -36,35 +63,59 @@ static void _torflowauthority_resumeScanning(TorFlowAuthority* authority, gpoint
     _torflowauthority_getDescriptors(authority);
 }
 
-static void _torflowauthority_scanPauseTimerReadable(TorFlowTimer* timer, TorFlowEventFlag type) {
-    g_assert(timer);
-    g_assert(type & TORFLOW_EV_READ);
+static void _torflowauthority_logEventCounters(TorFlowAuthority* authority) {
+    g_assert(authority);
 
-    /* if the timer triggered, this will call _torflowauthority_resumeScanning above */
-    gboolean calledNotify = torflowtimer_check(timer);
-    if(calledNotify) {
-        /* done with timer */
-        torflowtimer_free(timer);
-    } else {
-        warning("Authority unable to resume scanning using pause timer! "
-                "Hopefully another read event will trigger it.");
-    }
+    TorFlowEventCounters counters;
+    torfloweventmanager_getCounters(authority->manager, &counters);
+
+    guint64 numEpollCtlCalls = counters.numEpollCtlCalls - authority->countersAtRoundStart.numEpollCtlCalls;
+    guint64 numUringRequests = counters.numUringRequests - authority->countersAtRoundStart.numUringRequests;
+    guint64 numEpollCtlAvoided = counters.numEpollCtlAvoided - authority->countersAtRoundStart.numEpollCtlAvoided;
+    guint64 numWatchAllocations = counters.numWatchAllocations - authority->countersAtRoundStart.numWatchAllocations;
+    guint64 numEventsDispatched = counters.numEventsDispatched - authority->countersAtRoundStart.numEventsDispatched;
+    guint64 numEventsDeferred = counters.numEventsDeferred - authority->countersAtRoundStart.numEventsDeferred;
+
+    gdouble numProbes = (gdouble)MAX(authority->completeProbesThisRound, 1);
+
+    message("%s: event manager did %"G_GUINT64_FORMAT" epoll_ctl calls (%.02f per probe), "
+            "queued %"G_GUINT64_FORMAT" io_uring requests (%.02f per probe), "
+            "avoided %"G_GUINT64_FORMAT" epoll_ctl calls (%.02f per probe), "
+            "did %"G_GUINT64_FORMAT" watch allocations (%.02f per probe), "
+            "dispatched %"G_GUINT64_FORMAT" events (%.02f per probe), "
+            "and deferred %"G_GUINT64_FORMAT" low priority events (%.02f per probe) this round",
+            authority->id,
+            numEpollCtlCalls, (gdouble)numEpollCtlCalls / numProbes,
+            numUringRequests, (gdouble)numUringRequests / numProbes,
+            numEpollCtlAvoided, (gdouble)numEpollCtlAvoided / numProbes,
+            numWatchAllocations, (gdouble)numWatchAllocations / numProbes,
+            numEventsDispatched, (gdouble)numEventsDispatched / numProbes,
+            numEventsDeferred, (gdouble)numEventsDeferred / numProbes);
 }
 
 static void _torflowauthority_onRoundComplete(TorFlowAuthority* authority) {
     info("round complete after completing %u probes", authority->completeProbesThisRound);
 
+    _torflowauthority_logProgress(authority);
+    if(authority->progressTimer) {
+        torflowtimer_cancel(authority->progressTimer);
+    }
+
+    _torflowauthority_logEventCounters(authority);
+
+    torflowdatabase_finishRound(authority->database);
+
     /* write the new v3bw file */
     torflowdatabase_writeBandwidthFile(authority->database);
 
     guint seconds = torflowconfig_getScanIntervalSeconds(authority->config);
     if(seconds > 0) {
-        /* pause before resuming */
-        TorFlowTimer* timer = torflowtimer_new((GFunc)_torflowauthority_resumeScanning, authority, NULL);
-        torflowtimer_arm(timer, seconds);
-        gint timerFD = torflowtimer_getFD(timer);
-        torfloweventmanager_register(authority->manager, timerFD, TORFLOW_EV_READ,
-                (TorFlowOnEventFunc)_torflowauthority_scanPauseTimerReadable, timer);
+        /* pause before resuming, the timer will call _torflowauthority_resumeScanning above */
+        if(!authority->scanPauseTimer) {
+            authority->scanPauseTimer = torfloweventmanager_createTimer(authority->manager,
+                    (GFunc)_torflowauthority_resumeScanning, authority, NULL);
+        }
+        torflowtimer_arm(authority->scanPauseTimer, seconds);
     } else {
         /* no pause needed */
         _torflowauthority_resumeScanning(authority, NULL);
@@ -75,7 +126,6 @@ static void _torflowauthority_countProbesRemaining(TorFlowSlice* slice, guint* n
     g_assert(slice);
     g_assert(numProbesRemaining);
     *numProbesRemaining += torflowslice_getNumProbesRemaining(slice);
-    torflowslice_logStatus(slice);
 }
 
 static void _torflowauthority_logProgress(TorFlowAuthority* authority) {
@@ -85,15 +135,8 @@ static void _torflowauthority_logProgress(TorFlowAuthority* authority) {
         return;
     }
 
-    guint inProgress = 0;
-    guint remaining = 0;
-
-    if(authority->probes) {
-        inProgress = g_hash_table_size(authority->probes);
-    }
-    if(authority->slices) {
-        g_queue_foreach(authority->slices, (GFunc)_torflowauthority_countProbesRemaining, &remaining);
-    }
+    guint inProgress = authority->probes ? g_hash_table_size(authority->probes) : 0;
+    guint remaining = authority->remainingProbesThisRound;
 
     guint progressComplete = remaining >= authority->totalProbesThisRound ? 0 : authority->totalProbesThisRound-remaining;
     gdouble percentage = (gdouble)progressComplete / (gdouble)authority->totalProbesThisRound;
@@ -104,27 +147,117 @@ static void _torflowauthority_logProgress(TorFlowAuthority* authority) {
             progressComplete, authority->totalProbesThisRound, percentage);
 }
 
+static void _torflowauthority_onProgressTimer(TorFlowAuthority* authority, gpointer userData) {
+    g_assert(authority);
+
+    _torflowauthority_logProgress(authority);
+
+    /* keep reporting until the round is over, the next round arms us again */
+    gboolean isRoundRunning = (authority->slices && !g_queue_is_empty(authority->slices)) ||
+            (authority->finishingSlices && !g_queue_is_empty(authority->finishingSlices)) ||
+            (authority->probes && g_hash_table_size(authority->probes) > 0);
+    if(isRoundRunning) {
+        torflowtimer_arm(authority->progressTimer, TORFLOW_AUTHORITY_PROGRESS_INTERVAL_SECONDS);
+    }
+}
+
+static void _torflowauthority_onSliceComplete(TorFlowAuthority* authority, TorFlowSlice* slice) {
+    g_assert(authority);
+    g_assert(slice);
+
+    info("%s: slice %u complete after %u probes", authority->id,
+            torflowslice_getID(slice), torflowslice_getNumProbesComplete(slice));
+
+    /* after the first round every relay has measurements, and with initial estimates every relay
+     * has a bandwidth from the start, so the file is complete and we can publish the new results
+     * of every slice right away instead of waiting for the end of the round. the end of the
+     * round publishes anyway, so don't do it twice. */
+    gboolean isRoundComplete = g_queue_is_empty(authority->slices) &&
+            g_queue_is_empty(authority->finishingSlices) &&
+            g_hash_table_size(authority->probes) == 0;
+
+    gboolean isFileComplete = authority->roundNumber > 1 || torflowdatabase_hasPriorBandwidths(authority->database);
+
+    if(isFileComplete && !isRoundComplete && torflowslice_getNumProbesComplete(slice) > 0) {
+        message("%s: publishing results of slice %u", authority->id, torflowslice_getID(slice));
+        torflowdatabase_writeBandwidthFile(authority->database);
+    }
+
+    torflowslice_free(slice);
+}
+
+static void _torflowauthority_startReadyProbes(TorFlowAuthority* authority) {
+    g_assert(authority);
+
+    guint numParallelProbes = torflowconfig_getNumParallelProbes(authority->config);
+
+    while(authority->numDownloadingProbes < numParallelProbes && !g_queue_is_empty(authority->readyProbes)) {
+        guint probeID = GPOINTER_TO_UINT(g_queue_pop_head(authority->readyProbes));
+        TorFlowProbe* probe = g_hash_table_lookup(authority->probes, GUINT_TO_POINTER(probeID));
+
+        if(probe) {
+            /* a probe that fails to start completes right away, which frees it */
+            authority->numDownloadingProbes++;
+            torflowprobe_start(probe);
+        }
+    }
+}
+
+static void _torflowauthority_onProbeReady(TorFlowAuthority* authority, guint probeID) {
+    g_assert(authority);
+
+    debug("%s: probe %u has a circuit and waits for a download slot", authority->id, probeID);
+
+    g_queue_push_tail(authority->readyProbes, GUINT_TO_POINTER(probeID));
+    _torflowauthority_startReadyProbes(authority);
+}
+
 static void _torflowauthority_onProbeComplete(TorFlowAuthority* authority, guint probeID,
-        gchar* entryIdentity, gchar* exitIdentity, gboolean isSuccess,
+        TorFlowRelayHandle entryRelay, TorFlowRelayHandle exitRelay, gboolean isSuccess,
         gsize contentLength, gsize roundTripTime, gsize payloadTime, gsize totalTime) {
     g_assert(authority);
 
+    TorFlowRelayTable* relays = torflowdatabase_getRelays(authority->database);
+    gchar entryIdentity[TORFLOW_RELAY_IDENTITY_SIZE];
+    gchar exitIdentity[TORFLOW_RELAY_IDENTITY_SIZE];
+
     message("%s: probe complete: path=%s,%s success=%s, size=%zu, RTT=%zu, TTFB=%zu, TTLB=%zu",
             authority->id,
-            entryIdentity, exitIdentity, isSuccess ? "true" : "false",
+            torflowrelaytable_formatIdentity(relays, entryRelay, entryIdentity),
+            torflowrelaytable_formatIdentity(relays, exitRelay, exitIdentity), isSuccess ? "true" : "false",
             contentLength, roundTripTime, payloadTime, totalTime);
 
     authority->completeProbesThisRound++;
 
     /* store the measurement result */
-    torflowdatabase_storeMeasurementResult(authority->database, entryIdentity, exitIdentity,
+    torflowdatabase_storeMeasurementResult(authority->database, entryRelay, exitRelay,
             isSuccess, contentLength, roundTripTime, payloadTime, totalTime);
 
+    /* free its download slot, or its place in line for one */
+    TorFlowProbe* probe = g_hash_table_lookup(authority->probes, GUINT_TO_POINTER(probeID));
+    if(probe && torflowprobe_isStarted(probe)) {
+        authority->numDownloadingProbes--;
+    } else {
+        g_queue_remove(authority->readyProbes, GUINT_TO_POINTER(probeID));
+    }
+
     /* we are done with the probe, this will free the probe */
+    TorFlowSlice* slice = g_hash_table_lookup(authority->probeSlices, GUINT_TO_POINTER(probeID));
+    g_hash_table_remove(authority->probeSlices, GUINT_TO_POINTER(probeID));
     g_hash_table_remove(authority->probes, GUINT_TO_POINTER(probeID));
 
-    // TODO after the first round, once we have measurements for all relays,
-    // then we can write new v3bw file after every slice to speed up bw file creation
+    if(slice) {
+        torflowslice_onProbeComplete(slice);
+
+        /* the slice is done if this was the last probe it was waiting for */
+        if(torflowslice_getNumProbesRunning(slice) == 0 && g_queue_find(authority->finishingSlices, slice)) {
+            g_queue_remove(authority->finishingSlices, slice);
+            _torflowauthority_onSliceComplete(authority, slice);
+        }
+    }
+
+    /* the next download can use a circuit that is already built */
+    _torflowauthority_startReadyProbes(authority);
 
     /* if we still have slices, start some probes on their relays */
     if(!g_queue_is_empty(authority->slices)) {
@@ -135,7 +268,7 @@ static void _torflowauthority_onProbeComplete(TorFlowAuthority* authority, guint
 
     /* check if we need more probes or if the round is done */
     gboolean startNextRound = FALSE;
-    if(g_queue_is_empty(authority->slices)) {
+    if(g_queue_is_empty(authority->slices) && g_queue_is_empty(authority->finishingSlices)) {
         /* all slices are done, are we waiting for any more probes? */
         guint numProbes = g_hash_table_size(authority->probes);
         if(numProbes > 0) {
@@ -147,90 +280,70 @@ static void _torflowauthority_onProbeComplete(TorFlowAuthority* authority, guint
         }
     }
 
-    _torflowauthority_logProgress(authority);
-
     if(startNextRound) {
         _torflowauthority_onRoundComplete(authority);
     }
 }
 
-static void _torflowauthority_checkProbe(TorFlowAuthority* authority, gpointer probeID) {
-    g_assert(authority);
-
-    /* the probe would have timed out if it still exists, otherwise it completed successfully */
-    TorFlowProbe* probe = g_hash_table_lookup(authority->probes, probeID);
-    if(probe != NULL) {
-        info("%s: probe %u timed out, canceling now", authority->id, GPOINTER_TO_UINT(probeID));
-
-        /* this will cause a call to _torflowauthority_onProbeComplete to delete the probe */
-        torflowprobe_onTimeout(probe);
-    }
-}
-
-static void _torflowauthority_probeTimerReadable(TorFlowTimer* timer, TorFlowEventFlag type) {
-    g_assert(timer);
-    g_assert(type & TORFLOW_EV_READ);
-
-    /* if the timer triggered, this will call _torflowauthority_resumeScanning above */
-    gboolean calledNotify = torflowtimer_check(timer);
-    if(calledNotify) {
-        /* done with timer */
-        torflowtimer_free(timer);
-    } else {
-        warning("Authority unable to check probe timeout using pause timer! "
-                "Hopefully another read event will trigger it.");
-    }
-}
-
 static void _torflowauthority_launchProbes(TorFlowAuthority* authority) {
     g_assert(authority);
 
     /* start measuring relays with probes */
-    guint numParallelProbes = torflowconfig_getNumParallelProbes(authority->config);
+    /* besides the probes that download, a few build their circuits ahead of time */
+    guint numProbes = torflowconfig_getNumParallelProbes(authority->config) +
+            torflowconfig_getNumPrebuiltCircuits(authority->config);
     guint probeTimeoutSeconds = torflowconfig_getProbeTimeoutSeconds(authority->config);
 
-    in_port_t controlPort = torflowconfig_getTorControlPort(authority->config);
     in_port_t socksPort = torflowconfig_getTorSocksPort(authority->config);
 
-    while(g_hash_table_size(authority->probes) < numParallelProbes && !g_queue_is_empty(authority->slices)) {
+    while(g_hash_table_size(authority->probes) < numProbes && !g_queue_is_empty(authority->slices)) {
         TorFlowSlice* slice = g_queue_pop_head(authority->slices);
 
-        gchar* entryRelayIdentity = NULL;
-        gchar* exitRelayIdentity = NULL;
-        gboolean found = torflowslice_chooseRelayPair(slice, &entryRelayIdentity, &exitRelayIdentity);
+        TorFlowRelayHandle entryRelay = TORFLOW_RELAY_INVALID_HANDLE;
+        TorFlowRelayHandle exitRelay = TORFLOW_RELAY_INVALID_HANDLE;
+        guint sliceProbesRemaining = torflowslice_getNumProbesRemaining(slice);
+        gboolean found = torflowslice_chooseRelayPair(slice, &entryRelay, &exitRelay);
+
+        /* choosing a pair can satisfy up to two of the probes the slice still needs */
+        authority->remainingProbesThisRound -= sliceProbesRemaining - torflowslice_getNumProbesRemaining(slice);
 
-        if(found && entryRelayIdentity != NULL && exitRelayIdentity != NULL) {
+        if(found && entryRelay != TORFLOW_RELAY_INVALID_HANDLE && exitRelay != TORFLOW_RELAY_INVALID_HANDLE) {
             /* measure the relays */
             guint probeID = authority->workerIDCounter++;
             TorFlowPeer* filePeer = torflowconfig_cycleFileServerPeers(authority->config);
             gsize transferSize = torflowslice_getTransferSize(slice);
 
+            /* the probe cancels its own timeout when it completes */
             TorFlowProbe* probe = torflowprobe_new(authority->manager, probeID,
-                    controlPort, socksPort, filePeer, transferSize,
-                    entryRelayIdentity, exitRelayIdentity,
+                    authority->torctl, socksPort, filePeer, transferSize, probeTimeoutSeconds,
+                    torflowdatabase_getRelays(authority->database), entryRelay, exitRelay,
+                    (OnProbeReadyFunc)_torflowauthority_onProbeReady, authority,
                     (OnProbeCompleteFunc)_torflowauthority_onProbeComplete, authority);
 
             if(probe != NULL) {
                 g_hash_table_replace(authority->probes, GUINT_TO_POINTER(probeID), probe);
-
-                if(probeTimeoutSeconds > 0) {
-                    /* check on the probe after a timeout */
-                    TorFlowTimer* timer = torflowtimer_new((GFunc)_torflowauthority_checkProbe, authority, GUINT_TO_POINTER(probeID));
-                    torflowtimer_arm(timer, probeTimeoutSeconds);
-                    gint timerFD = torflowtimer_getFD(timer);
-                    torfloweventmanager_register(authority->manager, timerFD, TORFLOW_EV_READ,
-                            (TorFlowOnEventFunc)_torflowauthority_probeTimerReadable, timer);
-                }
+                g_hash_table_replace(authority->probeSlices, GUINT_TO_POINTER(probeID), slice);
             } else {
                 warning("%s: error creating probe %u; ignoring", authority->id, probeID);
+                torflowslice_onProbeComplete(slice);
             }
 
             /* we still need to probe relays in this slice */
             g_queue_push_tail(authority->slices, slice);
         } else {
             /* no longer need to measure any more relays.
-             * either they had no exits or entries, or we are done measuring all relays */
-            torflowslice_free(slice);
+             * either they had no exits or entries, or we are done measuring all relays.
+             * the slice is complete once its last probes report back.
+             * whatever it still needed will not be probed this round. */
+            guint numProbesSkipped = torflowslice_getNumProbesRemaining(slice);
+            authority->remainingProbesThisRound -= MIN(numProbesSkipped, authority->remainingProbesThisRound);
+            authority->totalProbesThisRound -= MIN(numProbesSkipped, authority->totalProbesThisRound);
+
+            if(torflowslice_getNumProbesRunning(slice) > 0) {
+                g_queue_push_tail(authority->finishingSlices, slice);
+            } else {
+                _torflowauthority_onSliceComplete(authority, slice);
+            }
         }
     }
 }
@@ -239,59 +352,74 @@ static GQueue* _torflowauthority_sliceRelays(TorFlowAuthority* authority) {
     g_assert(authority);
 
     /* get relays sorted by decreasing bandwidth */
-    GQueue* relaysToMeasure = torflowdatabase_getMeasureableRelays(authority->database);
-    guint totalMeasurableRelays = g_queue_get_length(relaysToMeasure);
+    guint totalMeasurableRelays = 0;
+    TorFlowRelayHandle* relaysToMeasure = torflowdatabase_getMeasureableRelays(authority->database, &totalMeasurableRelays);
 
     message("%s: we have %u measurable relays", authority->id, totalMeasurableRelays);
 
-    /* break relays into slices */
+    /* break relays into slices, each one a contiguous range of the sorted relays */
     GQueue* slices = g_queue_new();
-    TorFlowSlice* slice = NULL;
 
     guint numProbesPerRelay = torflowconfig_getNumProbesPerRelay(authority->config);
+    guint numRelaysPerSlice = torflowconfig_getNumRelaysPerSlice(authority->config);
+    TorFlowRelayTable* relays = torflowdatabase_getRelays(authority->database);
 
-    while(!g_queue_is_empty(relaysToMeasure)) {
+    for(guint start = 0; start < totalMeasurableRelays; start += numRelaysPerSlice) {
+        guint end = MIN(start + numRelaysPerSlice, totalMeasurableRelays);
 
-        if(!slice) {
-            guint sliceID = g_queue_get_length(slices);
-            gdouble percentile = 1.0f - ((gdouble)g_queue_get_length(relaysToMeasure)/(gdouble)totalMeasurableRelays);
-            slice = torflowslice_new(sliceID, percentile, numProbesPerRelay);
-            g_queue_push_tail(slices, slice);
-        }
-
-        torflowslice_addRelay(slice, g_queue_pop_head(relaysToMeasure));
+        guint sliceID = g_queue_get_length(slices);
+        gdouble percentile = (gdouble)start / (gdouble)totalMeasurableRelays;
+        TorFlowSlice* slice = torflowslice_new(sliceID, percentile, numProbesPerRelay);
+        g_queue_push_tail(slices, slice);
 
-        if(torflowslice_getLength(slice) >= torflowconfig_getNumRelaysPerSlice(authority->config)) {
-            /* log slice info */
-            torflowslice_logStatus(slice);
-            /* set to NULL so we create a new one next time */
-            slice = NULL;
+        for(guint i = start; i < end; i++) {
+            TorFlowRelayHandle relay = relaysToMeasure[i];
+            torflowslice_addRelay(slice, relay, torflowrelaytable_getIsExit(relays, relay),
+                    torflowdatabase_getNumProbes(authority->database, relay));
         }
-    }
 
-    /* the last slice may not be full, but log info anyway */
-    if(slice) {
+        /* log slice info, the last slice may not be full */
         torflowslice_logStatus(slice);
     }
 
+    g_free(relaysToMeasure);
+
     return slices;
 }
 
 static void _torflowauthority_startNewScanningRound(TorFlowAuthority* authority) {
     g_assert(authority);
 
+    /* after a restart, continue the round the measurement store says we were in */
+    guint unfinishedRound = torflowdatabase_getUnfinishedRound(authority->database);
+    if(authority->roundNumber == 0 && unfinishedRound > 0) {
+        authority->roundNumber = unfinishedRound;
+        message("%s: resuming round %u", authority->id, authority->roundNumber);
+    } else {
+        authority->roundNumber++;
+        torflowdatabase_beginRound(authority->database, authority->roundNumber);
+        message("%s: starting round %u", authority->id, authority->roundNumber);
+    }
+
     /* break relays into 'slices' for measurement */
     if(authority->slices) {
         g_queue_free_full(authority->slices, (GDestroyNotify) torflowslice_free);
     }
     authority->slices = _torflowauthority_sliceRelays(authority);
 
-    /* count the total probes needed this round */
+    if(authority->finishingSlices) {
+        g_queue_free_full(authority->finishingSlices, (GDestroyNotify) torflowslice_free);
+    }
+    authority->finishingSlices = g_queue_new();
+
+    /* count the total probes needed this round, the slices keep their own counts */
     authority->totalProbesThisRound = 0;
     if(authority->slices) {
         g_queue_foreach(authority->slices, (GFunc)_torflowauthority_countProbesRemaining, &authority->totalProbesThisRound);
     }
+    authority->remainingProbesThisRound = authority->totalProbesThisRound;
     authority->completeProbesThisRound = 0;
+    torfloweventmanager_getCounters(authority->manager, &authority->countersAtRoundStart);
 
     /* clear out previous probes that might be hanging around */
     if(authority->probes) {
@@ -299,6 +427,24 @@ static void _torflowauthority_startNewScanningRound(TorFlowAuthority* authority)
     }
     authority->probes = g_hash_table_new_full(g_direct_hash, g_direct_equal, NULL, (GDestroyNotify)torflowprobe_free);
 
+    if(authority->probeSlices) {
+        g_hash_table_destroy(authority->probeSlices);
+    }
+    authority->probeSlices = g_hash_table_new(g_direct_hash, g_direct_equal);
+
+    if(authority->readyProbes) {
+        g_queue_free(authority->readyProbes);
+    }
+    authority->readyProbes = g_queue_new();
+    authority->numDownloadingProbes = 0;
+
+    /* report progress on a timer, not on every probe */
+    if(!authority->progressTimer) {
+        authority->progressTimer = torfloweventmanager_createTimer(authority->manager,
+                (GFunc)_torflowauthority_onProgressTimer, authority, NULL);
+    }
+    torflowtimer_arm(authority->progressTimer, TORFLOW_AUTHORITY_PROGRESS_INTERVAL_SECONDS);
+
     /* start probing relays in the slices */
     _torflowauthority_launchProbes(authority);
 }
@@ -307,29 +453,7 @@ static void _torflowauthority_onNewStream(TorFlowAuthority* authority, gint stre
         gchar* sourceAddress, in_port_t sourcePort, gchar* targetAddress, in_port_t targetPort) {
     g_assert(authority);
 
-    debug("%s: new stream %i for port %u", authority->id, streamID, sourcePort);
-
-    /* if none of our probes created this stream, then we need to let Tor attach it */
-    GHashTableIter iter;
-    gpointer key, value;
-    g_hash_table_iter_init(&iter, authority->probes);
-
-    /* check if this is a probe stream */
-    while(g_hash_table_iter_next(&iter, &key, &value)) {
-        guint probeID = GPOINTER_TO_UINT(key);
-        TorFlowProbe* probe = value;
-
-        if(probe) {
-            in_port_t probePort = torflowprobe_getHostClientSocksPort(probe);
-            if(probePort > 0 && sourcePort == probePort) {
-                info("%s: ignoring stream %i, source port %u matches client port %u and should be handled by client",
-                        authority->id, streamID, sourcePort, probePort);
-                return;
-            }
-        }
-    }
-
-    /* the port did not match any client ports.
+    /* the controller already gave the streams from probe client ports to their probes.
      * let Tor attach the stream, and don't notify us when attached */
     info("%s: letting Tor attach stream %i to any circuit", authority->id, streamID);
     torflowtorctlclient_commandAttachStreamToCircuit(authority->torctl, streamID, 0, NULL, NULL);
@@ -342,41 +466,123 @@ static void _torflowauthority_setupTorController(TorFlowAuthority* authority) {
     torflowtorctlclient_commandSetupTorConfig(authority->torctl);
 
     /* we need to attach all streams that the probes do not create */
-    torflowtorctlclient_setNewStreamCallback(authority->torctl, 0,
+    torflowtorctlclient_setNewStreamCallback(authority->torctl,
             (OnStreamNewFunc)_torflowauthority_onNewStream, authority);
 
-    /* start watching for stream events */
-    torflowtorctlclient_commandEnableEvents(authority->torctl);
 }
 
-static void _torflowauthority_onDescriptorsReceived(TorFlowAuthority* authority, GQueue* descriptorLines) {
+static void _torflowauthority_onDescriptorsBegin(TorFlowAuthority* authority, gboolean isFullConsensus) {
     g_assert(authority);
+    torflowdatabase_beginDescriptors(authority->database, isFullConsensus);
+}
 
-    message("%s: received Tor relay descriptors", authority->id);
+static void _torflowauthority_onDescriptorLine(TorFlowAuthority* authority, const gchar* line, gsize length) {
+    g_assert(authority);
+    torflowdatabase_storeDescriptorLine(authority->database, line, length);
+}
 
-    /* now parse the descriptors */
-    message("%s: storing relays from descriptors", authority->id);
-    guint numRelays = torflowdatabase_storeNewDescriptors(authority->database, descriptorLines);
-    message("%s: finished parsing descriptors, found %u relays", authority->id, numRelays);
+static void _torflowauthority_onDescriptorsCurrent(TorFlowAuthority* authority) {
+    g_assert(authority);
+
+    authority->isWaitingForDescriptors = FALSE;
 
     if(!authority->isTorControllerSetup) {
         _torflowauthority_setupTorController(authority);
         authority->isTorControllerSetup = TRUE;
     }
 
+    /* the initial estimates and the consensus already make a useful file, so
+     * directory authorities don't have to wait for the whole first round */
+    if(authority->roundNumber == 0 && torflowdatabase_hasPriorBandwidths(authority->database)) {
+        message("%s: publishing initial bandwidth estimates", authority->id);
+        torflowdatabase_writeBandwidthFile(authority->database);
+    }
+
     _torflowauthority_startNewScanningRound(authority);
 }
 
+static void _torflowauthority_onDescriptorsReceived(TorFlowAuthority* authority, gboolean isFullConsensus) {
+    g_assert(authority);
+
+    /* the relays were stored while the descriptors streamed in */
+    guint numChangedRelays = torflowdatabase_finishDescriptors(authority->database);
+    guint numRelays = torflowrelaytable_getNumRelays(torflowdatabase_getRelays(authority->database));
+    message("%s: received %s, %u relays changed and we know %u relays", authority->id,
+            isFullConsensus ? "full consensus" : "consensus update", numChangedRelays, numRelays);
+
+    if(isFullConsensus) {
+        authority->hasConsensus = TRUE;
+        authority->consensusTime = g_get_monotonic_time();
+    }
+
+    /* updates during a round change the relays in place, the slices pick them up as they go */
+    if(authority->isWaitingForDescriptors && authority->hasConsensus) {
+        _torflowauthority_onDescriptorsCurrent(authority);
+    }
+}
+
+static void _torflowauthority_onDescriptorRetryTimer(TorFlowAuthority* authority, gpointer userData) {
+    g_assert(authority);
+
+    /* a consensus event may have made the retry unnecessary */
+    if(authority->isWaitingForDescriptors) {
+        message("%s: requesting current relay descriptors again", authority->id);
+        torflowtorctlclient_commandGetDescriptorInfo(authority->torctl);
+    }
+}
+
+static void _torflowauthority_onDescriptorsFailed(TorFlowAuthority* authority) {
+    g_assert(authority);
+
+    if(!authority->isWaitingForDescriptors) {
+        return;
+    }
+
+    warning("%s: descriptor request failed, retrying in %i seconds",
+            authority->id, TORFLOW_AUTHORITY_DESCRIPTOR_RETRY_SECONDS);
+
+    if(!authority->descriptorRetryTimer) {
+        authority->descriptorRetryTimer = torfloweventmanager_createTimer(authority->manager,
+                (GFunc)_torflowauthority_onDescriptorRetryTimer, authority, NULL);
+    }
+    torflowtimer_arm(authority->descriptorRetryTimer, TORFLOW_AUTHORITY_DESCRIPTOR_RETRY_SECONDS);
+}
+
 static void _torflowauthority_getDescriptors(TorFlowAuthority* authority) {
     g_assert(authority);
+
+    gint64 consensusAge = g_get_monotonic_time() - authority->consensusTime;
+    if(authority->hasConsensus && consensusAge < (gint64)TORFLOW_AUTHORITY_MAX_CONSENSUS_AGE_SECONDS * G_USEC_PER_SEC) {
+        /* the consensus events already told us about every change */
+        message("%s: relay descriptors are current, skipping the descriptor request", authority->id);
+        _torflowauthority_onDescriptorsCurrent(authority);
+        return;
+    }
+
+    if(authority->hasConsensus) {
+        message("%s: no full consensus for %"G_GINT64_FORMAT" seconds, fetching all descriptors again",
+                authority->id, consensusAge / G_USEC_PER_SEC);
+        /* the next round waits for the full consensus, updates still apply in the meantime */
+        authority->hasConsensus = FALSE;
+    }
+
+    authority->isWaitingForDescriptors = TRUE;
     message("%s: requesting current relay descriptors", authority->id);
-    torflowtorctlclient_commandGetDescriptorInfo(authority->torctl,
-            (OnDescriptorsReceivedFunc)_torflowauthority_onDescriptorsReceived, authority);
+    torflowtorctlclient_commandGetDescriptorInfo(authority->torctl);
 }
 
 static void _torflowauthority_onBootstrapped(TorFlowAuthority* authority) {
     g_assert(authority);
     message("%s: Tor instance successfully bootstrapped", authority->id);
+
+    /* follow consensus changes before we fetch the first one, so we don't miss any in between */
+    torflowtorctlclient_setDescriptorCallbacks(authority->torctl,
+            (OnDescriptorsBeginFunc)_torflowauthority_onDescriptorsBegin,
+            (OnDescriptorLineFunc)_torflowauthority_onDescriptorLine,
+            (OnDescriptorsReceivedFunc)_torflowauthority_onDescriptorsReceived,
+            (OnDescriptorsFailedFunc)_torflowauthority_onDescriptorsFailed, authority);
+    torflowtorctlclient_commandEnableEvents(authority->torctl);
+
     _torflowauthority_getDescriptors(authority);
 }
 
@@ -436,7 +642,7 @@ TorFlowAuthority* torflowauthority_new(TorFlowConfig* config, TorFlowEventManage
 
     /* set up the file listener that will accept probe connections */
     in_port_t listenerPort = torflowconfig_getListenerPort(authority->config);
-    authority->listener = torflowfilelistener_new(manager, 0, listenerPort);
+    authority->listener = torflowfilelistener_new(manager, 0, listenerPort, FALSE);
 
     if(authority->listener == NULL) {
         message("%s: error creating file server listener instance", authority->id);
@@ -453,12 +659,30 @@ void torflowauthority_free(TorFlowAuthority* authority) {
     if(authority->probes) {
         g_hash_table_destroy(authority->probes);
     }
+    if(authority->probeSlices) {
+        g_hash_table_destroy(authority->probeSlices);
+    }
+    if(authority->readyProbes) {
+        g_queue_free(authority->readyProbes);
+    }
     if(authority->slices) {
         g_queue_free_full(authority->slices, (GDestroyNotify) torflowslice_free);
     }
+    if(authority->finishingSlices) {
+        g_queue_free_full(authority->finishingSlices, (GDestroyNotify) torflowslice_free);
+    }
     if(authority->torctl) {
         torflowtorctlclient_free(authority->torctl);
     }
+    if(authority->scanPauseTimer) {
+        torflowtimer_free(authority->scanPauseTimer);
+    }
+    if(authority->progressTimer) {
+        torflowtimer_free(authority->progressTimer);
+    }
+    if(authority->descriptorRetryTimer) {
+        torflowtimer_free(authority->descriptorRetryTimer);
+    }
     if(authority->listener) {
         torflowfilelistener_free(authority->listener);
     }
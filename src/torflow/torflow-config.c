@@ -10,8 +10,10 @@ struct _TorFlowConfig {
     TorFlowMode mode;
 
     gchar* v3bwInitFilePath;
+    gchar* measurementStoreFilePath;
 
     guint numParallelProbes;
+    guint numPrebuiltCircuits;
     guint numRelaysPerSlice;
     guint scanIntervalSeconds;
     gdouble maxRelayWeightFraction;
@@ -19,10 +21,14 @@ struct _TorFlowConfig {
     in_port_t torSocksPort;
     in_port_t torControlPort;
     in_port_t listenPort;
+    guint numFileServerThreads;
 
     guint probeTimeoutSeconds;
     guint numProbesPerRelay;
+    guint numV3BWFilesKept;
     GLogLevelFlags logLevel;
+    /* 0 for categories that use logLevel */
+    GLogLevelFlags logCategoryLevels[TORFLOW_LOG_NUM_CATEGORIES];
 
     GQueue* fileServerPeers;
 };
@@ -48,6 +54,23 @@ static gboolean _torflowconfig_parseV3BWInitFilePath(TorFlowConfig* config, gcha
     }
 }
 
+static gboolean _torflowconfig_parseMeasurementStoreFilePath(TorFlowConfig* config, gchar* value) {
+    g_assert(config && value);
+
+    if(config->measurementStoreFilePath != NULL) {
+        g_free(config->measurementStoreFilePath);
+        config->measurementStoreFilePath = NULL;
+    }
+
+    /* the store is created if it does not exist yet */
+    if(value[0] == '\0' || g_file_test(value, G_FILE_TEST_IS_DIR)) {
+        return FALSE;
+    }
+
+    config->measurementStoreFilePath = g_strdup(value);
+    return TRUE;
+}
+
 static gboolean _torflowconfig_parseScanInterval(TorFlowConfig* config, gchar* value) {
     g_assert(config && value);
 
@@ -74,6 +97,19 @@ static gboolean _torflowconfig_parseNumProbes(TorFlowConfig* config, gchar* valu
     return TRUE;
 }
 
+static gboolean _torflowconfig_parseNumPrebuiltCircuits(TorFlowConfig* config, gchar* value) {
+    g_assert(config && value);
+
+    gint intValue = atoi(value);
+    if(intValue < 0) {
+        return FALSE;
+    }
+
+    config->numPrebuiltCircuits = (guint)intValue;
+
+    return TRUE;
+}
+
 static gboolean _torflowconfig_parseNumRelaysPerSlice(TorFlowConfig* config, gchar* value) {
     g_assert(config && value);
 
@@ -104,7 +140,8 @@ static gboolean _torflowconfig_parseNumProbesPerRelay(TorFlowConfig* config, gch
     g_assert(config && value);
 
     gint intValue = atoi(value);
-    if(intValue < 1) {
+    if(intValue < 1 || intValue > TORFLOW_RELAY_MAX_MEASUREMENTS) {
+        warning("NumProbesPerRelay must be between 1 and %i", TORFLOW_RELAY_MAX_MEASUREMENTS);
         return FALSE;
     }
 
@@ -113,6 +150,19 @@ static gboolean _torflowconfig_parseNumProbesPerRelay(TorFlowConfig* config, gch
     return TRUE;
 }
 
+static gboolean _torflowconfig_parseNumV3BWFilesKept(TorFlowConfig* config, gchar* value) {
+    g_assert(config && value);
+
+    gint intValue = atoi(value);
+    if(intValue < 0) {
+        return FALSE;
+    }
+
+    config->numV3BWFilesKept = (guint)intValue;
+
+    return TRUE;
+}
+
 static gboolean _torflowconfig_parseTorSocksPort(TorFlowConfig* config, gchar* value) {
     g_assert(config && value);
 
@@ -155,6 +205,19 @@ static gboolean _torflowconfig_parseListenPort(TorFlowConfig* config, gchar* val
     return TRUE;
 }
 
+static gboolean _torflowconfig_parseNumFileServerThreads(TorFlowConfig* config, gchar* value) {
+    g_assert(config && value);
+
+    gint intValue = atoi(value);
+    if(intValue < 1) {
+        return FALSE;
+    }
+
+    config->numFileServerThreads = (guint)intValue;
+
+    return TRUE;
+}
+
 static gboolean _torflowconfig_parseMaxRelayWeightFraction(TorFlowConfig* config, gchar* value) {
     g_assert(config && value);
 
@@ -200,17 +263,17 @@ static gboolean _torflowconfig_parseFileServerInfo(TorFlowConfig* config, gchar*
     return TRUE;
 }
 
-static gboolean _torflowconfig_parseLogLevel(TorFlowConfig* config, gchar* value) {
-    g_assert(config && value);
+static gboolean _torflowconfig_parseLogLevelValue(gchar* value, GLogLevelFlags* level) {
+    g_assert(value && level);
 
     if(!g_ascii_strcasecmp(value, "debug")) {
-        config->logLevel = G_LOG_LEVEL_DEBUG;
+        *level = G_LOG_LEVEL_DEBUG;
     } else if(!g_ascii_strcasecmp(value, "info")) {
-        config->logLevel = G_LOG_LEVEL_INFO;
+        *level = G_LOG_LEVEL_INFO;
     } else if(!g_ascii_strcasecmp(value, "message")) {
-        config->logLevel = G_LOG_LEVEL_MESSAGE;
+        *level = G_LOG_LEVEL_MESSAGE;
     } else if(!g_ascii_strcasecmp(value, "warning")) {
-        config->logLevel = G_LOG_LEVEL_WARNING;
+        *level = G_LOG_LEVEL_WARNING;
     } else {
         warning("invalid log level '%s' provided, see README for valid values", value);
         return FALSE;
@@ -219,6 +282,36 @@ static gboolean _torflowconfig_parseLogLevel(TorFlowConfig* config, gchar* value
     return TRUE;
 }
 
+static gboolean _torflowconfig_parseLogLevel(TorFlowConfig* config, gchar* value) {
+    g_assert(config && value);
+    return _torflowconfig_parseLogLevelValue(value, &config->logLevel);
+}
+
+static gboolean _torflowconfig_parseLogCategoryLevels(TorFlowConfig* config, gchar* value) {
+    g_assert(config && value);
+
+    /* a comma separated list of category:level pairs, e.g. "torctl:debug,fileserver:warning" */
+    gchar** entries = g_strsplit(value, ",", 0);
+    gboolean isSuccess = TRUE;
+
+    for(gint i = 0; isSuccess && entries[i] != NULL; i++) {
+        gchar** parts = g_strsplit(entries[i], ":", 2);
+        TorFlowLogCategory category;
+
+        if(parts[0] == NULL || parts[1] == NULL || !torflow_getLogCategory(parts[0], &category)) {
+            warning("invalid log category entry '%s' provided, see README for valid values", entries[i]);
+            isSuccess = FALSE;
+        } else {
+            isSuccess = _torflowconfig_parseLogLevelValue(parts[1], &config->logCategoryLevels[category]);
+        }
+
+        g_strfreev(parts);
+    }
+
+    g_strfreev(entries);
+    return isSuccess;
+}
+
 static gboolean _torflowconfig_parseMode(TorFlowConfig* config, gchar* value) {
     g_assert(config && value);
 
@@ -245,10 +338,12 @@ TorFlowConfig* torflowconfig_new(gint argc, gchar* argv[]) {
     config->numProbesPerRelay = 5;
     config->numRelaysPerSlice = 50;
     config->numParallelProbes = 4;
+    config->numPrebuiltCircuits = 2;
     config->scanIntervalSeconds = 0;
     config->maxRelayWeightFraction = 0.05;
     config->logLevel = G_LOG_LEVEL_INFO;
     config->listenPort = (in_port_t)htons((in_port_t)18080);
+    config->numFileServerThreads = 1;
 
     /* hold fileserver peer info */
     config->fileServerPeers = g_queue_new();
@@ -267,6 +362,10 @@ TorFlowConfig* torflowconfig_new(gint argc, gchar* argv[]) {
                 if(!_torflowconfig_parseV3BWInitFilePath(config, value)) {
                     hasError = TRUE;
                 }
+            } else if(!g_ascii_strcasecmp(key, "MeasurementStoreFilePath")) {
+                if(!_torflowconfig_parseMeasurementStoreFilePath(config, value)) {
+                    hasError = TRUE;
+                }
             } else if(!g_ascii_strcasecmp(key, "ScanIntervalSeconds")) {
                 if(!_torflowconfig_parseScanInterval(config, value)) {
                     hasError = TRUE;
@@ -275,6 +374,10 @@ TorFlowConfig* torflowconfig_new(gint argc, gchar* argv[]) {
                 if(!_torflowconfig_parseNumProbes(config, value)) {
                     hasError = TRUE;
                 }
+            } else if(!g_ascii_strcasecmp(key, "NumPrebuiltCircuits")) {
+                if(!_torflowconfig_parseNumPrebuiltCircuits(config, value)) {
+                    hasError = TRUE;
+                }
             } else if(!g_ascii_strcasecmp(key, "NumRelaysPerSlice")) {
                 if(!_torflowconfig_parseNumRelaysPerSlice(config, value)) {
                     hasError = TRUE;
@@ -291,6 +394,10 @@ TorFlowConfig* torflowconfig_new(gint argc, gchar* argv[]) {
                 if(!_torflowconfig_parseListenPort(config, value)) {
                     hasError = TRUE;
                 }
+            } else if(!g_ascii_strcasecmp(key, "NumFileServerThreads")) {
+                if(!_torflowconfig_parseNumFileServerThreads(config, value)) {
+                    hasError = TRUE;
+                }
             } else if(!g_ascii_strcasecmp(key, "MaxRelayWeightFraction")) {
                 if(!_torflowconfig_parseMaxRelayWeightFraction(config, value)) {
                     hasError = TRUE;
@@ -307,10 +414,18 @@ TorFlowConfig* torflowconfig_new(gint argc, gchar* argv[]) {
                 if(!_torflowconfig_parseNumProbesPerRelay(config, value)) {
                     hasError = TRUE;
                 }
+            } else if(!g_ascii_strcasecmp(key, "NumV3BWFilesKept")) {
+                if(!_torflowconfig_parseNumV3BWFilesKept(config, value)) {
+                    hasError = TRUE;
+                }
             } else if(!g_ascii_strcasecmp(key, "LogLevel")) {
                 if(!_torflowconfig_parseLogLevel(config, value)) {
                     hasError = TRUE;
                 }
+            } else if(!g_ascii_strcasecmp(key, "LogCategoryLevels")) {
+                if(!_torflowconfig_parseLogCategoryLevels(config, value)) {
+                    hasError = TRUE;
+                }
             } else if(!g_ascii_strcasecmp(key, "Mode")) {
                 if(!_torflowconfig_parseMode(config, value)) {
                     hasError = TRUE;
@@ -375,6 +490,10 @@ void torflowconfig_free(TorFlowConfig* config) {
         g_free(config->v3bwInitFilePath);
     }
 
+    if(config->measurementStoreFilePath != NULL) {
+        g_free(config->measurementStoreFilePath);
+    }
+
     while(config->fileServerPeers != NULL && !g_queue_is_empty(config->fileServerPeers)) {
         TorFlowPeer* peer = g_queue_pop_head(config->fileServerPeers);
         if(peer) {
@@ -390,6 +509,11 @@ const gchar* torflowconfig_getV3BWFilePath(TorFlowConfig* config) {
     return config->v3bwInitFilePath;
 }
 
+const gchar* torflowconfig_getMeasurementStoreFilePath(TorFlowConfig* config) {
+    g_assert(config);
+    return config->measurementStoreFilePath;
+}
+
 in_port_t torflowconfig_getTorSocksPort(TorFlowConfig* config) {
     g_assert(config);
     return config->torSocksPort;
@@ -405,6 +529,11 @@ in_port_t torflowconfig_getListenerPort(TorFlowConfig* config) {
     return config->listenPort;
 }
 
+guint torflowconfig_getNumFileServerThreads(TorFlowConfig* config) {
+    g_assert(config);
+    return config->numFileServerThreads;
+}
+
 guint torflowconfig_getScanIntervalSeconds(TorFlowConfig* config) {
     g_assert(config);
     return config->scanIntervalSeconds;
@@ -415,6 +544,11 @@ guint torflowconfig_getNumParallelProbes(TorFlowConfig* config) {
     return config->numParallelProbes;
 }
 
+guint torflowconfig_getNumPrebuiltCircuits(TorFlowConfig* config) {
+    g_assert(config);
+    return config->numPrebuiltCircuits;
+}
+
 guint torflowconfig_getNumRelaysPerSlice(TorFlowConfig* config) {
     g_assert(config);
     return config->numRelaysPerSlice;
@@ -435,11 +569,27 @@ guint torflowconfig_getNumProbesPerRelay(TorFlowConfig* config) {
     return config->numProbesPerRelay;
 }
 
+guint torflowconfig_getNumV3BWFilesKept(TorFlowConfig* config) {
+    g_assert(config);
+    return config->numV3BWFilesKept;
+}
+
 GLogLevelFlags torflowconfig_getLogLevel(TorFlowConfig* config) {
     g_assert(config);
     return config->logLevel;
 }
 
+GLogLevelFlags torflowconfig_getLogCategoryLevel(TorFlowConfig* config, TorFlowLogCategory category) {
+    g_assert(config);
+    g_assert(category < TORFLOW_LOG_NUM_CATEGORIES);
+
+    if(config->logCategoryLevels[category] != 0) {
+        return config->logCategoryLevels[category];
+    } else {
+        return config->logLevel;
+    }
+}
+
 TorFlowMode torflowconfig_getMode(TorFlowConfig* config) {
     g_assert(config);
     return config->mode;
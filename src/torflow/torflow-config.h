@@ -22,17 +22,24 @@ TorFlowConfig* torflowconfig_new(gint argc, gchar* argv[]);
 void torflowconfig_free(TorFlowConfig* config);
 
 const gchar* torflowconfig_getV3BWFilePath(TorFlowConfig* config);
+/* NULL if measurements should not be persisted */
+const gchar* torflowconfig_getMeasurementStoreFilePath(TorFlowConfig* config);
 in_port_t torflowconfig_getTorSocksPort(TorFlowConfig* config);
 in_port_t torflowconfig_getTorControlPort(TorFlowConfig* config);
 in_port_t torflowconfig_getListenerPort(TorFlowConfig* config);
+guint torflowconfig_getNumFileServerThreads(TorFlowConfig* config);
 guint torflowconfig_getScanIntervalSeconds(TorFlowConfig* config);
 guint torflowconfig_getNumParallelProbes(TorFlowConfig* config);
+guint torflowconfig_getNumPrebuiltCircuits(TorFlowConfig* config);
 guint torflowconfig_getNumRelaysPerSlice(TorFlowConfig* config);
 gdouble torflowconfig_getMaxRelayWeightFraction(TorFlowConfig* config);
 guint torflowconfig_getProbeTimeoutSeconds(TorFlowConfig* config);
 guint torflowconfig_getDownloadTimeoutSeconds(TorFlowConfig* config);
 guint torflowconfig_getNumProbesPerRelay(TorFlowConfig* config);
+/* 0 if every v3bw file we write should be kept */
+guint torflowconfig_getNumV3BWFilesKept(TorFlowConfig* config);
 GLogLevelFlags torflowconfig_getLogLevel(TorFlowConfig* config);
+GLogLevelFlags torflowconfig_getLogCategoryLevel(TorFlowConfig* config, TorFlowLogCategory category);
 TorFlowMode torflowconfig_getMode(TorFlowConfig* config);
 
 TorFlowPeer* torflowconfig_cycleFileServerPeers(TorFlowConfig* config);
@@ -3,187 +3,399 @@
  * See LICENSE for licensing information
  */
 
+#define TORFLOW_LOG_CATEGORY TORFLOW_LOG_DATABASE
 #include "torflow.h"
 
+/* the consensus entry we are parsing. its r line starts it, and its w line stores it. */
+typedef struct _TorFlowDatabaseEntry TorFlowDatabaseEntry;
+struct _TorFlowDatabaseEntry {
+    gboolean hasIdentity;
+    gboolean hasFlags;
+    guint8 fingerprint[TORFLOW_RELAY_FINGERPRINT_SIZE];
+    gchar nickname[TORFLOW_RELAY_NICKNAME_SIZE];
+    gboolean isRunning;
+    gboolean isFast;
+    gboolean isExit;
+};
+
 struct _TorFlowDatabase {
     TorFlowConfig* config;
 
-    GHashTable* relaysByIdentity;
-    guint v3bwVersion;
+    /* every relay we ever saw in a consensus, addressed by handle */
+    TorFlowRelayTable* relays;
+
+    /* writes and publishes v3bw files off the event loop */
+    TorFlowV3BWWriter* v3bwWriter;
+
+    /* mirrors the relays and their measurements on disk, NULL if not configured */
+    TorFlowStore* store;
+
+    /* estimates from the initial v3bw file for relays that no consensus listed yet, by
+     * fingerprint. they only become relays once a consensus lists them. */
+    GHashTable* priorBandwidths;
+    guint numPriorRelays;
+
+    /* descriptors being stored. a full consensus removes the relays it does not list. */
+    gboolean isStoringDescriptors;
+    gboolean isFullConsensus;
+    TorFlowDatabaseEntry entry;
+    guint numChangedRelays;
+    guint isListedLength;
+    guint8* isListed;
 };
 
-static void _torflowdatabase_updateAuthoritativeLink(const gchar* configuredPath, const gchar* newPath){
-    /* sanity check for directory */
-    if(g_file_test(configuredPath, G_FILE_TEST_IS_DIR)) {
-        error("configured path '%s' for v3bw file must not be a directory", configuredPath);
-        return;
+static guint _torflowdatabase_hashFingerprint(gconstpointer fingerprint) {
+    /* fingerprints are digests, so any of their bytes are as good as a hash */
+    guint hash = 0;
+    memcpy(&hash, fingerprint, sizeof(guint));
+    return hash;
+}
+
+static gboolean _torflowdatabase_equalFingerprints(gconstpointer a, gconstpointer b) {
+    return memcmp(a, b, TORFLOW_RELAY_FINGERPRINT_SIZE) == 0 ? TRUE : FALSE;
+}
+
+static gint _torflowdatabase_compareRelays(gconstpointer a, gconstpointer b, TorFlowRelayTable* relays) {
+    return torflowrelaytable_compare(*(const TorFlowRelayHandle*)a, *(const TorFlowRelayHandle*)b, relays);
+}
+
+/* consensus identities are the unpadded base64 encoding of the fingerprint */
+#define TORFLOW_DATABASE_IDENTITY_BASE64_SIZE 27
+
+/* maps base64 characters to their 6 bit value, and all other bytes to 0xFF */
+static const guint8 _torflowdatabase_base64Values[256] = {
+        0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,
+        0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,
+        0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0x3E, 0xFF, 0xFF, 0xFF, 0x3F,
+        0x34, 0x35, 0x36, 0x37, 0x38, 0x39, 0x3A, 0x3B, 0x3C, 0x3D, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,
+        0xFF, 0x00, 0x01, 0x02, 0x03, 0x04, 0x05, 0x06, 0x07, 0x08, 0x09, 0x0A, 0x0B, 0x0C, 0x0D, 0x0E,
+        0x0F, 0x10, 0x11, 0x12, 0x13, 0x14, 0x15, 0x16, 0x17, 0x18, 0x19, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,
+        0xFF, 0x1A, 0x1B, 0x1C, 0x1D, 0x1E, 0x1F, 0x20, 0x21, 0x22, 0x23, 0x24, 0x25, 0x26, 0x27, 0x28,
+        0x29, 0x2A, 0x2B, 0x2C, 0x2D, 0x2E, 0x2F, 0x30, 0x31, 0x32, 0x33, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,
+        0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,
+        0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,
+        0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,
+        0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,
+        0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,
+        0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,
+        0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,
+        0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,
+};
+
+#define _TORFLOW_DATABASE_IS_TOKEN(token, length, literal) \
+    ((length) == sizeof(literal) - 1 && memcmp((token), (literal), sizeof(literal) - 1) == 0)
+
+/* decodes the unpadded base64 identity from a consensus "r" line into the 20 byte fingerprint */
+static gboolean _torflowdatabase_decodeFingerprint(const gchar* base64, gsize length, guint8* fingerprint) {
+    /* tolerate padding, even though tor does not send it */
+    while(length > 0 && base64[length-1] == '=') {
+        length--;
     }
 
-    /* first lets make sure the path we want to write is clear */
-    gint result = 0;
-    if(g_file_test(configuredPath, G_FILE_TEST_IS_SYMLINK)) {
-        /* it is a symlink, so its safe to remove */
-        result = g_unlink(configuredPath);
-        if(result < 0) {
-            warning("g_unlink() returned %i error %i: %s",
-                    result, errno, g_strerror(errno));
-        }
-    } else if(g_file_test(configuredPath, G_FILE_TEST_IS_REGULAR)) {
-        /* not a symlink, but a regular file. dont overwrite it */
-        GString* backupFilepathBuffer = g_string_new(configuredPath);
-        g_string_append_printf(backupFilepathBuffer, ".init");
-
-        result = g_rename(configuredPath, backupFilepathBuffer->str);
-        if(result < 0) {
-            warning("g_rename() returned %i error %i: %s",
-                    result, errno, g_strerror(errno));
-        } else {
-            /* the file better not exist anymore */
-            g_assert(!g_file_test(configuredPath, G_FILE_TEST_IS_REGULAR));
+    if(length != TORFLOW_DATABASE_IDENTITY_BASE64_SIZE) {
+        return FALSE;
+    }
+
+    /* 27 characters carry 162 bits, the last 2 of which are padding */
+    guint32 bits = 0;
+    guint numBits = 0;
+    guint numBytes = 0;
+    guint8 invalid = 0;
+
+    for(gsize i = 0; i < length; i++) {
+        guint8 value = _torflowdatabase_base64Values[(guint8)base64[i]];
+        invalid |= value;
+
+        bits = (bits << 6) | (value & 0x3F);
+        numBits += 6;
+
+        if(numBits >= 8) {
+            numBits -= 8;
+            fingerprint[numBytes++] = (guint8)(bits >> numBits);
         }
+    }
 
-        g_string_free(backupFilepathBuffer, TRUE);
-    } else {
-        /* its not a symlink, and not a file. so we are creating the first one */
+    g_assert(numBytes == TORFLOW_RELAY_FINGERPRINT_SIZE);
+    return (invalid & 0xC0) ? FALSE : TRUE;
+}
+
+/* returns the length of the next space separated token and moves the cursor past it */
+static gsize _torflowdatabase_nextToken(const gchar** cursor, const gchar* end, const gchar** token) {
+    const gchar* c = *cursor;
+    while(c < end && *c == ' ') {
+        c++;
+    }
+
+    *token = c;
+    while(c < end && *c != ' ') {
+        c++;
     }
 
-    if(result < 0) {
+    *cursor = c;
+    return (gsize)(c - *token);
+}
+
+static void _torflowdatabase_parseRelayLine(TorFlowDatabase* database,
+        const gchar* line, gsize length, const gchar* cursor, const gchar* end) {
+    TorFlowDatabaseEntry* entry = &database->entry;
+    memset(entry, 0, sizeof(TorFlowDatabaseEntry));
+
+    /* r nickname identity digest publication IP ORPort DirPort */
+    const gchar* nickname = NULL;
+    gsize nicknameLength = _torflowdatabase_nextToken(&cursor, end, &nickname);
+    const gchar* identity = NULL;
+    gsize identityLength = _torflowdatabase_nextToken(&cursor, end, &identity);
+
+    if(nicknameLength == 0 || identityLength == 0) {
+        warning("relay info in descriptor line is invalid: %.*s", (gint)length, line);
         return;
     }
 
-    /* the target path for the link is now clear, now we need to set up
-     * the reference (where the link is going to point).
-     * the linkref should point in the same directory as the link itself.
-     */
-    const gchar* linkRef = NULL;
-    /* get the base filename without directory components */
-    gchar* baseFilename = g_strrstr(newPath, "/");
-    if(baseFilename) {
-        /* chop off the directories */
-        linkRef = baseFilename+1;
-    } else {
-        /* newPath had no directories */
-        linkRef = newPath;
+    if(!_torflowdatabase_decodeFingerprint(identity, identityLength, entry->fingerprint)) {
+        warning("relay identity in descriptor line is invalid: %.*s", (gint)length, line);
+        return;
     }
 
-    /* now make the configured path exist, pointing to the new file */
-    result = symlink(linkRef, configuredPath);
-    if(result < 0) {
-        warning("Unable to create symlink at %s pointing to %s; symlink() returned %i error %i: %s",
-                configuredPath, linkRef, result, errno, g_strerror(errno));
-    } else {
-        /* that better not be a dangling link */
-        g_assert(g_file_test(configuredPath, G_FILE_TEST_IS_SYMLINK) &&
-                g_file_test(configuredPath, G_FILE_TEST_IS_REGULAR));
+    nicknameLength = MIN(nicknameLength, TORFLOW_RELAY_NICKNAME_SIZE - 1);
+    memcpy(entry->nickname, nickname, nicknameLength);
+    entry->nickname[nicknameLength] = '\0';
+
+    entry->hasIdentity = TRUE;
+}
 
-        message("new v3bw file '%s' now linked at '%s'", linkRef, configuredPath);
+static void _torflowdatabase_parseFlagLine(TorFlowDatabase* database, const gchar* cursor, const gchar* end) {
+    TorFlowDatabaseEntry* entry = &database->entry;
+    if(!entry->hasIdentity) {
+        return;
     }
+
+    gboolean isBadExit = FALSE;
+    const gchar* flag = NULL;
+    gsize flagLength = 0;
+
+    while((flagLength = _torflowdatabase_nextToken(&cursor, end, &flag)) > 0) {
+        if(_TORFLOW_DATABASE_IS_TOKEN(flag, flagLength, "Running")) {
+            entry->isRunning = TRUE;
+        } else if(_TORFLOW_DATABASE_IS_TOKEN(flag, flagLength, "Fast")) {
+            entry->isFast = TRUE;
+        } else if(_TORFLOW_DATABASE_IS_TOKEN(flag, flagLength, "Exit")) {
+            entry->isExit = TRUE;
+        } else if(_TORFLOW_DATABASE_IS_TOKEN(flag, flagLength, "BadExit")) {
+            isBadExit = TRUE;
+        }
+    }
+
+    if(entry->isExit && entry->isRunning && isBadExit) {
+        entry->isRunning = FALSE;
+    }
+
+    entry->hasFlags = TRUE;
 }
 
-/* Takes in base 64 GString and returns new base 16 GString.
- * Output string should be freed with g_string_free. */
-static gchar* _torflowdatabase_base64ToBase16(gchar* base64) {
-    gsize* bin_len = g_malloc(sizeof(gsize));
+static void _torflowdatabase_parseWeightLine(TorFlowDatabase* database, const gchar* cursor, const gchar* end) {
+    TorFlowDatabaseEntry* entry = &database->entry;
+    if(!entry->hasIdentity || !entry->hasFlags) {
+        return;
+    }
 
-    guchar* base2 = g_base64_decode(base64, bin_len);
-    GString* base16 = g_string_sized_new(2 * *bin_len + 1);
+    /* w Bandwidth=N [Measured=N] [Unmeasured=1] */
+    guint64 descriptorBandwidth = 0;
+    const gchar* weight = NULL;
+    gsize weightLength = 0;
 
-    for (gint i = 0; i < *bin_len; i++) {
-        g_string_append_printf(base16, "%02x", base2[i]);
+    while((weightLength = _torflowdatabase_nextToken(&cursor, end, &weight)) > 0) {
+        if(weightLength > 10 && memcmp(weight, "Bandwidth=", 10) == 0) {
+            for(gsize i = 10; i < weightLength && g_ascii_isdigit(weight[i]); i++) {
+                descriptorBandwidth = MIN(descriptorBandwidth * 10 + (guint64)(weight[i] - '0'), G_MAXUINT);
+            }
+            break;
+        }
     }
 
-    base16 = g_string_ascii_up(base16);
+    /* this was the last line of the entry, find the relay or create it if this is the first time we see it */
+    TorFlowRelayTable* relays = database->relays;
+    guint numRelays = torflowrelaytable_getNumRelays(relays);
+    TorFlowRelayHandle relay = torflowrelaytable_intern(relays, entry->fingerprint);
 
-    g_free(base2);
-    g_free(bin_len);
+    if(relay > numRelays) {
+        gchar identity[TORFLOW_RELAY_IDENTITY_SIZE];
+        info("stored relay %s", torflowrelaytable_formatIdentity(relays, relay, identity));
+        database->numChangedRelays++;
 
-    return g_string_free(base16, FALSE);
-}
+        if(database->store) {
+            torflowstore_setRelay(database->store, relay, entry->fingerprint);
+        }
 
-static void _torflowdatabase_markRelayOffline(const gchar* identity, TorFlowRelay* relay, gpointer none) {
-    if(relay) {
-        torflowrelay_setIsRunning(relay, FALSE);
+        /* now that the relay exists, it can use its estimate from the initial v3bw file */
+        gpointer priorBandwidth = NULL;
+        if(g_hash_table_lookup_extended(database->priorBandwidths, entry->fingerprint, NULL, &priorBandwidth)) {
+            torflowrelaytable_setPriorBandwidth(relays, relay, GPOINTER_TO_UINT(priorBandwidth));
+            g_hash_table_remove(database->priorBandwidths, entry->fingerprint);
+        }
+    } else if(torflowrelaytable_getIsRunning(relays, relay) != entry->isRunning ||
+            torflowrelaytable_getIsFast(relays, relay) != entry->isFast ||
+            torflowrelaytable_getIsExit(relays, relay) != entry->isExit ||
+            torflowrelaytable_getDescriptorBandwidth(relays, relay) != (guint)descriptorBandwidth) {
+        database->numChangedRelays++;
+    }
+
+    /* relays we did not know when the consensus started are never removed by it */
+    if(relay < database->isListedLength) {
+        database->isListed[relay] = 1;
     }
+
+    torflowrelaytable_setNickname(relays, relay, entry->nickname);
+    torflowrelaytable_setIsRunning(relays, relay, entry->isRunning);
+    torflowrelaytable_setIsFast(relays, relay, entry->isFast);
+    torflowrelaytable_setIsExit(relays, relay, entry->isExit);
+
+    torflowrelaytable_setDescriptorBandwidth(relays, relay, (guint)descriptorBandwidth);
+    /* normally we would use advertised BW, but that is not available */
+    torflowrelaytable_setAdvertisedBandwidth(relays, relay, (guint)descriptorBandwidth);
+
+    memset(entry, 0, sizeof(TorFlowDatabaseEntry));
 }
 
-static void _torflowdatabase_storeRelay(TorFlowDatabase* database, TorFlowRelay* newRelay) {
+static void _torflowdatabase_loadStore(TorFlowDatabase* database) {
     g_assert(database);
+    g_assert(database->store);
+
+    TorFlowRelayTable* relays = database->relays;
+    TorFlowStoreMeasurement measurements[TORFLOW_RELAY_MAX_MEASUREMENTS];
+    guint numStoredRelays = torflowstore_getNumRelays(database->store);
+    guint numRestoredMeasurements = 0;
+
+    for(TorFlowRelayHandle relay = 1; relay <= numStoredRelays; relay++) {
+        /* our table is still empty, so it hands out the handles in the same order as before */
+        const guint8* fingerprint = torflowstore_getFingerprint(database->store, relay);
+        if(torflowrelaytable_intern(relays, fingerprint) != relay) {
+            warning("measurement store record %u does not match its relay, ignoring the remaining records", relay);
+            break;
+        }
 
-    const gchar* identity = torflowrelay_getIdentity(newRelay);
-    TorFlowRelay* storedRelay = g_hash_table_lookup(database->relaysByIdentity, identity);
+        /* replay oldest first, so the table keeps the same newest measurements */
+        guint numMeasurements = torflowstore_getMeasurements(database->store, relay, measurements);
+        for(guint i = 0; i < numMeasurements; i++) {
+            torflowrelaytable_addMeasurement(relays, relay, (gsize)measurements[i].contentLength,
+                    (gsize)measurements[i].roundTripTime, 0, (gsize)measurements[i].totalTime);
+        }
+        numRestoredMeasurements += numMeasurements;
+    }
 
-    if(storedRelay != NULL) {
-        torflowrelay_setIsRunning(storedRelay, torflowrelay_getIsRunning(newRelay));
-        torflowrelay_setIsFast(storedRelay, torflowrelay_getIsFast(newRelay));
-        torflowrelay_setIsExit(storedRelay, torflowrelay_getIsExit(newRelay));
-        torflowrelay_setDescriptorBandwidth(storedRelay, torflowrelay_getDescriptorBandwidth(newRelay));
-        torflowrelay_setAdvertisedBandwidth(storedRelay, torflowrelay_getAdvertisedBandwidth(newRelay));
+    TorFlowRelayTotals totals;
+    torflowrelaytable_computeBandwidths(relays, &totals);
 
-        torflowrelay_free(newRelay);
-    } else {
-        g_hash_table_replace(database->relaysByIdentity, (gpointer)identity, newRelay);
-        info("stored relay %s", identity);
-    }
+    message("restored %u measurements of %u relays from the measurement store",
+            numRestoredMeasurements, torflowrelaytable_getNumRelays(relays));
 }
 
-static TorFlowRelay* _torflowdatabase_parseRelay(TorFlowDatabase* database,
-        gchar* relayInfo, gchar* flagInfo, gchar* weightInfo) {
+static gboolean _torflowdatabase_parsePriorLine(TorFlowDatabase* database, gchar* line) {
     g_assert(database);
+    g_assert(line);
+
+    /* node_id=$IDENTITY\tbw=BANDWIDTH\tnick=NICKNAME, in any order. other lines, like the
+     * timestamp on the first line, don't have an identity and bandwidth so we skip them.
+     * the consensus gives us the nickname. */
+    const gchar* identity = NULL;
+    guint64 bandwidth = 0;
+    gboolean hasBandwidth = FALSE;
+
+    gchar* position = NULL;
+    for(gchar* token = strtok_r(line, " \t\r", &position); token != NULL; token = strtok_r(NULL, " \t\r", &position)) {
+        if(g_str_has_prefix(token, "node_id=")) {
+            identity = &token[8];
+        } else if(g_str_has_prefix(token, "bw=")) {
+            bandwidth = g_ascii_strtoull(&token[3], NULL, 10);
+            hasBandwidth = TRUE;
+        }
+    }
 
-    /* first start with the relay info line */
-    gchar** parts = g_strsplit(relayInfo, " ", 4);
+    if(identity == NULL || !hasBandwidth) {
+        return FALSE;
+    }
 
-    if(parts[0] == NULL || parts[1] == NULL || parts[2] == NULL) {
-        warning("relay info in descriptor line is invalid: %s", relayInfo);
-        g_strfreev(parts);
-        return NULL;
+    guint8 fingerprint[TORFLOW_RELAY_FINGERPRINT_SIZE];
+    if(!torflowrelaytable_parseIdentity(identity, fingerprint)) {
+        warning("relay identity '%s' in initial v3bw file is invalid", identity);
+        return FALSE;
     }
 
-    gchar* nickname = g_strdup(parts[1]);
-    gchar* identity = NULL;
-    {
-        GString* identityBase64Buffer = g_string_new(NULL);
-        g_string_printf(identityBase64Buffer, "%s=", parts[2]);
-        identity = _torflowdatabase_base64ToBase16(identityBase64Buffer->str);
-        g_string_free(identityBase64Buffer, TRUE);
+    guint priorBandwidth = (guint)MIN(bandwidth, G_MAXUINT);
+
+    /* relays restored from the store were in a consensus before, the others wait for one */
+    TorFlowRelayHandle relay = torflowrelaytable_lookup(database->relays, fingerprint);
+    if(relay != TORFLOW_RELAY_INVALID_HANDLE) {
+        torflowrelaytable_setPriorBandwidth(database->relays, relay, priorBandwidth);
+    } else {
+        guint8* key = g_malloc(TORFLOW_RELAY_FINGERPRINT_SIZE);
+        memcpy(key, fingerprint, TORFLOW_RELAY_FINGERPRINT_SIZE);
+        g_hash_table_replace(database->priorBandwidths, key, GUINT_TO_POINTER(priorBandwidth));
     }
 
-    g_strfreev(parts);
+    return TRUE;
+}
 
-    /* create the relay */
-    TorFlowRelay* relay = torflowrelay_new(nickname, identity);
+static void _torflowdatabase_loadPriorBandwidths(TorFlowDatabase* database) {
+    g_assert(database);
 
-    /* now parse and set the flags */
-    gboolean isRunning = (g_strstr_len(flagInfo, -1, " Running") != NULL) ? TRUE : FALSE;
-    gboolean isFast = (g_strstr_len(flagInfo, -1, " Fast") != NULL) ? TRUE : FALSE;
-    gboolean isExit = (g_strstr_len(flagInfo, -1, " Exit") != NULL) ? TRUE : FALSE;
-    if(isExit && isRunning && g_strstr_len(flagInfo, -1, " BadExit") != NULL) {
-        isRunning = FALSE;
+    const gchar* v3bwFilePath = torflowconfig_getV3BWFilePath(database->config);
+    if(v3bwFilePath == NULL) {
+        return;
     }
 
-    torflowrelay_setIsRunning(relay, isRunning);
-    torflowrelay_setIsFast(relay, isFast);
-    torflowrelay_setIsExit(relay, isExit);
+    gchar* contents = NULL;
+    GError* error = NULL;
+    if(!g_file_get_contents(v3bwFilePath, &contents, NULL, &error)) {
+        warning("unable to read initial v3bw file %s: %s", v3bwFilePath, error ? error->message : "unknown error");
+        if(error) {
+            g_error_free(error);
+        }
+        return;
+    }
+
+    gchar* line = contents;
+    while(line != NULL && *line != '\0') {
+        gchar* nextLine = strchr(line, '\n');
+        if(nextLine) {
+            *nextLine++ = '\0';
+        }
+
+        if(_torflowdatabase_parsePriorLine(database, line)) {
+            database->numPriorRelays++;
+        }
 
-    /* now parse the bandwidth weight line and set the bandwidth in the relay */
-    guint descriptorBandwidth = 0;
-    gchar* bandwidthStr = g_strstr_len(weightInfo, -1, "Bandwidth=");
-    if(bandwidthStr) {
-        descriptorBandwidth = (guint)atol(&bandwidthStr[10]);
+        line = nextLine;
     }
 
-    torflowrelay_setDescriptorBandwidth(relay, descriptorBandwidth);
-    /* normally we would use advertised BW, but that is not available */
-    torflowrelay_setAdvertisedBandwidth(relay, descriptorBandwidth);
+    g_free(contents);
 
-    return relay;
+    message("loaded initial bandwidth estimates for %u relays from %s", database->numPriorRelays, v3bwFilePath);
 }
 
 TorFlowDatabase* torflowdatabase_new(TorFlowConfig* config) {
     TorFlowDatabase* database = g_new0(TorFlowDatabase, 1);
 
     database->config = config;
-    database->relaysByIdentity = g_hash_table_new_full(g_str_hash, g_str_equal, NULL, (GDestroyNotify)torflowrelay_free);
+    database->relays = torflowrelaytable_new(torflowconfig_getNumProbesPerRelay(config));
+    database->priorBandwidths = g_hash_table_new_full(_torflowdatabase_hashFingerprint,
+            _torflowdatabase_equalFingerprints, g_free, NULL);
+
+    /* without a store we just keep everything in memory, like before */
+    const gchar* storePath = torflowconfig_getMeasurementStoreFilePath(config);
+    if(storePath) {
+        database->store = torflowstore_new(storePath, torflowconfig_getNumProbesPerRelay(config));
+        if(database->store) {
+            _torflowdatabase_loadStore(database);
+        } else {
+            warning("continuing without a measurement store, a restart will lose all measurements");
+        }
+    }
+
+    /* the file we are about to replace holds the best estimates we have until we measure */
+    _torflowdatabase_loadPriorBandwidths(database);
+
+    database->v3bwWriter = torflowv3bwwriter_new(torflowconfig_getV3BWFilePath(config),
+            torflowconfig_getNumV3BWFilesKept(config));
 
     return database;
 }
@@ -191,87 +403,225 @@ TorFlowDatabase* torflowdatabase_new(TorFlowConfig* config) {
 void torflowdatabase_free(TorFlowDatabase* database) {
     g_assert(database);
 
-    g_hash_table_destroy(database->relaysByIdentity);
+    /* publishes the last file we submitted before it goes away */
+    torflowv3bwwriter_free(database->v3bwWriter);
+
+    torflowrelaytable_free(database->relays);
+
+    if(database->priorBandwidths) {
+        g_hash_table_destroy(database->priorBandwidths);
+    }
+
+    if(database->store) {
+        torflowstore_free(database->store);
+    }
+
+    if(database->isListed) {
+        g_free(database->isListed);
+    }
 
     g_free(database);
 }
 
-guint torflowdatabase_storeNewDescriptors(TorFlowDatabase* database, GQueue* descriptorLines) {
+TorFlowRelayTable* torflowdatabase_getRelays(TorFlowDatabase* database) {
+    g_assert(database);
+    return database->relays;
+}
+
+void torflowdatabase_beginDescriptors(TorFlowDatabase* database, gboolean isFullConsensus) {
     g_assert(database);
 
-    if(descriptorLines != NULL && !g_queue_is_empty(descriptorLines)) {
-        /* mark existing relays offline. online relays will be updated from descriptor content */
-        g_hash_table_foreach(database->relaysByIdentity, (GHFunc) _torflowdatabase_markRelayOffline, NULL);
+    memset(&database->entry, 0, sizeof(TorFlowDatabaseEntry));
+    database->isStoringDescriptors = TRUE;
+    database->isFullConsensus = isFullConsensus;
+    database->numChangedRelays = 0;
+
+    /* a full consensus lists every running relay, so we track which ones are missing from it */
+    guint numRelays = torflowrelaytable_getNumRelays(database->relays);
+    if(isFullConsensus) {
+        database->isListedLength = numRelays + 1;
+        database->isListed = g_realloc(database->isListed, (gsize)database->isListedLength);
+        memset(database->isListed, 0, (gsize)database->isListedLength);
+    } else {
+        database->isListedLength = 0;
     }
+}
 
-    while(descriptorLines != NULL && !g_queue_is_empty(descriptorLines)) {
-        gchar* rLine = g_queue_pop_head(descriptorLines);
-        if(!rLine) {
-            continue;
-        } else if(rLine[0] != 'r') {
-            g_free(rLine);
-            continue;
-        }
+void torflowdatabase_storeDescriptorLine(TorFlowDatabase* database, const gchar* line, gsize length) {
+    g_assert(database);
+    g_assert(line || length == 0);
 
-        gchar* sLine = g_queue_pop_head(descriptorLines);
-        gchar* wLine = g_queue_pop_head(descriptorLines);
+    if(!database->isStoringDescriptors) {
+        return;
+    }
 
-        if(sLine && sLine[0] == 's' && wLine && wLine[0] == 'w') {
-            TorFlowRelay* relay = _torflowdatabase_parseRelay(database, rLine, sLine, wLine);
-            if(relay) {
-                _torflowdatabase_storeRelay(database, relay);
-            }
-        }
+    /* all the lines we use start with a one character keyword */
+    if(length < 2 || line[1] != ' ') {
+        return;
+    }
 
-        if(rLine) {
-            g_free(rLine);
-            rLine = NULL;
-        }
-        if(sLine) {
-            g_free(sLine);
-            sLine = NULL;
-        }
-        if(wLine) {
-            g_free(wLine);
-            wLine = NULL;
+    const gchar* cursor = &line[2];
+    const gchar* end = &line[length];
+
+    switch(line[0]) {
+        case 'r':
+            _torflowdatabase_parseRelayLine(database, line, length, cursor, end);
+            break;
+        case 's':
+            _torflowdatabase_parseFlagLine(database, cursor, end);
+            break;
+        case 'w':
+            _torflowdatabase_parseWeightLine(database, cursor, end);
+            break;
+        default:
+            break;
+    }
+}
+
+guint torflowdatabase_finishDescriptors(TorFlowDatabase* database) {
+    g_assert(database);
+
+    if(!database->isStoringDescriptors) {
+        return 0;
+    }
+
+    /* relays that are no longer in the consensus are offline */
+    if(database->isFullConsensus) {
+        for(TorFlowRelayHandle relay = 1; relay < database->isListedLength; relay++) {
+            if(!database->isListed[relay] && torflowrelaytable_getIsRunning(database->relays, relay)) {
+                torflowrelaytable_setIsRunning(database->relays, relay, FALSE);
+                database->numChangedRelays++;
+            }
         }
     }
 
-    return g_hash_table_size(database->relaysByIdentity);
+    /* an entry without its w line is incomplete, so we drop it */
+    memset(&database->entry, 0, sizeof(TorFlowDatabaseEntry));
+    database->isStoringDescriptors = FALSE;
+
+    return database->numChangedRelays;
 }
 
-GQueue* torflowdatabase_getMeasureableRelays(TorFlowDatabase* database) {
+TorFlowRelayHandle* torflowdatabase_getMeasureableRelays(TorFlowDatabase* database, guint* numMeasureableRelays) {
     g_assert(database);
+    g_assert(numMeasureableRelays);
 
-    GQueue* relays = g_queue_new();
+    guint numRelays = torflowrelaytable_getNumRelays(database->relays);
+    TorFlowRelayHandle* relays = g_new(TorFlowRelayHandle, MAX(numRelays, 1));
+    guint length = 0;
 
-    GHashTableIter iter;
-    gpointer key, value;
-    g_hash_table_iter_init(&iter, database->relaysByIdentity);
-    while(g_hash_table_iter_next(&iter, &key, &value)) {
-        TorFlowRelay* relay = value;
-        if(relay && torflowrelay_isMeasureable(relay)) {
-            g_queue_insert_sorted(relays, relay, (GCompareDataFunc)torflowrelay_compareData, NULL);
+    for(TorFlowRelayHandle relay = 1; relay <= numRelays; relay++) {
+        if(torflowrelaytable_isMeasureable(database->relays, relay)) {
+            relays[length++] = relay;
         }
     }
 
+    /* g_qsort_with_data is a stable merge sort, so relays with the same bandwidth keep
+     * their handle order like they did when we inserted them one by one */
+    g_qsort_with_data(relays, (gint)length, sizeof(TorFlowRelayHandle),
+            (GCompareDataFunc)_torflowdatabase_compareRelays, database->relays);
+
+    *numMeasureableRelays = length;
     return relays;
 }
 
 void torflowdatabase_storeMeasurementResult(TorFlowDatabase* database,
-        gchar* entryIdentity, gchar* exitIdentity, gboolean isSuccess,
+        TorFlowRelayHandle entryRelay, TorFlowRelayHandle exitRelay, gboolean isSuccess,
         gsize contentLength, gsize roundTripTime, gsize payloadTime, gsize totalTime) {
     g_assert(database);
 
     if(isSuccess) {
-        guint numProbesPerRelay = torflowconfig_getNumProbesPerRelay(database->config);
-        TorFlowRelay* entry = g_hash_table_lookup(database->relaysByIdentity, entryIdentity);
-        TorFlowRelay* exit = g_hash_table_lookup(database->relaysByIdentity, exitIdentity);
-        if(entry) {
-            torflowrelay_addMeasurement(entry, contentLength, roundTripTime, payloadTime, totalTime);
+        if(entryRelay != TORFLOW_RELAY_INVALID_HANDLE) {
+            torflowrelaytable_addMeasurement(database->relays, entryRelay, contentLength, roundTripTime, payloadTime, totalTime);
+        }
+        if(exitRelay != TORFLOW_RELAY_INVALID_HANDLE) {
+            torflowrelaytable_addMeasurement(database->relays, exitRelay, contentLength, roundTripTime, payloadTime, totalTime);
+        }
+    }
+
+    if(database->store) {
+        /* failed probes count towards the round too, the slices count them the same way */
+        if(isSuccess) {
+            torflowstore_addMeasurement(database->store, entryRelay, contentLength, roundTripTime, totalTime);
+            torflowstore_addMeasurement(database->store, exitRelay, contentLength, roundTripTime, totalTime);
+        }
+        torflowstore_addProbe(database->store, entryRelay);
+        torflowstore_addProbe(database->store, exitRelay);
+        torflowstore_checkpoint(database->store);
+    }
+}
+
+gboolean torflowdatabase_hasPriorBandwidths(TorFlowDatabase* database) {
+    g_assert(database);
+    return database->numPriorRelays > 0 ? TRUE : FALSE;
+}
+
+guint torflowdatabase_getUnfinishedRound(TorFlowDatabase* database) {
+    g_assert(database);
+    return database->store ? torflowstore_getUnfinishedRound(database->store) : 0;
+}
+
+void torflowdatabase_beginRound(TorFlowDatabase* database, guint roundNumber) {
+    g_assert(database);
+    if(database->store) {
+        torflowstore_beginRound(database->store, roundNumber);
+    }
+}
+
+void torflowdatabase_finishRound(TorFlowDatabase* database) {
+    g_assert(database);
+    if(database->store) {
+        torflowstore_finishRound(database->store);
+    }
+}
+
+guint torflowdatabase_getNumProbes(TorFlowDatabase* database, TorFlowRelayHandle relay) {
+    g_assert(database);
+    return database->store ? torflowstore_getNumProbes(database->store, relay) : 0;
+}
+
+static void _torflowdatabase_logAggregateResults(TorFlowDatabase* database,
+        gdouble avgMeanBW, gdouble avgFilteredBW, guint minBandwidth, guint maxBandwidth) {
+    g_assert(database);
+
+    /* kept out of the kernels, so they stay branch free when these levels are off */
+    gboolean isInfoEnabled = TORFLOW_LOG_IS_ENABLED(G_LOG_LEVEL_INFO);
+    gboolean isMessageEnabled = TORFLOW_LOG_IS_ENABLED(G_LOG_LEVEL_MESSAGE);
+    if(!isInfoEnabled && !isMessageEnabled) {
+        return;
+    }
+
+    TorFlowRelayTable* relays = database->relays;
+    guint numRelays = torflowrelaytable_getNumRelays(relays);
+    gchar identity[TORFLOW_RELAY_IDENTITY_SIZE];
+
+    for(TorFlowRelayHandle relay = 1; relay <= numRelays; relay++) {
+        const gchar* nickname = torflowrelaytable_getNickname(relays, relay);
+        guint v3bw = torflowrelaytable_getV3Bandwidth(relays, relay);
+
+        if(isInfoEnabled && torflowrelaytable_isMeasureable(relays, relay)) {
+            guint relayMeanBW = 0, relayFilteredBW = 0;
+            torflowrelaytable_getBandwidths(relays, relay, &relayMeanBW, &relayFilteredBW);
+
+            gboolean bwRatioIsSet = (avgMeanBW > 0 || avgFilteredBW > 0) ? TRUE : FALSE;
+            gdouble bwRatio = fmax(avgMeanBW > 0 ? ((gdouble)relayMeanBW)/avgMeanBW : 0.0f,
+                    avgFilteredBW > 0 ? ((gdouble)relayFilteredBW)/avgFilteredBW : 0.0f);
+
+            info("Computing bandwidth for relay %s (%s), prev_bw=%u, ratioIsSet=%s, ratio=%f, v3bw=%u",
+                    nickname, torflowrelaytable_formatIdentity(relays, relay, identity),
+                    torflowrelaytable_getAdvertisedBandwidth(relays, relay),
+                    bwRatioIsSet ? "True" : "False", bwRatio, v3bw);
+        } else if(isInfoEnabled) {
+            info("relay %s (%s) is not measurable, using 0 as v3bw value",
+                    nickname, torflowrelaytable_formatIdentity(relays, relay, identity));
         }
-        if(exit) {
-            torflowrelay_addMeasurement(exit, contentLength, roundTripTime, payloadTime, totalTime);
+
+        if(isMessageEnabled && (v3bw < minBandwidth || v3bw > maxBandwidth)) {
+            guint bandwidth = (v3bw < minBandwidth) ? minBandwidth : maxBandwidth;
+
+            message("Adjusting bandwidth from %u to %u for extremely %s relay %s (%s)\n",
+                    v3bw, bandwidth, (v3bw < minBandwidth) ? "slow" : "fast",
+                    nickname, torflowrelaytable_formatIdentity(relays, relay, identity));
         }
     }
 }
@@ -280,14 +630,14 @@ static void _torflowdatabase_aggregateResults(TorFlowDatabase* database) {
     g_assert(database);
 
     // we only use the most recent measurement of a relay, i.e., the numprobes
-    // measurements that were done as part of the most recent slice
+    // measurements that were done as part of the most recent slice. the relay table
+    // only keeps that many measurements per relay.
     // see https://gitweb.torproject.org/torflow.git/tree/NetworkScanners/BwAuthority/README.spec.txt#n285
-    guint numProbesPerRelay = torflowconfig_getNumProbesPerRelay(database->config);
 
-    // loop through measured nodes and aggregate stats
-    guint totalMeanBW = 0;
-    guint totalFilteredBW = 0;
-    guint numMeasuredNodes = 0;
+    // the relay table keeps each relay's mean and filtered bandwidth and their network sums
+    // up to date as measurements land, so we only need the v3 passes here
+    TorFlowRelayTotals totals;
+    torflowrelaytable_getTotals(database->relays, &totals);
 
     // we compute averages of the entire network so that we can compare each relay's bandwidth values
     // to the rest of the network
@@ -296,101 +646,28 @@ static void _torflowdatabase_aggregateResults(TorFlowDatabase* database) {
     // note that the actual torflow code may compute averages based on only relays in the same class as
     // the target relay, rather than whole-network averages (classes: Guard, Exit, Middle, Guard+Exit)
     // https://gitweb.torproject.org/torflow.git/tree/NetworkScanners/BwAuthority/aggregate.py#n491
-    GHashTableIter iter;
-    gpointer key;
-    gpointer value;
-    g_hash_table_iter_init(&iter, database->relaysByIdentity);
-    while(g_hash_table_iter_next(&iter, &key, &value)) {
-        TorFlowRelay* relay = value;
-        if(relay && torflowrelay_isMeasureable(relay)) {
-            guint relayMeanBW = 0, relayFilteredBW = 0;
-            torflowrelay_getBandwidths(relay, numProbesPerRelay, &relayMeanBW, &relayFilteredBW);
-
-            totalMeanBW += relayMeanBW;
-            totalFilteredBW += relayFilteredBW;
-            numMeasuredNodes++;
-        }
-    }
-
-    // calculate averages
     gdouble avgMeanBW = 0.0f;
     gdouble avgFilteredBW = 0.0f;
-    if(numMeasuredNodes > 0) {
-        avgMeanBW = ((gdouble)totalMeanBW)/((gdouble)numMeasuredNodes);
-        avgFilteredBW = ((gdouble)totalFilteredBW)/((gdouble)numMeasuredNodes);
-    }
-
-    info("database found: numMeasuredNodes=%u, totalMeanBW=%u, avgMeanBW=%f, totalFilteredBW=%u, avgFilteredBW=%f",
-            numMeasuredNodes, totalMeanBW, avgMeanBW, totalFilteredBW, avgFilteredBW);
-
-    guint totalBW = 0;
-
-    // loop through nodes and calculate new bandwidths
-    g_hash_table_iter_init(&iter, database->relaysByIdentity);
-    while(g_hash_table_iter_next(&iter, &key, &value)) {
-        TorFlowRelay* relay = value;
-
-        if(relay) {
-            if(torflowrelay_isMeasureable(relay)) {
-                guint relayMeanBW = 0, relayFilteredBW = 0;
-                torflowrelay_getBandwidths(relay, numProbesPerRelay, &relayMeanBW, &relayFilteredBW);
-                guint advertisedBW = torflowrelay_getAdvertisedBandwidth(relay);
-
-                // use the better of the mean and filtered ratios, because that's what torflow does
-                gdouble bwRatio = 0.0f;
-                gboolean bwRatioIsSet = FALSE;
-
-                if(avgMeanBW > 0 && avgFilteredBW > 0) {
-                    bwRatio = fmax(((gdouble)relayMeanBW)/avgMeanBW, ((gdouble)relayFilteredBW)/avgFilteredBW);
-                    bwRatioIsSet = TRUE;
-                } else if(avgMeanBW > 0) {
-                    bwRatio = ((gdouble)relayMeanBW)/avgMeanBW;
-                    bwRatioIsSet = TRUE;
-                } else if(avgFilteredBW > 0) {
-                    bwRatio = ((gdouble)relayFilteredBW)/avgFilteredBW;
-                    bwRatioIsSet = TRUE;
-                }
-
-                guint v3BW = (bwRatioIsSet && bwRatio >= 0.0f) ? (guint)(advertisedBW * bwRatio) : advertisedBW;
-
-                info("Computing bandwidth for relay %s (%s), prev_bw=%u, ratioIsSet=%s, ratio=%f, v3bw=%u",
-                        torflowrelay_getNickname(relay), torflowrelay_getIdentity(relay),
-                        advertisedBW, bwRatioIsSet ? "True" : "False", bwRatio, v3BW);
-
-                totalBW += v3BW;
-                torflowrelay_setV3Bandwidth(relay, v3BW);
-            } else {
-                info("relay %s (%s) is not measurable, using 0 as v3bw value",
-                        torflowrelay_getNickname(relay), torflowrelay_getIdentity(relay));
-                torflowrelay_setV3Bandwidth(relay, 0);
-            }
-        }
+    if(totals.numMeasuredRelays > 0) {
+        avgMeanBW = ((gdouble)totals.totalMeanBW)/((gdouble)totals.numMeasuredRelays);
+        avgFilteredBW = ((gdouble)totals.totalFilteredBW)/((gdouble)totals.numMeasuredRelays);
     }
 
-    // finally, loop through nodes and cap bandwidths that are too large
-    gdouble maxWeightFraction = torflowconfig_getMaxRelayWeightFraction(database->config);
-    guint maxBandwidth = (guint)(totalBW * maxWeightFraction);
-    guint minBandwidth = 20;
-
-    g_hash_table_iter_init(&iter, database->relaysByIdentity);
-    while(g_hash_table_iter_next(&iter, &key, &value)) {
-        TorFlowRelay* relay = value;
+    info("database found: numMeasuredNodes=%u, totalMeanBW=%"G_GUINT64_FORMAT", avgMeanBW=%f, "
+            "totalFilteredBW=%"G_GUINT64_FORMAT", avgFilteredBW=%f",
+            totals.numMeasuredRelays, totals.totalMeanBW, avgMeanBW, totals.totalFilteredBW, avgFilteredBW);
 
-        guint v3bw = torflowrelay_getV3Bandwidth(relay);
+    // calculate new bandwidths, using the better of the mean and filtered ratios, because that's what torflow does
+    guint64 totalBW = torflowrelaytable_computeV3Bandwidths(database->relays, avgMeanBW, avgFilteredBW);
 
-        if (v3bw < minBandwidth || v3bw > maxBandwidth) {
-            const gchar* identity = torflowrelay_getIdentity(relay);
-            const gchar* nickname = torflowrelay_getNickname(relay);
-
-            guint bandwidth = (v3bw < minBandwidth) ? minBandwidth : maxBandwidth;
+    // finally, cap bandwidths that are too large
+    gdouble maxWeightFraction = torflowconfig_getMaxRelayWeightFraction(database->config);
+    guint maxBandwidth = (guint)MIN(totalBW * maxWeightFraction, (gdouble)G_MAXUINT);
+    guint minBandwidth = 20;
 
-            message("Adjusting bandwidth from %u to %u for extremely %s relay %s (%s)\n",
-                    v3bw, bandwidth, (v3bw < minBandwidth) ? "slow" : "fast", nickname, identity);
+    _torflowdatabase_logAggregateResults(database, avgMeanBW, avgFilteredBW, minBandwidth, maxBandwidth);
 
-            v3bw = bandwidth;
-            torflowrelay_setV3Bandwidth(relay, v3bw);
-        }
-    }
+    torflowrelaytable_clampV3Bandwidths(database->relays, minBandwidth, maxBandwidth);
 }
 
 void torflowdatabase_writeBandwidthFile(TorFlowDatabase* database) {
@@ -399,58 +676,23 @@ void torflowdatabase_writeBandwidthFile(TorFlowDatabase* database) {
     // first aggregate the latest results that we have
     _torflowdatabase_aggregateResults(database);
 
-    message("writing new v3bw file now");
-
-    //create new file to print to, and increment version
-    const gchar* v3bwFilePath = torflowconfig_getV3BWFilePath(database->config);
-    GString* newFilename = g_string_new(NULL);
-    g_string_printf(newFilename, "%s.%d", v3bwFilePath, database->v3bwVersion++);
-
     struct timespec now_ts;
     clock_gettime(CLOCK_REALTIME, &now_ts);
 
-    FILE * fp = fopen(newFilename->str, "w");
-    if(fp == NULL) {
-        warning("unable to write v3bw file, NULL file stream for file path %s: error %i: %s",
-                newFilename->str, errno, g_strerror(errno));
-        g_string_free(newFilename, TRUE);
-        return;
-    }
-
-    fprintf(fp, "%li\n", now_ts.tv_sec);
-
-    /*
-     * loop through all relays and print them to file
-     * file format is, where first line value is unix timestamp:
-     * ```
-     * {}\n
-     * node_id=${}\tbw={}\tnick={}\n
-     * [...]
-     * node_id=${}\tbw={}\tnick={}\n
-     * ```
-     * notice there is a newline on the last line.
-     *
-     * see https://gitweb.torproject.org/torflow.git/tree/NetworkScanners/BwAuthority/README.spec.txt#n332
-     */
-    GHashTableIter iter;
-    gpointer key;
-    gpointer value;
-    g_hash_table_iter_init(&iter, database->relaysByIdentity);
-    while(g_hash_table_iter_next(&iter, &key, &value)) {
-        TorFlowRelay* relay = value;
+    // the writer thread formats and writes the file, we only copy out what goes into it
+    TorFlowRelayTable* relays = database->relays;
+    guint numRelays = torflowrelaytable_getNumRelays(relays);
+    TorFlowV3BWLine* lines = g_new(TorFlowV3BWLine, MAX(numRelays, 1));
 
-        const gchar* identity = torflowrelay_getIdentity(relay);
-        const gchar* nickname = torflowrelay_getNickname(relay);
-        guint v3bw = torflowrelay_getV3Bandwidth(relay);
-
-        fprintf(fp, "node_id=$%s\tbw=%u\tnick=%s\n", identity, v3bw, nickname);
+    for(TorFlowRelayHandle relay = 1; relay <= numRelays; relay++) {
+        TorFlowV3BWLine* line = &lines[relay - 1];
+        memcpy(line->fingerprint, torflowrelaytable_getFingerprint(relays, relay), TORFLOW_RELAY_FINGERPRINT_SIZE);
+        memcpy(line->nickname, torflowrelaytable_getNickname(relays, relay), TORFLOW_RELAY_NICKNAME_SIZE);
+        line->bandwidth = torflowrelaytable_getV3Bandwidth(relays, relay);
     }
 
-    fclose(fp);
-
-    message("wrote new bandwidth file at %s", v3bwFilePath);
+    torflowv3bwwriter_submit(database->v3bwWriter, lines, numRelays, (gint64)now_ts.tv_sec);
 
-    /* update symlink */
-    _torflowdatabase_updateAuthoritativeLink(v3bwFilePath, newFilename->str);
-    g_string_free(newFilename, TRUE);
+    message("handed %u relays to the v3bw writer for %s", numRelays,
+            torflowconfig_getV3BWFilePath(database->config));
 }
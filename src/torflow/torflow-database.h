@@ -14,13 +14,32 @@ typedef struct _TorFlowDatabase TorFlowDatabase;
 TorFlowDatabase* torflowdatabase_new(TorFlowConfig* config);
 void torflowdatabase_free(TorFlowDatabase* database);
 
-guint torflowdatabase_storeNewDescriptors(TorFlowDatabase* database, GQueue* descriptorLines);
+TorFlowRelayTable* torflowdatabase_getRelays(TorFlowDatabase* database);
 
-GQueue* torflowdatabase_getMeasureableRelays(TorFlowDatabase* database);
+/* consensus lines are parsed in place as they arrive, without the trailing CRLF. a full consensus
+ * marks the relays it does not list offline, otherwise only the listed relays change.
+ * finishing returns the number of relays that were added, changed or removed. */
+void torflowdatabase_beginDescriptors(TorFlowDatabase* database, gboolean isFullConsensus);
+void torflowdatabase_storeDescriptorLine(TorFlowDatabase* database, const gchar* line, gsize length);
+guint torflowdatabase_finishDescriptors(TorFlowDatabase* database);
+
+/* true if the initial v3bw file gave us estimates, so a bandwidth file is useful before we measured everything */
+gboolean torflowdatabase_hasPriorBandwidths(TorFlowDatabase* database);
+
+/* returns a g_new'd array of the handles of the relays to measure, by decreasing bandwidth */
+TorFlowRelayHandle* torflowdatabase_getMeasureableRelays(TorFlowDatabase* database, guint* numMeasureableRelays);
 void torflowdatabase_storeMeasurementResult(TorFlowDatabase* database,
-        gchar* entryIdentity, gchar* exitIdentity, gboolean isSuccess,
+        TorFlowRelayHandle entryRelay, TorFlowRelayHandle exitRelay, gboolean isSuccess,
         gsize contentLength, gsize roundTripTime, gsize payloadTime, gsize totalTime);
 
+/* round progress lives in the measurement store, so a restarted scanner can resume the round.
+ * without a store there is never an unfinished round and relays never have probes. */
+guint torflowdatabase_getUnfinishedRound(TorFlowDatabase* database);
+void torflowdatabase_beginRound(TorFlowDatabase* database, guint roundNumber);
+void torflowdatabase_finishRound(TorFlowDatabase* database);
+/* the number of probes the relay was part of this round */
+guint torflowdatabase_getNumProbes(TorFlowDatabase* database, TorFlowRelayHandle relay);
+
 void torflowdatabase_writeBandwidthFile(TorFlowDatabase* database);
 
 #endif /* SRC_TORFLOW_TORFLOW_DATABASE_H_ */
@@ -3,36 +3,475 @@
  * See LICENSE for licensing information
  */
 
+/* for accept4 */
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
+#define TORFLOW_LOG_CATEGORY TORFLOW_LOG_EVENTMANAGER
 #include "torflow.h"
 
-struct _TorFlowEventManager {
-    gint epollDescriptor;
-    gboolean shouldStopLoop;
-    GHashTable* watches;
-};
+/* watches are stored in chunks of 256 descriptors */
+#define TORFLOW_WATCH_CHUNK_BITS 8
+#define TORFLOW_WATCH_CHUNK_SIZE (1 << TORFLOW_WATCH_CHUNK_BITS)
+#define TORFLOW_WATCH_CHUNK_MASK (TORFLOW_WATCH_CHUNK_SIZE - 1)
+
+#ifdef TORFLOW_USE_IO_URING
+/* the size of the submission queue, the completion queue is twice as large */
+#define TORFLOW_URING_NUM_ENTRIES 1024
+
+/* the user data of every request we submit holds the kind of request in the top
+ * 2 bits, the generation of the watch in the next 30 bits, and the descriptor */
+#define TORFLOW_URING_KIND_IGNORE 0
+#define TORFLOW_URING_KIND_POLL 1
+#define TORFLOW_URING_KIND_ACCEPT 2
+#define TORFLOW_URING_GENERATION_MASK 0x3FFFFFFF
+#else
+/* the epoll event buffer starts small and doubles whenever epoll fills it */
+#define TORFLOW_EVENTS_INITIAL_SIZE 64
+#define TORFLOW_EVENTS_MAX_SIZE 8192
+#endif
+
+/* the number of low priority callbacks we run per loop iteration before
+ * checking again for timers and control traffic */
+#define TORFLOW_EVENTS_LOW_PRIORITY_BUDGET 32
 
 typedef struct _TorFlowWatch TorFlowWatch;
 struct _TorFlowWatch {
     gint descriptor;
+    gboolean isRegistered;
     TorFlowEventFlag type;
     TorFlowOnEventFunc onEvent;
     gpointer onEventArg;
+    /* set instead of onEvent for listening sockets */
+    TorFlowOnAcceptFunc onAccept;
+
+    TorFlowEventPriority priority;
+    /* set while the watch sits in a pending queue waiting for dispatch */
+    gboolean isPending;
+    TorFlowEventFlag pendingEvents;
+
+#ifdef TORFLOW_USE_IO_URING
+    /* tags the requests of this registration, so we can drop the completions of
+     * older registrations that used the same descriptor */
+    guint32 generation;
+#endif
 };
 
-TorFlowEventManager* torfloweventmanager_new() {
-    TorFlowEventManager* manager = g_new0(TorFlowEventManager, 1);
+struct _TorFlowEventManager {
+    gboolean shouldStopLoop;
+
+    /* descriptors are small dense integers, so the watch for descriptor fd lives at
+     * watchChunks[fd >> TORFLOW_WATCH_CHUNK_BITS][fd & TORFLOW_WATCH_CHUNK_MASK].
+     * chunks are never moved or freed while we run, so epoll can hand us
+     * a pointer straight to the watch. */
+    TorFlowWatch** watchChunks;
+    guint numWatchChunks;
+
+#ifdef TORFLOW_USE_IO_URING
+    /* every registration is a multishot request in the ring, and all changes
+     * are submitted together with the wait at the top of the main loop */
+    struct io_uring ring;
+    gboolean isRingInitialized;
+    guint32 nextGeneration;
+#else
+    gint epollDescriptor;
+
+    /* the buffer epoll_wait fills with ready events */
+    struct epoll_event* events;
+    gint numEvents;
+#endif
+
+    /* watches with events to dispatch, one FIFO queue per priority class */
+    GPtrArray* pending[TORFLOW_PRIORITY_NUM];
+
+    /* all timers share one timerfd, armed for the next expiration in the wheel */
+    gint timerDescriptor;
+    TorFlowTimerWheel* timers;
+    gboolean isTimerDescriptorArmed;
+    guint64 timerDescriptorExpiration;
+
+    TorFlowEventCounters counters;
+};
+
+/* necessary forward declarations */
+static void _torfloweventmanager_onTimerReadable(TorFlowEventManager* manager, TorFlowEventFlag type);
+static TorFlowWatch* _torfloweventmanager_lookupWatch(TorFlowEventManager* manager, gint descriptor);
+static void _torfloweventmanager_queueEvent(TorFlowEventManager* manager,
+        TorFlowWatch* watch, TorFlowEventFlag event);
+
+#ifdef TORFLOW_USE_IO_URING
+
+static gboolean _torfloweventmanager_backendInit(TorFlowEventManager* manager) {
+    g_assert(manager);
+
+    gint result = io_uring_queue_init(TORFLOW_URING_NUM_ENTRIES, &manager->ring, 0);
+    if(result < 0) {
+        critical("Error in main io_uring_queue_init: error %i: %s", -result, g_strerror(-result));
+        return FALSE;
+    }
+
+    manager->isRingInitialized = TRUE;
+    return TRUE;
+}
+
+static void _torfloweventmanager_backendFree(TorFlowEventManager* manager) {
+    g_assert(manager);
+
+    if(manager->isRingInitialized) {
+        io_uring_queue_exit(&manager->ring);
+    }
+}
+
+static struct io_uring_sqe* _torfloweventmanager_getSubmissionEntry(TorFlowEventManager* manager) {
+    g_assert(manager);
+
+    struct io_uring_sqe* sqe = io_uring_get_sqe(&manager->ring);
+    if(sqe == NULL) {
+        /* the submission queue is full, hand what we have to the kernel now */
+        io_uring_submit(&manager->ring);
+        sqe = io_uring_get_sqe(&manager->ring);
+    }
+
+    g_assert(sqe);
+    return sqe;
+}
+
+static guint64 _torfloweventmanager_toUserData(guint kind, TorFlowWatch* watch) {
+    return (((guint64)kind) << 62) |
+            (((guint64)(watch->generation & TORFLOW_URING_GENERATION_MASK)) << 32) |
+            ((guint64)(guint32)watch->descriptor);
+}
+
+static gboolean _torfloweventmanager_backendArm(TorFlowEventManager* manager,
+        TorFlowWatch* watch, TorFlowEventFlag eventType) {
+    g_assert(manager);
+    g_assert(watch);
+
+    struct io_uring_sqe* sqe = _torfloweventmanager_getSubmissionEntry(manager);
+
+    if(watch->onAccept) {
+        /* one request keeps accepting connections until it is canceled */
+        io_uring_prep_multishot_accept(sqe, watch->descriptor, NULL, NULL, SOCK_NONBLOCK);
+        io_uring_sqe_set_data64(sqe, _torfloweventmanager_toUserData(TORFLOW_URING_KIND_ACCEPT, watch));
+    } else {
+        guint pollMask = 0;
+        if(eventType & TORFLOW_EV_READ) {
+            pollMask |= POLLIN;
+        }
+        if(eventType & TORFLOW_EV_WRITE) {
+            pollMask |= POLLOUT;
+        }
+
+        /* multishot polls report readiness changes, which is what edge-triggered
+         * watches expect. everyone else wants to hear about readiness until they act on it. */
+        io_uring_prep_poll_multishot(sqe, watch->descriptor, pollMask);
+        if(!(eventType & TORFLOW_EV_EDGETRIGGERED)) {
+            sqe->len |= IORING_POLL_ADD_LEVEL;
+        }
+        io_uring_sqe_set_data64(sqe, _torfloweventmanager_toUserData(TORFLOW_URING_KIND_POLL, watch));
+    }
+
+    manager->counters.numUringRequests++;
+    return TRUE;
+}
+
+static void _torfloweventmanager_backendCancel(TorFlowEventManager* manager, TorFlowWatch* watch) {
+    g_assert(manager);
+    g_assert(watch);
+
+    struct io_uring_sqe* sqe = _torfloweventmanager_getSubmissionEntry(manager);
+
+    guint kind = watch->onAccept ? TORFLOW_URING_KIND_ACCEPT : TORFLOW_URING_KIND_POLL;
+    io_uring_prep_cancel64(sqe, _torfloweventmanager_toUserData(kind, watch), 0);
+
+    /* we don't care about the result of the cancel request itself */
+    io_uring_sqe_set_data64(sqe, 0);
+
+    manager->counters.numUringRequests++;
+}
+
+static gboolean _torfloweventmanager_backendAdd(TorFlowEventManager* manager,
+        TorFlowWatch* watch, TorFlowEventFlag eventType) {
+    g_assert(manager);
+    g_assert(watch);
+
+    watch->generation = manager->nextGeneration++;
+    return _torfloweventmanager_backendArm(manager, watch, eventType);
+}
+
+static gboolean _torfloweventmanager_backendModify(TorFlowEventManager* manager,
+        TorFlowWatch* watch, TorFlowEventFlag eventType) {
+    g_assert(manager);
+    g_assert(watch);
+
+    /* replacing the request is simpler than updating it in place, and costs
+     * no extra syscall since both go out with the next submission */
+    _torfloweventmanager_backendCancel(manager, watch);
+    return _torfloweventmanager_backendAdd(manager, watch, eventType);
+}
+
+static gboolean _torfloweventmanager_backendDelete(TorFlowEventManager* manager, TorFlowWatch* watch) {
+    g_assert(manager);
+    g_assert(watch);
+
+    _torfloweventmanager_backendCancel(manager, watch);
+    return TRUE;
+}
+
+/* errors that say the descriptor itself can't be watched, so asking again fails the same way */
+static gboolean _torfloweventmanager_isDescriptorError(gint error) {
+    return (error == EBADF || error == ENOTSOCK || error == EINVAL || error == EOPNOTSUPP) ? TRUE : FALSE;
+}
+
+static void _torfloweventmanager_handleCompletion(TorFlowEventManager* manager,
+        guint64 userData, gint result, guint flags) {
+    g_assert(manager);
+
+    guint kind = (guint)(userData >> 62);
+    if(kind == TORFLOW_URING_KIND_IGNORE) {
+        return;
+    }
+
+    gint descriptor = (gint)(guint32)userData;
+    guint32 generation = (guint32)((userData >> 32) & TORFLOW_URING_GENERATION_MASK);
+
+    TorFlowWatch* watch = _torfloweventmanager_lookupWatch(manager, descriptor);
+    if(watch == NULL || (watch->generation & TORFLOW_URING_GENERATION_MASK) != generation) {
+        /* the completion of a registration that was already replaced or deregistered */
+        return;
+    }
+
+    /* the kernel drops multishot requests on errors or overflows */
+    gboolean isStillArmed = (flags & IORING_CQE_F_MORE) ? TRUE : FALSE;
+
+    if(kind == TORFLOW_URING_KIND_ACCEPT) {
+        TorFlowOnAcceptFunc onAccept = watch->onAccept;
+        gpointer onAcceptArg = watch->onEventArg;
+
+        if(onAccept) {
+            /* the result is the new descriptor or a negative errno */
+            onAccept(onAcceptArg, result);
+        }
+
+        /* the callback may have deregistered the listener */
+        watch = _torfloweventmanager_lookupWatch(manager, descriptor);
+        if(watch == NULL || (watch->generation & TORFLOW_URING_GENERATION_MASK) != generation) {
+            return;
+        }
+
+        if(result < 0 && _torfloweventmanager_isDescriptorError(-result)) {
+            /* the listener already got the error, accepting again would only repeat it */
+            warning("io_uring accept failed on descriptor %i: error %i: %s, no longer accepting",
+                    descriptor, -result, g_strerror(-result));
+            return;
+        }
+    } else if(result >= 0) {
+        TorFlowEventFlag eventFlag = TORFLOW_EV_NONE;
+        if(result & POLLIN) {
+            eventFlag |= TORFLOW_EV_READ;
+        }
+        if(result & POLLOUT) {
+            eventFlag |= TORFLOW_EV_WRITE;
+        }
+
+        _torfloweventmanager_queueEvent(manager, watch, eventFlag);
+    } else {
+        /* polling again would fail the same way on every loop iteration. instead, we let the
+         * owner find the error with its next read or write, like epoll does with EPOLLERR.
+         * it is armed again only if the owner changes its interest. */
+        warning("io_uring poll failed on descriptor %i: error %i: %s, no longer polling",
+                descriptor, -result, g_strerror(-result));
+        _torfloweventmanager_queueEvent(manager, watch, watch->type & (TORFLOW_EV_READ|TORFLOW_EV_WRITE));
+        return;
+    }
+
+    if(!isStillArmed) {
+        _torfloweventmanager_backendArm(manager, watch, watch->type);
+    }
+}
+
+static gboolean _torfloweventmanager_backendWait(TorFlowEventManager* manager, gboolean shouldBlock) {
+    g_assert(manager);
+
+    /* one syscall submits every registration change and waits for completions */
+    gint result = io_uring_submit_and_wait(&manager->ring, shouldBlock ? 1 : 0);
+    if(result < 0 && result != -EINTR) {
+        critical("Error in io_uring_submit_and_wait in main loop: error %i: %s", -result, g_strerror(-result));
+        return FALSE;
+    }
+
+    struct io_uring_cqe* cqe = NULL;
+    guint head = 0;
+    guint numCompletions = 0;
+
+    io_uring_for_each_cqe(&manager->ring, head, cqe) {
+        numCompletions++;
+        _torfloweventmanager_handleCompletion(manager, cqe->user_data, cqe->res, cqe->flags);
+    }
+
+    io_uring_cq_advance(&manager->ring, numCompletions);
+    return TRUE;
+}
+
+#else /* epoll */
+
+static gboolean _torfloweventmanager_backendInit(TorFlowEventManager* manager) {
+    g_assert(manager);
 
     /* we need to watch all of the descriptors in our main loop
      * so we know when we can wait on any of them without blocking. */
     manager->epollDescriptor = epoll_create(1);
     if(manager->epollDescriptor < 0) {
         critical("Error in main epoll_create");
+        return FALSE;
+    }
+
+    manager->numEvents = TORFLOW_EVENTS_INITIAL_SIZE;
+    manager->events = g_new0(struct epoll_event, manager->numEvents);
+
+    return TRUE;
+}
+
+static void _torfloweventmanager_backendFree(TorFlowEventManager* manager) {
+    g_assert(manager);
+
+    if(manager->epollDescriptor > 0) {
         close(manager->epollDescriptor);
+    }
+
+    if(manager->events) {
+        g_free(manager->events);
+    }
+}
+
+static guint32 _torfloweventmanager_toEpollEvents(TorFlowEventFlag eventType) {
+    guint32 events = 0;
+
+    if(eventType & TORFLOW_EV_READ) {
+        events |= EPOLLIN;
+    }
+    if(eventType & TORFLOW_EV_WRITE) {
+        events |= EPOLLOUT;
+    }
+    if(events != 0 && (eventType & TORFLOW_EV_EDGETRIGGERED)) {
+        events |= EPOLLET;
+    }
+
+    return events;
+}
+
+static gboolean _torfloweventmanager_backendControl(TorFlowEventManager* manager,
+        gint operation, TorFlowWatch* watch, TorFlowEventFlag eventType) {
+    g_assert(manager);
+    g_assert(watch);
+
+    struct epoll_event epev;
+    memset(&epev, 0, sizeof(struct epoll_event));
+
+    epev.events = _torfloweventmanager_toEpollEvents(eventType);
+    epev.data.ptr = watch;
+
+    manager->counters.numEpollCtlCalls++;
+    gint result = epoll_ctl(manager->epollDescriptor, operation, watch->descriptor, &epev);
+    if(result < 0) {
+        warning("epoll_ctl failed to %s descriptor %i",
+                (operation == EPOLL_CTL_ADD) ? "add" :
+                (operation == EPOLL_CTL_MOD) ? "modify" : "delete",
+                watch->descriptor);
+        return FALSE;
+    }
+
+    return TRUE;
+}
+
+static gboolean _torfloweventmanager_backendAdd(TorFlowEventManager* manager,
+        TorFlowWatch* watch, TorFlowEventFlag eventType) {
+    /* tell epoll to watch it */
+    return _torfloweventmanager_backendControl(manager, EPOLL_CTL_ADD, watch, eventType);
+}
+
+static gboolean _torfloweventmanager_backendModify(TorFlowEventManager* manager,
+        TorFlowWatch* watch, TorFlowEventFlag eventType) {
+    /* change the interest set in place, the registration stays alive */
+    return _torfloweventmanager_backendControl(manager, EPOLL_CTL_MOD, watch, eventType);
+}
+
+static gboolean _torfloweventmanager_backendDelete(TorFlowEventManager* manager, TorFlowWatch* watch) {
+    return _torfloweventmanager_backendControl(manager, EPOLL_CTL_DEL, watch, TORFLOW_EV_NONE);
+}
+
+static gboolean _torfloweventmanager_backendWait(TorFlowEventManager* manager, gboolean shouldBlock) {
+    g_assert(manager);
+
+    gint nReadyFDs = epoll_wait(manager->epollDescriptor, manager->events, manager->numEvents, shouldBlock ? -1 : 0);
+    if(nReadyFDs == -1) {
+        critical("Error in client epoll_wait in main loop");
+        return FALSE;
+    }
+
+    /* sort every descriptor that's ready into the queue of its class */
+    for(gint i = 0; i < nReadyFDs; i++) {
+        /* no lookup needed, epoll gives us the watch itself */
+        TorFlowWatch* watch = manager->events[i].data.ptr;
+
+        TorFlowEventFlag eventFlag = TORFLOW_EV_NONE;
+        if(manager->events[i].events & EPOLLIN) {
+            eventFlag |= TORFLOW_EV_READ;
+        }
+        if(manager->events[i].events & EPOLLOUT) {
+            eventFlag |= TORFLOW_EV_WRITE;
+        }
+
+        if(watch->isRegistered) {
+            _torfloweventmanager_queueEvent(manager, watch, eventFlag);
+        }
+    }
+
+    /* a full buffer means more descriptors are probably ready, make room for them */
+    if(nReadyFDs == manager->numEvents && manager->numEvents < TORFLOW_EVENTS_MAX_SIZE) {
+        manager->numEvents *= 2;
+        manager->events = g_renew(struct epoll_event, manager->events, manager->numEvents);
+        debug("grew the epoll event buffer to %i events", manager->numEvents);
+    }
+
+    return TRUE;
+}
+
+#endif /* TORFLOW_USE_IO_URING */
+
+TorFlowEventManager* torfloweventmanager_new() {
+    TorFlowEventManager* manager = g_new0(TorFlowEventManager, 1);
+
+    for(gint i = 0; i < TORFLOW_PRIORITY_NUM; i++) {
+        manager->pending[i] = g_ptr_array_new();
+    }
+
+    if(!_torfloweventmanager_backendInit(manager)) {
         torfloweventmanager_free(manager);
         return NULL;
     }
 
-    manager->watches = g_hash_table_new_full(g_int_hash, g_int_equal, NULL, g_free);
+    manager->timers = torflowtimerwheel_new();
+
+    /* the descriptor that wakes us up when the next timer in the wheel expires */
+    manager->timerDescriptor = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK);
+    if(manager->timerDescriptor < 0) {
+        critical("Error in main timerfd_create");
+        torfloweventmanager_free(manager);
+        return NULL;
+    }
+
+    gboolean success = torfloweventmanager_register(manager, manager->timerDescriptor, TORFLOW_EV_READ,
+            (TorFlowOnEventFunc)_torfloweventmanager_onTimerReadable, manager);
+    if(!success) {
+        critical("failed to add timer descriptor %i", manager->timerDescriptor);
+        torfloweventmanager_free(manager);
+        return NULL;
+    }
+
+    /* timeouts are part of what we measure, don't let them wait */
+    torfloweventmanager_setPriority(manager, manager->timerDescriptor, TORFLOW_PRIORITY_HIGH);
 
     return manager;
 }
@@ -40,154 +479,448 @@ TorFlowEventManager* torfloweventmanager_new() {
 void torfloweventmanager_free(TorFlowEventManager* manager) {
     g_assert(manager);
 
-    if(manager->watches) {
-        /* this will call g_free on all of the watch objects */
-        g_hash_table_destroy(manager->watches);
+    if(manager->watchChunks) {
+        for(guint i = 0; i < manager->numWatchChunks; i++) {
+            if(manager->watchChunks[i]) {
+                g_free(manager->watchChunks[i]);
+            }
+        }
+        g_free(manager->watchChunks);
+    }
+
+    for(gint i = 0; i < TORFLOW_PRIORITY_NUM; i++) {
+        if(manager->pending[i]) {
+            g_ptr_array_free(manager->pending[i], TRUE);
+        }
+    }
+
+    _torfloweventmanager_backendFree(manager);
+
+    if(manager->timerDescriptor > 0) {
+        close(manager->timerDescriptor);
+    }
+
+    if(manager->timers) {
+        torflowtimerwheel_free(manager->timers);
     }
 
     g_free(manager);
 }
 
+static TorFlowWatch* _torfloweventmanager_lookupWatch(TorFlowEventManager* manager, gint descriptor) {
+    g_assert(manager);
+
+    guint chunk = ((guint)descriptor) >> TORFLOW_WATCH_CHUNK_BITS;
+
+    if(descriptor <= 0 || chunk >= manager->numWatchChunks || manager->watchChunks[chunk] == NULL) {
+        return NULL;
+    }
+
+    TorFlowWatch* watch = &(manager->watchChunks[chunk][descriptor & TORFLOW_WATCH_CHUNK_MASK]);
+    return watch->isRegistered ? watch : NULL;
+}
+
+static TorFlowWatch* _torfloweventmanager_getFreeWatch(TorFlowEventManager* manager, gint descriptor) {
+    g_assert(manager);
+    g_assert(descriptor > 0);
+
+    guint chunk = ((guint)descriptor) >> TORFLOW_WATCH_CHUNK_BITS;
+
+    /* grow the chunk index to cover the descriptor; this only moves the chunk pointers */
+    if(chunk >= manager->numWatchChunks) {
+        guint newNumChunks = MAX(chunk + 1, manager->numWatchChunks * 2);
+        manager->watchChunks = g_renew(TorFlowWatch*, manager->watchChunks, newNumChunks);
+        memset(&(manager->watchChunks[manager->numWatchChunks]), 0,
+                sizeof(TorFlowWatch*) * (newNumChunks - manager->numWatchChunks));
+        manager->numWatchChunks = newNumChunks;
+    }
+
+    if(manager->watchChunks[chunk] == NULL) {
+        manager->counters.numWatchAllocations++;
+        manager->watchChunks[chunk] = g_new0(TorFlowWatch, TORFLOW_WATCH_CHUNK_SIZE);
+    }
+
+    TorFlowWatch* watch = &(manager->watchChunks[chunk][descriptor & TORFLOW_WATCH_CHUNK_MASK]);
+    g_assert(!watch->isRegistered);
+    return watch;
+}
+
+static gboolean _torfloweventmanager_addWatch(TorFlowEventManager* manager,
+        gint descriptor, TorFlowEventFlag eventType, TorFlowOnEventFunc onEvent,
+        TorFlowOnAcceptFunc onAccept, gpointer onEventArg) {
+    g_assert(manager);
+
+    /* the slot in our table where we store the variables we need to take action when events occur */
+    TorFlowWatch* watch = _torfloweventmanager_getFreeWatch(manager, descriptor);
+
+    watch->descriptor = descriptor;
+    watch->type = eventType;
+    watch->onEvent = onEvent;
+    watch->onAccept = onAccept;
+    watch->onEventArg = onEventArg;
+    watch->priority = TORFLOW_PRIORITY_NORMAL;
+
+    if(!_torfloweventmanager_backendAdd(manager, watch, eventType)) {
+        memset(watch, 0, sizeof(TorFlowWatch));
+        return FALSE;
+    }
+
+    watch->isRegistered = TRUE;
+    return TRUE;
+}
+
+static gboolean _torfloweventmanager_updateInterest(TorFlowEventManager* manager,
+        TorFlowWatch* watch, TorFlowEventFlag eventType) {
+    g_assert(manager);
+    g_assert(watch);
+
+    if(watch->type == eventType) {
+        /* the backend is already watching for exactly these events */
+        manager->counters.numEpollCtlAvoided++;
+        return TRUE;
+    }
+
+    if(!_torfloweventmanager_backendModify(manager, watch, eventType)) {
+        return FALSE;
+    }
+
+    watch->type = eventType;
+    return TRUE;
+}
+
 gboolean torfloweventmanager_register(TorFlowEventManager* manager,
         gint descriptor, TorFlowEventFlag eventType,
         TorFlowOnEventFunc onEvent, gpointer onEventArg) {
     g_assert(manager);
 
-    struct epoll_event epev;
-    memset(&epev, 0, sizeof(struct epoll_event));
-
-    if(eventType & TORFLOW_EV_READ) {
-        epev.events |= EPOLLIN;
+    if((eventType & (TORFLOW_EV_READ|TORFLOW_EV_WRITE)) == 0 || descriptor <= 0) {
+        /* not registered */
+        return FALSE;
     }
-    if(eventType & TORFLOW_EV_WRITE) {
-        epev.events |= EPOLLOUT;
+
+    /* if it's already registered, we keep the watch and only update it */
+    TorFlowWatch* watch = _torfloweventmanager_lookupWatch(manager, descriptor);
+    if(watch != NULL) {
+        /* listening sockets have to be deregistered first */
+        g_assert(watch->onAccept == NULL);
+
+        watch->onEvent = onEvent;
+        watch->onEventArg = onEventArg;
+        return _torfloweventmanager_updateInterest(manager, watch, eventType);
     }
 
-    if(epev.events == 0 || descriptor <= 0) {
+    return _torfloweventmanager_addWatch(manager, descriptor, eventType, onEvent, NULL, onEventArg);
+}
+
+gboolean torfloweventmanager_registerAccept(TorFlowEventManager* manager,
+        gint descriptor, TorFlowOnAcceptFunc onAccept, gpointer onAcceptArg) {
+    g_assert(manager);
+    g_assert(onAccept);
+
+    if(descriptor <= 0 || _torfloweventmanager_lookupWatch(manager, descriptor) != NULL) {
         /* not registered */
         return FALSE;
     }
 
-    epev.data.fd = descriptor;
+    return _torfloweventmanager_addWatch(manager, descriptor, TORFLOW_EV_READ, NULL, onAccept, onAcceptArg);
+}
+
+gboolean torfloweventmanager_setInterest(TorFlowEventManager* manager,
+        gint descriptor, TorFlowEventFlag eventType) {
+    g_assert(manager);
 
-    /* if it's already registered, we have to remove it first */
-    if(g_hash_table_lookup(manager->watches, &descriptor) != NULL) {
-        torfloweventmanager_deregister(manager, descriptor);
+    TorFlowWatch* watch = _torfloweventmanager_lookupWatch(manager, descriptor);
+    if(watch == NULL || watch->onAccept != NULL) {
+        /* we need a callback first */
+        return FALSE;
     }
 
-    /* tell epoll to watch it */
-    int result = epoll_ctl(manager->epollDescriptor, EPOLL_CTL_ADD, epev.data.fd, &epev);
-    if(result < 0) {
-        warning("epoll_ctl failed to add descriptor %i", descriptor);
+    /* keep the trigger mode that was chosen at registration time */
+    TorFlowEventFlag newType = (eventType & (TORFLOW_EV_READ|TORFLOW_EV_WRITE)) |
+            (watch->type & TORFLOW_EV_EDGETRIGGERED);
+
+    if((newType & (TORFLOW_EV_READ|TORFLOW_EV_WRITE)) == 0) {
+        /* an empty interest set would still report hangups and errors;
+         * use torfloweventmanager_deregister instead */
         return FALSE;
     }
 
-    /* now store the variables we need to take action when events occur */
-    TorFlowWatch* watch = g_new0(TorFlowWatch, 1);
-    watch->descriptor = descriptor;
-    watch->type = eventType;
-    watch->onEvent = onEvent;
-    watch->onEventArg = onEventArg;
+    return _torfloweventmanager_updateInterest(manager, watch, newType);
+}
+
+gboolean torfloweventmanager_setPriority(TorFlowEventManager* manager,
+        gint descriptor, TorFlowEventPriority priority) {
+    g_assert(manager);
+    g_assert(priority < TORFLOW_PRIORITY_NUM);
 
-    g_hash_table_replace(manager->watches, &(watch->descriptor), watch);
+    TorFlowWatch* watch = _torfloweventmanager_lookupWatch(manager, descriptor);
+    if(watch == NULL) {
+        return FALSE;
+    }
 
-    /* successfully registered */
+    /* events that are already queued are dispatched in their old class */
+    watch->priority = priority;
     return TRUE;
 }
 
-gboolean torfloweventmanager_deregister(TorFlowEventManager* manager, gint descriptor) {
+static void _torfloweventmanager_queueEvent(TorFlowEventManager* manager,
+        TorFlowWatch* watch, TorFlowEventFlag event) {
     g_assert(manager);
+    g_assert(watch);
+
+    /* a watch is queued at most once, later events are merged into the queued one */
+    watch->pendingEvents |= event;
 
-    /* de-register the epoll descriptor */
-    TorFlowWatch* watch = g_hash_table_lookup(manager->watches, &descriptor);
+    if(!watch->isPending) {
+        watch->isPending = TRUE;
+        g_ptr_array_add(manager->pending[watch->priority], watch);
+    }
+}
+
+gboolean torfloweventmanager_yield(TorFlowEventManager* manager,
+        gint descriptor, TorFlowEventFlag eventType) {
+    g_assert(manager);
+
+    TorFlowWatch* watch = _torfloweventmanager_lookupWatch(manager, descriptor);
     if(watch == NULL) {
-        /* couldn't find a registered watch, so nothing was deregistered */
         return FALSE;
     }
 
-    struct epoll_event epev;
-    memset(&epev, 0, sizeof(struct epoll_event));
+    _torfloweventmanager_queueEvent(manager, watch, eventType & (TORFLOW_EV_READ|TORFLOW_EV_WRITE));
+    return TRUE;
+}
 
-    epev.data.fd = descriptor;
+gboolean torfloweventmanager_deregister(TorFlowEventManager* manager, gint descriptor) {
+    g_assert(manager);
 
-    int result = epoll_ctl(manager->epollDescriptor, EPOLL_CTL_DEL, epev.data.fd, &epev);
-    if(result < 0) {
-        warning("epoll_ctl failed to delete descriptor %i", descriptor);
+    /* de-register the descriptor */
+    TorFlowWatch* watch = _torfloweventmanager_lookupWatch(manager, descriptor);
+    if(watch == NULL) {
+        /* couldn't find a registered watch, so nothing was deregistered */
+        return FALSE;
+    }
+
+    if(!_torfloweventmanager_backendDelete(manager, watch)) {
         return FALSE;
     }
 
-    /* this will call g_free on the watch object */
-    g_hash_table_remove(manager->watches, &descriptor);
+    /* the slot stays in the table for the next descriptor with this number. events
+     * for it that are still queued will be skipped. */
+    memset(watch, 0, sizeof(TorFlowWatch));
 
     /* successfully deregistered */
     return TRUE;
 }
 
-static void _torfloweventmanager_processEvent(TorFlowEventManager* manager, gint descriptor, TorFlowEventFlag event) {
+void torfloweventmanager_getCounters(TorFlowEventManager* manager, TorFlowEventCounters* counters) {
     g_assert(manager);
 
-    debug("started processing event %s for descriptor %i",
-            (event == TORFLOW_EV_READ) ? "READ" :
+    if(counters) {
+        *counters = manager->counters;
+    }
+}
+
+TorFlowTimer* torfloweventmanager_createTimer(TorFlowEventManager* manager,
+        GFunc notifyFunc, gpointer arg1, gpointer arg2) {
+    g_assert(manager);
+    return torflowtimer_new(manager->timers, notifyFunc, arg1, arg2);
+}
+
+static void _torfloweventmanager_updateTimerDescriptor(TorFlowEventManager* manager) {
+    g_assert(manager);
+
+    guint64 expiration = 0;
+    gboolean hasExpiration = torflowtimerwheel_getNextExpiration(manager->timers, &expiration);
+
+    /* only touch the timerfd if the next expiration actually changed */
+    if(hasExpiration == manager->isTimerDescriptorArmed &&
+            (!hasExpiration || expiration == manager->timerDescriptorExpiration)) {
+        return;
+    }
+
+    struct itimerspec arm;
+    memset(&arm, 0, sizeof(struct itimerspec));
+
+    if(hasExpiration) {
+        /* absolute CLOCK_MONOTONIC time. an all zero value would disarm the timer,
+         * so we use a 1 nano expiration to get notified as soon as possible */
+        arm.it_value.tv_sec = (time_t)(expiration / 1000);
+        arm.it_value.tv_nsec = (long)((expiration % 1000) * 1000000);
+        if(arm.it_value.tv_sec == 0 && arm.it_value.tv_nsec == 0) {
+            arm.it_value.tv_nsec = 1;
+        }
+    }
+
+    /* timer never repeats, a zeroed it_value disarms it */
+    gint result = timerfd_settime(manager->timerDescriptor, TFD_TIMER_ABSTIME, &arm, NULL);
+    if(result < 0) {
+        warning("timerfd_settime failed on timer descriptor %i: error %i: %s",
+                manager->timerDescriptor, errno, g_strerror(errno));
+        return;
+    }
+
+    manager->isTimerDescriptorArmed = hasExpiration;
+    manager->timerDescriptorExpiration = expiration;
+}
+
+static void _torfloweventmanager_onTimerReadable(TorFlowEventManager* manager, TorFlowEventFlag type) {
+    g_assert(manager);
+
+    /* clear the event from the descriptor */
+    guint64 numExpirations = 0;
+    ssize_t result = read(manager->timerDescriptor, &numExpirations, sizeof(guint64));
+
+    if(result < 0) {
+        /* EAGAIN means the timerfd was re-armed after it became readable, so nothing expired yet */
+        if(errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+            warning("unable to read timer descriptor %i: error %i: %s",
+                    manager->timerDescriptor, errno, g_strerror(errno));
+        }
+        return;
+    }
+
+    /* the timerfd only fires once per arm */
+    manager->isTimerDescriptorArmed = FALSE;
+
+    /* run the notify functions of every expired timer */
+    guint numExpired = torflowtimerwheel_advance(manager->timers);
+    debug("processed %u expired timers", numExpired);
+}
+
+static void _torfloweventmanager_acceptReady(TorFlowEventManager* manager, TorFlowWatch* watch) {
+    g_assert(manager);
+    g_assert(watch);
+
+    /* take every connection that is waiting, not just one per wakeup. the
+     * callback may deregister the listener, which clears the watch. */
+    while(watch->isRegistered && watch->onAccept) {
+        gint childDescriptor = accept4(watch->descriptor, NULL, NULL, SOCK_NONBLOCK);
+
+        if(childDescriptor < 0 && (errno == EWOULDBLOCK || errno == EAGAIN)) {
+            break;
+        }
+
+        /* pass on errors as negative errno values */
+        watch->onAccept(watch->onEventArg, (childDescriptor < 0) ? -errno : childDescriptor);
+
+        if(childDescriptor < 0) {
+            break;
+        }
+    }
+}
+
+static const gchar* _torfloweventmanager_eventToString(TorFlowEventFlag event) {
+    return (event == TORFLOW_EV_READ) ? "READ" :
             (event == TORFLOW_EV_WRITE) ? "WRITE" :
             (event == (TORFLOW_EV_READ|TORFLOW_EV_WRITE)) ? "READ|WRITE" :
-            "NONE", descriptor);
+            "NONE";
+}
 
-    TorFlowWatch* watch = g_hash_table_lookup(manager->watches, &descriptor);
-    if(watch == NULL) {
-        /* couldn't find a registered watch, so nothing was deregistered */
-        warning("missing watch object to handle event %s for descriptor %i",
-                    (event == TORFLOW_EV_READ) ? "READ" :
-                    (event == TORFLOW_EV_WRITE) ? "WRITE" :
-                    (event == (TORFLOW_EV_READ|TORFLOW_EV_WRITE)) ? "READ|WRITE" :
-                    "NONE", descriptor);
+static void _torfloweventmanager_processEvent(TorFlowEventManager* manager, TorFlowWatch* watch, TorFlowEventFlag event) {
+    g_assert(manager);
+    g_assert(watch);
+
+    debug("started processing event %s for descriptor %i",
+            _torfloweventmanager_eventToString(event), watch->descriptor);
+
+    if(!watch->isRegistered) {
+        /* an earlier callback deregistered the descriptor while the event was queued */
+        debug("skipping event %s for deregistered descriptor", _torfloweventmanager_eventToString(event));
         return;
     }
 
-    if(watch->onEvent) {
+    manager->counters.numEventsDispatched++;
+
+    /* the callback may deregister the watch, which clears it */
+    gint descriptor = watch->descriptor;
+
+    if(watch->onAccept) {
+        /* readiness on a listening socket, only the epoll backend gets here */
+        _torfloweventmanager_acceptReady(manager, watch);
+    } else if(watch->onEvent) {
         /* call the registered callback to handle the event. make sure to pass the events
          * that *occurred*, not the events that are *registered* in the watch. */
         watch->onEvent(watch->onEventArg, event);
     }
 
     debug("finished processing event %s for descriptor %i",
-                (event == TORFLOW_EV_READ) ? "READ" :
-                (event == TORFLOW_EV_WRITE) ? "WRITE" :
-                (event == (TORFLOW_EV_READ|TORFLOW_EV_WRITE)) ? "READ|WRITE" :
-                "NONE", descriptor);
+            _torfloweventmanager_eventToString(event), descriptor);
+}
+
+static gboolean _torfloweventmanager_hasPendingEvents(TorFlowEventManager* manager) {
+    g_assert(manager);
+
+    for(gint i = 0; i < TORFLOW_PRIORITY_NUM; i++) {
+        if(manager->pending[i]->len > 0) {
+            return TRUE;
+        }
+    }
+    return FALSE;
+}
+
+static void _torfloweventmanager_dispatchPendingEvents(TorFlowEventManager* manager) {
+    g_assert(manager);
+
+    for(gint priority = 0; priority < TORFLOW_PRIORITY_NUM; priority++) {
+        GPtrArray* queue = manager->pending[priority];
+
+        /* only dispatch what was queued before we started, so that callbacks
+         * that yield or queue more work cannot keep us in this class forever */
+        guint numToDispatch = queue->len;
+        if(priority == TORFLOW_PRIORITY_LOW) {
+            numToDispatch = MIN(numToDispatch, TORFLOW_EVENTS_LOW_PRIORITY_BUDGET);
+        }
+
+        for(guint i = 0; i < numToDispatch; i++) {
+            /* callbacks may grow the queue, so don't hold on to pdata */
+            TorFlowWatch* watch = g_ptr_array_index(queue, i);
+
+            if(!watch->isPending) {
+                /* deregistered (and maybe reused) since it was queued */
+                continue;
+            }
+
+            TorFlowEventFlag event = watch->pendingEvents;
+            watch->isPending = FALSE;
+            watch->pendingEvents = TORFLOW_EV_NONE;
+
+            _torfloweventmanager_processEvent(manager, watch, event);
+        }
+
+        g_ptr_array_remove_range(queue, 0, numToDispatch);
+
+        if(priority == TORFLOW_PRIORITY_LOW) {
+            manager->counters.numEventsDeferred += queue->len;
+        }
+    }
 }
 
 gboolean torfloweventmanager_runMainLoop(TorFlowEventManager* manager) {
     g_assert(manager);
 
     /* main loop - wait for events from the descriptors */
-    struct epoll_event events[100];
-    gint nReadyFDs;
     message("entering main loop to watch descriptors");
 
     while(1) {
-        /* wait for some events */
-        debug("waiting for events");
-        nReadyFDs = epoll_wait(manager->epollDescriptor, events, 100, -1);
-        if(nReadyFDs == -1) {
-            critical("Error in client epoll_wait in main loop");
-            return FALSE;
-        }
+        /* make sure we wake up in time for the next timer */
+        _torfloweventmanager_updateTimerDescriptor(manager);
 
-        /* process every descriptor that's ready */
-        for(gint i = 0; i < nReadyFDs; i++) {
-            gint descriptor = events[i].data.fd;
+        /* wait for some events, but only poll if we still have deferred work */
+        gboolean shouldBlock = !_torfloweventmanager_hasPendingEvents(manager);
 
-            TorFlowEventFlag eventFlag = TORFLOW_EV_NONE;
-            if(events[i].events & EPOLLIN) {
-                eventFlag |= TORFLOW_EV_READ;
-            }
-            if(events[i].events & EPOLLOUT) {
-                eventFlag |= TORFLOW_EV_WRITE;
-            }
+        debug("waiting for events");
+        if(shouldBlock) {
+            /* we are idle, a good time to write out the logs from this iteration */
+            torflow_flushLog();
+        }
 
-            _torfloweventmanager_processEvent(manager, descriptor, eventFlag);
+        if(!_torfloweventmanager_backendWait(manager, shouldBlock)) {
+            return FALSE;
         }
 
+        /* high priority first, then normal, then a budgeted number of low */
+        _torfloweventmanager_dispatchPendingEvents(manager);
+
         /* break out if done */
         if(manager->shouldStopLoop) {
             break;
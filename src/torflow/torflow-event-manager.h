@@ -9,22 +9,67 @@
 
 #include <glib.h>
 
+#include "torflow-timer.h"
+
 typedef enum _TorFlowEventFlag TorFlowEventFlag;
 enum _TorFlowEventFlag {
     TORFLOW_EV_NONE = 0,
     TORFLOW_EV_READ = 1 << 0,
     TORFLOW_EV_WRITE = 1 << 1,
+    /* only meaningful at registration: report readiness changes instead of
+     * readiness, so callbacks must read or write until they get EAGAIN */
+    TORFLOW_EV_EDGETRIGGERED = 1 << 2,
+};
+
+/* the order in which ready descriptors are dispatched within one main loop iteration.
+ * timing samples are taken in the high and normal classes, so bulk transfers must
+ * not delay them. new registrations start in TORFLOW_PRIORITY_NORMAL. */
+typedef enum _TorFlowEventPriority TorFlowEventPriority;
+enum _TorFlowEventPriority {
+    /* timers and control connections */
+    TORFLOW_PRIORITY_HIGH,
+    TORFLOW_PRIORITY_NORMAL,
+    /* bulk data transfers, only a budgeted number are dispatched per iteration */
+    TORFLOW_PRIORITY_LOW,
+    TORFLOW_PRIORITY_NUM,
 };
 
 /* function signature for the callback function that will get called by the
  * event manager when I/O occurs on registered descriptors. */
 typedef void (*TorFlowOnEventFunc)(gpointer onEventArg, TorFlowEventFlag eventType);
 
+/* function signature for the callback function that will get called by the
+ * event manager for every connection accepted on a registered listening socket.
+ * childDescriptor is the new non-blocking socket, or a negative errno value. */
+typedef void (*TorFlowOnAcceptFunc)(gpointer onAcceptArg, gint childDescriptor);
+
+/* running totals of the work done by the event manager, so that we can
+ * measure the cost of event handling (e.g., per probe). */
+typedef struct _TorFlowEventCounters TorFlowEventCounters;
+struct _TorFlowEventCounters {
+    /* epoll_ctl calls to add, modify, or delete descriptors */
+    guint64 numEpollCtlCalls;
+    /* poll, accept, and cancel requests queued on the io_uring backend. they cost no
+     * syscall of their own, they go out with the next wait. */
+    guint64 numUringRequests;
+    /* registration changes that did not need an epoll_ctl call or io_uring request */
+    guint64 numEpollCtlAvoided;
+    /* allocations of new chunks in the watch table */
+    guint64 numWatchAllocations;
+    /* ready events handed to registered callbacks */
+    guint64 numEventsDispatched;
+    /* ready low priority events carried over to a later iteration by the budget */
+    guint64 numEventsDeferred;
+};
+
 /* Opaque internal struct for the manager object */
 typedef struct _TorFlowEventManager TorFlowEventManager;
 
 /* returns a new instance of an event manager that will watch file descriptors
- * for read/write events and notify components when the specified I/O occurs. */
+ * for read/write events and notify components when the specified I/O occurs.
+ * the manager uses epoll, or io_uring when built with TORFLOW_USE_IO_URING.
+ * io_uring only replaces how readiness is watched and waited for. components still
+ * read and write with one recv or send call each, on both backends. */
 TorFlowEventManager* torfloweventmanager_new();
 
 /* deallocates all memory associated with an event manager previously created
@@ -32,17 +77,54 @@ TorFlowEventManager* torfloweventmanager_new();
 void torfloweventmanager_free(TorFlowEventManager* manager);
 
 /* monitor a new file descriptor for I/O events of the given type, and register
- * a callback function and arguments to execute when I/O occurs.
+ * a callback function and arguments to execute when I/O occurs. a descriptor
+ * that is already registered keeps its watch, and only the callback and the
+ * interest set are updated (with EPOLL_CTL_MOD, and only if it changed).
  * returns TRUE if the registration was successful, false otherwise. */
 gboolean torfloweventmanager_register(TorFlowEventManager* manager,
         gint descriptor, TorFlowEventFlag eventType,
         TorFlowOnEventFunc onEvent, gpointer onEventArg);
 
+/* monitor a listening socket and call onAccept for every incoming connection.
+ * with io_uring this is a single multishot accept request, with epoll we accept
+ * everything that is waiting whenever the socket becomes readable.
+ * returns TRUE if the registration was successful, false otherwise. */
+gboolean torfloweventmanager_registerAccept(TorFlowEventManager* manager,
+        gint descriptor, TorFlowOnAcceptFunc onAccept, gpointer onAcceptArg);
+
+/* changes the I/O events we monitor on an already registered file descriptor,
+ * keeping its callback and trigger mode. the interest set must not be empty.
+ * returns TRUE if the descriptor is now watched for the given events, FALSE otherwise. */
+gboolean torfloweventmanager_setInterest(TorFlowEventManager* manager,
+        gint descriptor, TorFlowEventFlag eventType);
+
+/* sets the class in which events for an already registered descriptor are dispatched.
+ * returns TRUE if the descriptor is registered, FALSE otherwise. */
+gboolean torfloweventmanager_setPriority(TorFlowEventManager* manager,
+        gint descriptor, TorFlowEventPriority priority);
+
+/* asks for the callback of an already registered descriptor to be called again with
+ * the given events in the next main loop iteration, even if epoll does not report them.
+ * callbacks on edge-triggered descriptors use this to stop before EAGAIN and give
+ * other descriptors a turn. returns TRUE if the descriptor is registered, FALSE otherwise. */
+gboolean torfloweventmanager_yield(TorFlowEventManager* manager,
+        gint descriptor, TorFlowEventFlag eventType);
+
 /* stops monitoring I/O for the given file descriptor and deregisters previously
  * registered callback functions.
  * returns TRUE if the descriptor was previously registered, FALSE otherwise. */
 gboolean torfloweventmanager_deregister(TorFlowEventManager* manager, gint descriptor);
 
+/* returns a new timer that will be driven by this event manager's main loop.
+ * when the armed timer expires, notifyFunc will be called with arg1 and arg2.
+ * the caller owns the timer and should free it with torflowtimer_free, which
+ * also cancels it if it is still armed. */
+TorFlowTimer* torfloweventmanager_createTimer(TorFlowEventManager* manager,
+        GFunc notifyFunc, gpointer arg1, gpointer arg2);
+
+/* copies the current event handling counters into the given struct */
+void torfloweventmanager_getCounters(TorFlowEventManager* manager, TorFlowEventCounters* counters);
+
 /* instructs the event manager to start waiting for events from all registered descriptors.
  * when events occur, the registered callback functions will be executed. */
 gboolean torfloweventmanager_runMainLoop(TorFlowEventManager* manager);
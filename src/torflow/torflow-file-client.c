@@ -3,6 +3,7 @@
  * See LICENSE for licensing information
  */
 
+#define TORFLOW_LOG_CATEGORY TORFLOW_LOG_FILECLIENT
 #include "torflow.h"
 
 #define BUFSIZE 16384
@@ -112,8 +113,7 @@ beginsocks:
 
         /* next we wait for socks init response */
         client->state = TORFLOWSOCKSCLIENT_SOCKSRECVINIT;
-        torfloweventmanager_register(client->manager, client->descriptor, TORFLOW_EV_READ,
-                        (TorFlowOnEventFunc)_torflowfileclient_state, client);
+        torfloweventmanager_setInterest(client->manager, client->descriptor, TORFLOW_EV_READ);
         break;
     }
 
@@ -158,8 +158,7 @@ beginsocks:
 
         /* next we write socks connect command */
         client->state = TORFLOWSOCKSCLIENT_SOCKSSENDCONNECT;
-        torfloweventmanager_register(client->manager, client->descriptor, TORFLOW_EV_WRITE,
-                        (TorFlowOnEventFunc)_torflowfileclient_state, client);
+        torfloweventmanager_setInterest(client->manager, client->descriptor, TORFLOW_EV_WRITE);
 
         break;
     }
@@ -214,8 +213,7 @@ beginsocks:
 
         /* next we receive the socks connect response */
         client->state = TORFLOWSOCKSCLIENT_SOCKSRECVCONNECT;
-        torfloweventmanager_register(client->manager, client->descriptor, TORFLOW_EV_READ,
-                        (TorFlowOnEventFunc)_torflowfileclient_state, client);
+        torfloweventmanager_setInterest(client->manager, client->descriptor, TORFLOW_EV_READ);
         break;
     }
 
@@ -264,8 +262,7 @@ beginsocks:
 
             /* next write the request */
             client->state = TORFLOWSOCKSCLIENT_HTTPSENDREQUEST;
-            torfloweventmanager_register(client->manager, client->descriptor, TORFLOW_EV_WRITE,
-                            (TorFlowOnEventFunc)_torflowfileclient_state, client);
+            torfloweventmanager_setInterest(client->manager, client->descriptor, TORFLOW_EV_WRITE);
         } else if(client->recvbuf[0] == 0x05 && client->recvbuf[1] == 0x06 && client->recvbuf[2] == 0x00 && client->recvbuf[3] == 0x01) {
             message("%s: socks connect timed out", client->id);
             client->state = TORFLOWSOCKSCLIENT_ERROR;
@@ -326,8 +323,10 @@ beginsocks:
         client->remaining = client->transferSizeBytes;
         client->nextRecvPercLog = 20.0f;
         client->state = TORFLOWSOCKSCLIENT_HTTPRECVREPLY;
-        torfloweventmanager_register(client->manager, client->descriptor, TORFLOW_EV_READ,
-                        (TorFlowOnEventFunc)_torflowfileclient_state, client);
+        torfloweventmanager_setInterest(client->manager, client->descriptor, TORFLOW_EV_READ);
+
+        /* the download is bulk data, let other probes take their timing samples first */
+        torfloweventmanager_setPriority(client->manager, client->descriptor, TORFLOW_PRIORITY_LOW);
         break;
     }
 
@@ -416,13 +415,11 @@ beginsocks:
 static void _torflowfileclient_onConnected(TorFlowFileClient* client, TorFlowEventFlag type) {
     g_assert(client);
 
-    /* deregister so this function doesn't get called again */
-    torfloweventmanager_deregister(client->manager, client->descriptor);
-
     /* we are connected */
     client->state = TORFLOWSOCKSCLIENT_SOCKSSENDINIT;
 
-    /* we want to write the socks handshake next */
+    /* we want to write the socks handshake next. this swaps the callback
+     * on our existing watch so this function doesn't get called again */
     torfloweventmanager_register(client->manager, client->descriptor, TORFLOW_EV_WRITE,
                 (TorFlowOnEventFunc)_torflowfileclient_state, client);
 }
@@ -3,11 +3,13 @@
  * See LICENSE for licensing information
  */
 
+#define TORFLOW_LOG_CATEGORY TORFLOW_LOG_FILESERVER
 #include "torflow.h"
 
 struct _TorFlowFileListener {
     TorFlowEventManager* manager;
     in_port_t listenPort;
+    gboolean isPortShared;
 
     gint descriptor;
 
@@ -46,22 +48,11 @@ static void _torflowfilelistener_onFileServerComplete(TorFlowFileListener* liste
             g_hash_table_size(listener->servers));
 }
 
-static void _torflowfilelistener_onListenerReadable(TorFlowFileListener* listener, TorFlowEventFlag type) {
+static void _torflowfilelistener_onAccepted(TorFlowFileListener* listener, gint childDescriptor) {
     g_assert(listener);
 
-    if(!(type & TORFLOW_EV_READ)) {
-        return;
-    }
-
-    gint childDescriptor = accept(listener->descriptor, NULL, NULL);
-
-    if(childDescriptor < 0 && (errno == EWOULDBLOCK || errno == EAGAIN)) {
-        /* non-blocking, wait for the next one. really, this shouldn't happen since
-         * the descriptor is marked as readable we should be able to accept one. */
-        return;
-    }
-
-    if(childDescriptor == 0 || (childDescriptor < 0 && errno == EBADF)) {
+    /* the event manager already did the accept, errors come as negative errno values */
+    if(childDescriptor == 0 || childDescriptor == -EBADF) {
         /* the listener socket closed? lets try to build a new one */
         torfloweventmanager_deregister(listener->manager, listener->descriptor);
         close(listener->descriptor);
@@ -77,7 +68,7 @@ static void _torflowfilelistener_onListenerReadable(TorFlowFileListener* listene
 
     if(childDescriptor < 0) {
         warning("%s: unable to accept connection on listener socket %i: error %i in accept(): %s",
-             listener->id, listener->descriptor, errno, g_strerror(errno));
+             listener->id, listener->descriptor, -childDescriptor, g_strerror(-childDescriptor));
         return;
     }
 
@@ -109,6 +100,18 @@ static gboolean _torflowfilelistener_setupListener(TorFlowFileListener* listener
 
     socklen_t listenerLen = (socklen_t)sizeof(struct sockaddr_in);
 
+    /* every file server worker thread binds its own listener to the same port,
+     * and the kernel spreads the incoming connections across them */
+    if(listener->isPortShared) {
+        gint reusePort = 1;
+        if(setsockopt(listener->descriptor, SOL_SOCKET, SO_REUSEPORT, &reusePort, sizeof(gint)) < 0) {
+            /* the other threads could not bind the port without it */
+            warning("%s: unable to set SO_REUSEPORT on listener socket %i: error %i in setsockopt(): %s",
+                 listener->id, listener->descriptor, errno, g_strerror(errno));
+            return FALSE;
+        }
+    }
+
     /* bind the socket to the listener port */
     gint result = bind(listener->descriptor, (struct sockaddr *) &listenInfo, listenerLen);
     if(result < 0) {
@@ -125,19 +128,21 @@ static gboolean _torflowfilelistener_setupListener(TorFlowFileListener* listener
         return FALSE;
     }
 
-    /* notify us when we are ready to accept connects */
-    gboolean success = torfloweventmanager_register(listener->manager, listener->descriptor, TORFLOW_EV_READ,
-            (TorFlowOnEventFunc)_torflowfilelistener_onListenerReadable, listener);
+    /* notify us for every new connection */
+    gboolean success = torfloweventmanager_registerAccept(listener->manager, listener->descriptor,
+            (TorFlowOnAcceptFunc)_torflowfilelistener_onAccepted, listener);
 
     return success;
 }
 
-TorFlowFileListener* torflowfilelistener_new(TorFlowEventManager* manager, guint workerID, in_port_t listenPort) {
+TorFlowFileListener* torflowfilelistener_new(TorFlowEventManager* manager, guint workerID, in_port_t listenPort,
+        gboolean isPortShared) {
     TorFlowFileListener* listener = g_new0(TorFlowFileListener, 1);
 
     listener->manager = manager;
     listener->workerID = workerID;
     listener->listenPort = listenPort;
+    listener->isPortShared = isPortShared;
 
     /* hash table to store child connection objects */
     listener->servers = g_hash_table_new_full(g_direct_hash, g_direct_equal, NULL, (GDestroyNotify)torflowfileserver_free);
@@ -13,7 +13,9 @@
 
 typedef struct _TorFlowFileListener TorFlowFileListener;
 
-TorFlowFileListener* torflowfilelistener_new(TorFlowEventManager* manager, guint workerID, in_port_t listenPort);
+/* isPortShared lets the listeners of other file server threads bind the same port with SO_REUSEPORT */
+TorFlowFileListener* torflowfilelistener_new(TorFlowEventManager* manager, guint workerID, in_port_t listenPort,
+        gboolean isPortShared);
 void torflowfilelistener_free(TorFlowFileListener* listener);
 
 #endif /* SRC_TORFLOW_TORFLOW_FILE_LISTENER_H_ */
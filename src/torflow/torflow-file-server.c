@@ -3,10 +3,14 @@
  * See LICENSE for licensing information
  */
 
+#define TORFLOW_LOG_CATEGORY TORFLOW_LOG_FILESERVER
 #include "torflow.h"
 
 #define TORFLOW_FILESERVER_BUF_SIZE 64
 
+/* the most we send per callback before giving other descriptors a turn */
+#define TORFLOW_FILESERVER_SEND_BUDGET 65536
+
 struct _TorFlowFileServer {
     TorFlowEventManager* manager;
 
@@ -47,7 +51,15 @@ static void _torflowfileserver_onEventSendResponse(TorFlowFileServer* server, To
     gchar buffer[bufferSize];
     memset(buffer, 6, bufferSize);
 
+    gsize budget = TORFLOW_FILESERVER_SEND_BUDGET;
+
     while(TRUE) {
+        if(budget == 0) {
+            /* we are edge-triggered, so we have to ask to be called again */
+            torfloweventmanager_yield(server->manager, server->descriptor, TORFLOW_EV_WRITE);
+            break;
+        }
+
         gsize amountToSend = MIN(bufferSize, MAX(0, server->bytesRequested - server->bytesSent));
         gssize result = send(server->descriptor, buffer, amountToSend, 0);
 
@@ -73,6 +85,7 @@ static void _torflowfileserver_onEventSendResponse(TorFlowFileServer* server, To
         /* successful send */
         gsize amountSent = (gsize) result;
         server->bytesSent += amountSent;
+        budget -= MIN(budget, amountSent);
 
         if(server->bytesSent >= server->bytesRequested) {
             /* we finished sending everything */
@@ -131,9 +144,6 @@ static void _torflowfileserver_onEventReceiveRequest(TorFlowFileServer* server,
         gchar* suffix = g_strstr_len(server->buffer, (gssize)server->offset, "\r\n\r\n");
 
         if(suffix) {
-            /* we have the full request, stop waiting for read events */
-            torfloweventmanager_deregister(server->manager, server->descriptor);
-
             gchar* start = g_strstr_len(server->buffer, (gssize)server->offset, "TORFLOW GET ");
             if(!start) {
                 warning("%s: socket %i malformed request '%s', failing",
@@ -153,14 +163,20 @@ static void _torflowfileserver_onEventReceiveRequest(TorFlowFileServer* server,
             /* parse the value */
             server->bytesRequested = (gsize)g_ascii_strtoull(requestedBytesString, NULL, 10);
 
-            /* now we want to start sending the response */
-            gboolean success = torfloweventmanager_register(server->manager, server->descriptor, TORFLOW_EV_WRITE,
+            /* now we want to start sending the response instead of reading. this
+             * keeps our watch, and the edge-triggered MOD reports that we are writable */
+            gboolean success = torfloweventmanager_register(server->manager, server->descriptor,
+                        TORFLOW_EV_WRITE|TORFLOW_EV_EDGETRIGGERED,
                         (TorFlowOnEventFunc)_torflowfileserver_onEventSendResponse, server);
 
             if(!success) {
                 warning("%s: socket %i can't wait for write events, failing", server->id, server->descriptor);
                 _torflowfileserver_finish(server, FALSE);
+                return;
             }
+
+            /* the response is bulk data, new requests go first */
+            torfloweventmanager_setPriority(server->manager, server->descriptor, TORFLOW_PRIORITY_LOW);
             return;
         }
 
@@ -182,7 +198,9 @@ TorFlowFileServer* torflowfileserver_new(TorFlowEventManager* manager, guint wor
     g_string_printf(idbuf, "Worker%u-FileServer-FD%i", workerID, descriptor);
     server->id = g_string_free(idbuf, FALSE);
 
-    gboolean success = torfloweventmanager_register(server->manager, server->descriptor, TORFLOW_EV_READ,
+    /* we always read and write until EAGAIN, so edge-triggered events are enough */
+    gboolean success = torfloweventmanager_register(server->manager, server->descriptor,
+            TORFLOW_EV_READ|TORFLOW_EV_EDGETRIGGERED,
             (TorFlowOnEventFunc)_torflowfileserver_onEventReceiveRequest, server);
 
     return server;
@@ -0,0 +1,272 @@
+/*
+ * The Shadow Simulator
+ * See LICENSE for licensing information
+ */
+
+#include "torflow.h"
+
+/* the size of the log buffer, and how full it may get before we write it out */
+#define TORFLOW_LOG_BUFFER_SIZE 65536
+#define TORFLOW_LOG_FLUSH_THRESHOLD (TORFLOW_LOG_BUFFER_SIZE / 2)
+
+/* "YYYY-MM-DD HH:MM:SS <unix seconds>." */
+#define TORFLOW_LOG_TIMESTAMP_SIZE 64
+
+/* rate limited call sites log at most this many messages per window */
+#define TORFLOW_LOG_RATE_LIMIT_BURST 10
+#define TORFLOW_LOG_RATE_LIMIT_SECONDS 10
+
+GLogLevelFlags torflowLogLevels[TORFLOW_LOG_NUM_CATEGORIES] = {
+    [0 ... TORFLOW_LOG_NUM_CATEGORIES-1] = G_LOG_LEVEL_INFO
+};
+
+/* the names used for the categories in the config */
+static const gchar* torflowLogCategoryNames[TORFLOW_LOG_NUM_CATEGORIES] = {
+    [TORFLOW_LOG_GENERAL] = "general",
+    [TORFLOW_LOG_EVENTMANAGER] = "eventmanager",
+    [TORFLOW_LOG_TORCTL] = "torctl",
+    [TORFLOW_LOG_FILECLIENT] = "fileclient",
+    [TORFLOW_LOG_FILESERVER] = "fileserver",
+    [TORFLOW_LOG_SLICE] = "slice",
+    [TORFLOW_LOG_DATABASE] = "database",
+};
+
+/* file server worker threads log too, so everything below is guarded by the lock */
+static GMutex torflowLogLock;
+
+static gchar torflowLogBuffer[TORFLOW_LOG_BUFFER_SIZE];
+static gsize torflowLogBufferLength = 0;
+
+/* the timestamp prefix only changes once per second, so we format it once per second */
+static time_t torflowLogTimestampSecond = 0;
+static gchar torflowLogTimestamp[TORFLOW_LOG_TIMESTAMP_SIZE];
+static gsize torflowLogTimestampLength = 0;
+
+static const gchar* _torflow_logLevelToString(GLogLevelFlags logLevel) {
+    switch (logLevel) {
+        case G_LOG_LEVEL_ERROR:
+            return "error";
+        case G_LOG_LEVEL_CRITICAL:
+            return "critical";
+        case G_LOG_LEVEL_WARNING:
+            return "warning";
+        case G_LOG_LEVEL_MESSAGE:
+            return "message";
+        case G_LOG_LEVEL_INFO:
+            return "info";
+        case G_LOG_LEVEL_DEBUG:
+            return "debug";
+        default:
+            return "default";
+    }
+}
+
+static void _torflow_writeLog(const gchar* buffer, gsize length) {
+    gsize offset = 0;
+
+    while(offset < length) {
+        ssize_t result = write(STDOUT_FILENO, &buffer[offset], length - offset);
+        if(result < 0 && errno == EINTR) {
+            continue;
+        } else if(result <= 0) {
+            /* nowhere to report this, drop the rest */
+            return;
+        }
+        offset += (gsize)result;
+    }
+}
+
+static void _torflow_flushLogLocked() {
+    if(torflowLogBufferLength > 0) {
+        _torflow_writeLog(torflowLogBuffer, torflowLogBufferLength);
+        torflowLogBufferLength = 0;
+    }
+}
+
+static void _torflow_updateLogTimestamp(struct timespec* now) {
+    if(now->tv_sec == torflowLogTimestampSecond && torflowLogTimestampLength > 0) {
+        return;
+    }
+
+    struct tm local;
+    localtime_r(&now->tv_sec, &local);
+
+    gint length = g_snprintf(torflowLogTimestamp, TORFLOW_LOG_TIMESTAMP_SIZE,
+            "%04i-%02i-%02i %02i:%02i:%02i %"G_GINT64_FORMAT".",
+            local.tm_year + 1900, local.tm_mon + 1, local.tm_mday,
+            local.tm_hour, local.tm_min, local.tm_sec, (gint64)now->tv_sec);
+
+    torflowLogTimestampSecond = now->tv_sec;
+    torflowLogTimestampLength = (gsize)MIN(MAX(length, 0), TORFLOW_LOG_TIMESTAMP_SIZE - 1);
+}
+
+/* formats the record at the end of the buffer and returns TRUE if it fit. if it
+ * did not fit nothing is added, and recordLength says how much space it needs. */
+static gboolean _torflow_formatLogRecord(struct timespec* now, GLogLevelFlags level,
+        const gchar* functionName, const gchar* format, va_list vargs, gsize* recordLength) {
+    gchar* start = &torflowLogBuffer[torflowLogBufferLength];
+    gsize space = TORFLOW_LOG_BUFFER_SIZE - torflowLogBufferLength;
+
+    gsize length = torflowLogTimestampLength;
+    if(length < space) {
+        memcpy(start, torflowLogTimestamp, length);
+    }
+
+    gint result = g_snprintf(length < space ? &start[length] : NULL, length < space ? space - length : 0,
+            "%06li [%s] [%s] ", (glong)(now->tv_nsec / 1000), _torflow_logLevelToString(level), functionName);
+    length += (gsize)MAX(result, 0);
+
+    result = g_vsnprintf(length < space ? &start[length] : NULL, length < space ? space - length : 0,
+            format, vargs);
+    length += (gsize)MAX(result, 0);
+
+    if(length < space) {
+        start[length] = '\n';
+    }
+    length++;
+
+    *recordLength = length;
+
+    if(length <= space) {
+        torflowLogBufferLength += length;
+        return TRUE;
+    } else {
+        return FALSE;
+    }
+}
+
+static void _torflow_appendLogLocked(struct timespec* now, GLogLevelFlags level,
+        const gchar* functionName, const gchar* format, va_list vargs) {
+    _torflow_updateLogTimestamp(now);
+
+    gsize length = 0;
+    va_list attemptArgs;
+
+    va_copy(attemptArgs, vargs);
+    gboolean isBuffered = _torflow_formatLogRecord(now, level, functionName, format, attemptArgs, &length);
+    va_end(attemptArgs);
+
+    if(!isBuffered && length <= TORFLOW_LOG_BUFFER_SIZE) {
+        /* it did not fit, make room and try again */
+        _torflow_flushLogLocked();
+
+        va_copy(attemptArgs, vargs);
+        isBuffered = _torflow_formatLogRecord(now, level, functionName, format, attemptArgs, &length);
+        va_end(attemptArgs);
+    }
+
+    if(!isBuffered) {
+        /* larger than the whole buffer, this one gets its own allocation */
+        _torflow_flushLogLocked();
+
+        va_copy(attemptArgs, vargs);
+        gchar* message = g_strdup_vprintf(format, attemptArgs);
+        va_end(attemptArgs);
+
+        gchar* record = g_strdup_printf("%.*s%06li [%s] [%s] %s\n",
+                (gint)torflowLogTimestampLength, torflowLogTimestamp, (glong)(now->tv_nsec / 1000),
+                _torflow_logLevelToString(level), functionName, message);
+        _torflow_writeLog(record, strlen(record));
+
+        g_free(record);
+        g_free(message);
+    }
+
+    /* don't let problems sit in the buffer, and write in large batches otherwise */
+    if(level <= G_LOG_LEVEL_WARNING || torflowLogBufferLength >= TORFLOW_LOG_FLUSH_THRESHOLD) {
+        _torflow_flushLogLocked();
+    }
+}
+
+static void _torflow_appendLogFormatLocked(struct timespec* now, GLogLevelFlags level,
+        const gchar* functionName, const gchar* format, ...) {
+    va_list vargs;
+    va_start(vargs, format);
+    _torflow_appendLogLocked(now, level, functionName, format, vargs);
+    va_end(vargs);
+}
+
+void torflow_setLogLevel(TorFlowLogCategory category, GLogLevelFlags level) {
+    g_assert(category < TORFLOW_LOG_NUM_CATEGORIES);
+    torflowLogLevels[category] = level;
+}
+
+gboolean torflow_getLogCategory(const gchar* name, TorFlowLogCategory* category) {
+    g_assert(name);
+
+    for(gint i = 0; i < TORFLOW_LOG_NUM_CATEGORIES; i++) {
+        if(!g_ascii_strcasecmp(name, torflowLogCategoryNames[i])) {
+            if(category) {
+                *category = (TorFlowLogCategory)i;
+            }
+            return TRUE;
+        }
+    }
+
+    return FALSE;
+}
+
+void torflow_log(TorFlowLogCategory category, GLogLevelFlags level,
+        const gchar* functionName, const gchar* format, ...) {
+    if(level > torflowLogLevels[category]) {
+        return;
+    }
+
+    struct timespec now;
+    clock_gettime(CLOCK_REALTIME, &now);
+
+    g_mutex_lock(&torflowLogLock);
+
+    va_list vargs;
+    va_start(vargs, format);
+    _torflow_appendLogLocked(&now, level, functionName, format, vargs);
+    va_end(vargs);
+
+    g_mutex_unlock(&torflowLogLock);
+}
+
+void torflow_logLimited(TorFlowLogRateLimit* limit, TorFlowLogCategory category, GLogLevelFlags level,
+        const gchar* functionName, const gchar* format, ...) {
+    g_assert(limit);
+
+    if(level > torflowLogLevels[category]) {
+        return;
+    }
+
+    struct timespec now;
+    clock_gettime(CLOCK_REALTIME, &now);
+
+    g_mutex_lock(&torflowLogLock);
+
+    if((gint64)now.tv_sec >= limit->windowStartSeconds + TORFLOW_LOG_RATE_LIMIT_SECONDS) {
+        /* a new window starts, tell them what they missed in the last one */
+        if(limit->numSuppressed > 0) {
+            _torflow_appendLogFormatLocked(&now, level, functionName,
+                    "suppressed %u similar messages in the last %i seconds",
+                    limit->numSuppressed, TORFLOW_LOG_RATE_LIMIT_SECONDS);
+        }
+
+        limit->windowStartSeconds = (gint64)now.tv_sec;
+        limit->numLogged = 0;
+        limit->numSuppressed = 0;
+    }
+
+    if(limit->numLogged < TORFLOW_LOG_RATE_LIMIT_BURST) {
+        limit->numLogged++;
+
+        va_list vargs;
+        va_start(vargs, format);
+        _torflow_appendLogLocked(&now, level, functionName, format, vargs);
+        va_end(vargs);
+    } else {
+        limit->numSuppressed++;
+    }
+
+    g_mutex_unlock(&torflowLogLock);
+}
+
+void torflow_flushLog() {
+    g_mutex_lock(&torflowLogLock);
+    _torflow_flushLogLocked();
+    g_mutex_unlock(&torflowLogLock);
+}
@@ -0,0 +1,94 @@
+/*
+ * The Shadow Simulator
+ * See LICENSE for licensing information
+ */
+
+
+#ifndef SRC_TORFLOW_TORFLOW_LOGGER_H_
+#define SRC_TORFLOW_TORFLOW_LOGGER_H_
+
+#include <glib.h>
+
+/* every subsystem logs in its own category with its own level. a source file
+ * picks its category by defining TORFLOW_LOG_CATEGORY before including torflow.h. */
+typedef enum _TorFlowLogCategory TorFlowLogCategory;
+enum _TorFlowLogCategory {
+    TORFLOW_LOG_GENERAL,
+    TORFLOW_LOG_EVENTMANAGER,
+    TORFLOW_LOG_TORCTL,
+    TORFLOW_LOG_FILECLIENT,
+    TORFLOW_LOG_FILESERVER,
+    TORFLOW_LOG_SLICE,
+    TORFLOW_LOG_DATABASE,
+    TORFLOW_LOG_NUM_CATEGORIES,
+};
+
+#ifndef TORFLOW_LOG_CATEGORY
+#define TORFLOW_LOG_CATEGORY TORFLOW_LOG_GENERAL
+#endif
+
+/* messages less severe than this are compiled out, see TORFLOW_LOG_COMPILE_LEVEL in CMakeLists.txt */
+#ifndef TORFLOW_LOG_COMPILE_LEVEL
+#define TORFLOW_LOG_COMPILE_LEVEL G_LOG_LEVEL_DEBUG
+#endif
+
+/* messages less severe than the level of their category are dropped before their
+ * arguments are evaluated. set from the config at startup. */
+extern GLogLevelFlags torflowLogLevels[TORFLOW_LOG_NUM_CATEGORIES];
+
+/* per call site state for rate limited messages, see TORFLOW_LOG_LIMITED */
+typedef struct _TorFlowLogRateLimit TorFlowLogRateLimit;
+struct _TorFlowLogRateLimit {
+    gint64 windowStartSeconds;
+    guint numLogged;
+    guint numSuppressed;
+};
+
+/* sets the level of the given category */
+void torflow_setLogLevel(TorFlowLogCategory category, GLogLevelFlags level);
+
+/* returns TRUE and sets category if name is the name of a log category, e.g. "torctl" */
+gboolean torflow_getLogCategory(const gchar* name, TorFlowLogCategory* category);
+
+/* formats a message into the log buffer. the buffer is written out in large
+ * batches, and right away for warnings and more severe messages. */
+void torflow_log(TorFlowLogCategory category, GLogLevelFlags level,
+        const gchar* functionName, const gchar* format, ...);
+
+/* like torflow_log, but drops the message if its call site already logged too many in
+ * the current window, and reports how many were dropped when the next window starts. */
+void torflow_logLimited(TorFlowLogRateLimit* limit, TorFlowLogCategory category, GLogLevelFlags level,
+        const gchar* functionName, const gchar* format, ...);
+
+/* writes out everything in the log buffer. the event manager calls this
+ * before it blocks waiting for events, and main calls it before exiting. */
+void torflow_flushLog();
+
+#define TORFLOW_LOG_IS_ENABLED(level) \
+    ((level) <= TORFLOW_LOG_COMPILE_LEVEL && (level) <= torflowLogLevels[TORFLOW_LOG_CATEGORY])
+
+#define TORFLOW_LOG(level, ...) do { \
+    if(TORFLOW_LOG_IS_ENABLED(level)) { \
+        torflow_log(TORFLOW_LOG_CATEGORY, (level), __FUNCTION__, __VA_ARGS__); \
+    } \
+} while(0)
+
+/* for messages that may be logged for every event, e.g., for every stream */
+#define TORFLOW_LOG_LIMITED(level, ...) do { \
+    static TorFlowLogRateLimit torflowLogRateLimit; \
+    if(TORFLOW_LOG_IS_ENABLED(level)) { \
+        torflow_logLimited(&torflowLogRateLimit, TORFLOW_LOG_CATEGORY, (level), __FUNCTION__, __VA_ARGS__); \
+    } \
+} while(0)
+
+#define debug(...) TORFLOW_LOG(G_LOG_LEVEL_DEBUG, __VA_ARGS__)
+#define info(...) TORFLOW_LOG(G_LOG_LEVEL_INFO, __VA_ARGS__)
+#define message(...) TORFLOW_LOG(G_LOG_LEVEL_MESSAGE, __VA_ARGS__)
+#define warning(...) TORFLOW_LOG(G_LOG_LEVEL_WARNING, __VA_ARGS__)
+#define critical(...) TORFLOW_LOG(G_LOG_LEVEL_CRITICAL, __VA_ARGS__)
+#define error(...) TORFLOW_LOG(G_LOG_LEVEL_ERROR, __VA_ARGS__)
+
+#define debug_limited(...) TORFLOW_LOG_LIMITED(G_LOG_LEVEL_DEBUG, __VA_ARGS__)
+#define info_limited(...) TORFLOW_LOG_LIMITED(G_LOG_LEVEL_INFO, __VA_ARGS__)
+
+#endif /* SRC_TORFLOW_TORFLOW_LOGGER_H_ */
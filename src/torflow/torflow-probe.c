@@ -8,20 +8,30 @@
 struct _TorFlowProbe {
     /* un-owned objects (we don't free these) */
     TorFlowEventManager* manager;
+    /* the authority's controller, shared by all probes */
+    TorFlowTorCtlClient* torctl;
 
+    OnProbeReadyFunc onProbeReady;
+    gpointer onProbeReadyArg;
     OnProbeCompleteFunc onProbeComplete;
     gpointer onProbeCompleteArg;
 
     /* our objects */
-    TorFlowTorCtlClient* torctl;
-    in_port_t controlPort;
+    TorFlowTorCtlCircuit* circuit;
     TorFlowFileClient* fileClient;
     in_port_t socksPort;
 
-    gchar* entryRelayIdentity;
-    gchar* exitRelayIdentity;
+    TorFlowRelayHandle entryRelay;
+    TorFlowRelayHandle exitRelay;
+    /* "ENTRY,EXIT" in hex, for EXTENDCIRCUIT */
+    gchar circuitPath[2*TORFLOW_RELAY_IDENTITY_SIZE];
     TorFlowPeer* filePeer;
     gsize transferSize;
+    guint timeoutSeconds;
+    TorFlowTimer* timeoutTimer;
+    /* the circuit is built and we wait until we may download */
+    gboolean isReady;
+    gboolean isStarted;
 
     gint circuitID;
     gint streamID;
@@ -38,6 +48,11 @@ static void _torflowprobe_onFileClientComplete(TorFlowProbe* probe, gboolean isS
         gsize contentLength, gsize roundTripTime, gsize payloadTime, gsize totalTime) {
     g_assert(probe);
 
+    /* we have a result, so we no longer need to time out */
+    if(probe->timeoutTimer) {
+        torflowtimer_cancel(probe->timeoutTimer);
+    }
+
     /* RTT: round-trip time; TTFB: time to first byte; TTLB: time to last byte */
     info("%s: Probe complete: Success=%s, Bytes=%zu, RTT=%zu, TTFB=%zu, TTLB=%zu",
             probe->id,
@@ -48,7 +63,7 @@ static void _torflowprobe_onFileClientComplete(TorFlowProbe* probe, gboolean isS
      * forward the result to the authority */
     if(probe->onProbeComplete) {
         probe->onProbeComplete(probe->onProbeCompleteArg, probe->workerID,
-                probe->entryRelayIdentity, probe->exitRelayIdentity, isSuccess,
+                probe->entryRelay, probe->exitRelay, isSuccess,
                 contentLength, roundTripTime, payloadTime, totalTime);
     }
 }
@@ -95,41 +110,59 @@ static void _torflowprobe_onStreamNew(TorFlowProbe* probe, gint streamID,
         gchar* sourceAddress, in_port_t sourcePort, gchar* targetAddress, in_port_t targetPort) {
     g_assert(probe);
 
-    /* only handle the stream if it's one of ours, otherwise the authority will
-     * attach other regular streams to circuits. */
-    in_port_t clientSocksPort = 0;
+    message("%s: new stream %i from source %s:%u to target %s:%u", probe->id,
+            streamID, sourceAddress, sourcePort, targetAddress, targetPort);
 
-    if(probe->fileClient) {
-        clientSocksPort = torflowfileclient_getHostClientSocksPort(probe->fileClient);
-    }
+    /* our file client created this stream, store the latest net info */
+    _torflowprobe_updateNetInfo(probe, targetAddress, targetPort, sourceAddress, sourcePort);
 
-    message("%s: new stream %i for port %u, probe port is %u", probe->id, streamID, sourcePort, clientSocksPort);
+    /* save the stream ID */
+    probe->streamID = streamID;
 
-    if(clientSocksPort > 0 && clientSocksPort == sourcePort) {
-        message("%s: new stream %i from source %s:%u to target %s:%u", probe->id,
-                streamID, sourceAddress, sourcePort, targetAddress, targetPort);
+    /* attach the stream to our already built circuit */
+    torflowtorctlclient_commandAttachStreamToCircuit(probe->torctl, probe->streamID, probe->circuitID,
+            (OnStreamSucceededFunc)_torflowprobe_onStreamSucceeded, probe);
+}
 
-        /* our file client created this stream, store the latest net info */
-        _torflowprobe_updateNetInfo(probe, targetAddress, targetPort, sourceAddress, sourcePort);
+static void _torflowprobe_onCircuitBuilt(TorFlowProbe* probe, gint circuitID) {
+    g_assert(probe);
+
+    message("%s: Tor controller successfully built new circuit %i", probe->id, circuitID);
 
-        /* save the stream ID */
-        probe->streamID = streamID;
+    probe->circuitID = circuitID;
+    probe->isReady = TRUE;
 
-        /* attach the stream to our already built circuit */
-        torflowtorctlclient_commandAttachStreamToCircuit(probe->torctl, probe->streamID, probe->circuitID,
-                (OnStreamSucceededFunc)_torflowprobe_onStreamSucceeded, probe);
+    if(probe->onProbeReady) {
+        /* a built circuit does not time out while it waits for a download slot */
+        if(probe->timeoutTimer) {
+            torflowtimer_cancel(probe->timeoutTimer);
+        }
+        probe->onProbeReady(probe->onProbeReadyArg, probe->workerID);
     } else {
-        info("%s: ignoring stream %i, source port %u doesn't match client port %u",
-                probe->id, streamID, sourcePort, clientSocksPort);
+        torflowprobe_start(probe);
     }
 }
 
-static void _torflowprobe_onCircuitBuilt(TorFlowProbe* probe, gint circuitID) {
+static void _torflowprobe_onCircuitClosed(TorFlowProbe* probe, gint circuitID) {
     g_assert(probe);
 
-    message("%s: Tor controller successfully built new circuit %i", probe->id, circuitID);
+    /* without its circuit the probe can't measure anything, so don't wait for the timeout.
+     * a probe waiting for a download slot also leaves the owner's queue this way. */
+    info("%s: circuit %i closed before the probe completed, canceling now", probe->id, circuitID);
+    _torflowprobe_onFileClientComplete(probe, FALSE, 0, 0, 0, 0);
+}
 
-    probe->circuitID = circuitID;
+void torflowprobe_start(TorFlowProbe* probe) {
+    g_assert(probe);
+    g_assert(probe->isReady);
+    g_assert(!probe->isStarted);
+
+    probe->isStarted = TRUE;
+
+    /* the download gets the whole timeout to itself */
+    if(probe->timeoutTimer) {
+        torflowtimer_arm(probe->timeoutTimer, probe->timeoutSeconds);
+    }
 
     message("%s: creating socks client to connect to Tor", probe->id);
 
@@ -144,73 +177,57 @@ static void _torflowprobe_onCircuitBuilt(TorFlowProbe* probe, gint circuitID) {
         return;
     }
 
-    /* get our client port so we can filter stream events */
+    /* the controller gives us the stream that comes from this port */
     in_port_t clientSocksPort = torflowfileclient_getHostClientSocksPort(probe->fileClient);
 
     message("%s: file client successful, waiting for stream on client port %u", probe->id, clientSocksPort);
 
-    /* start listening for new streams */
-    torflowtorctlclient_setNewStreamCallback(probe->torctl, clientSocksPort,
+    torflowtorctlclient_setCircuitStreamCallback(probe->torctl, probe->circuit, clientSocksPort,
             (OnStreamNewFunc)_torflowprobe_onStreamNew, probe);
 }
 
-static void _torflowprobe_onBootstrapped(TorFlowProbe* probe) {
-    g_assert(probe);
-
-    message("%s: Tor instance successfully bootstrapped", probe->id);
-
-    /* make sure we will get the response */
-    torflowtorctlclient_commandEnableEvents(probe->torctl);
-
-    GString* pathBuffer = g_string_new(NULL);
-    g_string_printf(pathBuffer, "%s,%s", probe->entryRelayIdentity, probe->exitRelayIdentity);
-
-    /* build a circuit and set up callbacks when it is built and when streams arrive on it */
-    torflowtorctlclient_commandBuildNewCircuit(probe->torctl, pathBuffer->str,
-            (OnCircuitBuiltFunc)_torflowprobe_onCircuitBuilt, probe);
-
-    g_string_free(pathBuffer, TRUE);
-}
-
-static void _torflowprobe_onAuthenticated(TorFlowProbe* probe) {
+static void _torflowprobe_onTimeoutTimerExpired(TorFlowProbe* probe, gpointer unused) {
     g_assert(probe);
 
-    message("%s: Tor controller successfully authenticated", probe->id);
+    info("%s: probe timed out, canceling now", probe->id);
 
-    torflowtorctlclient_commandGetBootstrapStatus(probe->torctl,
-            (OnBootstrappedFunc)_torflowprobe_onBootstrapped, probe);
-}
-
-static void _torflowprobe_onConnected(TorFlowProbe* probe) {
-    g_assert(probe);
-
-    message("%s: successfully connected to Tor control port", probe->id);
-
-    torflowtorctlclient_commandAuthenticate(probe->torctl,
-            (OnAuthenticatedFunc)_torflowprobe_onAuthenticated, probe);
+    /* this will cause our owner to free the probe */
+    torflowprobe_onTimeout(probe);
 }
 
 TorFlowProbe* torflowprobe_new(TorFlowEventManager* manager, guint workerID,
-        in_port_t controlPort, in_port_t socksPort, TorFlowPeer* filePeer, gsize transferSize,
-        const gchar* entryRelayIdentity, const gchar* exitRelayIdentity,
+        TorFlowTorCtlClient* torctl, in_port_t socksPort, TorFlowPeer* filePeer, gsize transferSize,
+        guint timeoutSeconds, TorFlowRelayTable* relays, TorFlowRelayHandle entryRelay, TorFlowRelayHandle exitRelay,
+        OnProbeReadyFunc onProbeReady, gpointer onProbeReadyArg,
         OnProbeCompleteFunc onProbeComplete, gpointer onProbeCompleteArg) {
     g_assert(manager);
+    g_assert(torctl);
     g_assert(filePeer);
+    g_assert(relays);
 
     TorFlowProbe* probe = g_new0(TorFlowProbe, 1);
 
     probe->manager = manager;
+    probe->torctl = torctl;
 
     probe->workerID = workerID;
-    probe->controlPort = controlPort;
     probe->socksPort = socksPort;
 
-    probe->exitRelayIdentity = g_strdup(exitRelayIdentity);
-    probe->entryRelayIdentity = g_strdup(entryRelayIdentity);
+    probe->entryRelay = entryRelay;
+    probe->exitRelay = exitRelay;
+
+    gchar entryIdentity[TORFLOW_RELAY_IDENTITY_SIZE];
+    gchar exitIdentity[TORFLOW_RELAY_IDENTITY_SIZE];
+    g_snprintf(probe->circuitPath, sizeof(probe->circuitPath), "%s,%s",
+            torflowrelaytable_formatIdentity(relays, entryRelay, entryIdentity),
+            torflowrelaytable_formatIdentity(relays, exitRelay, exitIdentity));
     probe->filePeer = filePeer;
     torflowpeer_ref(filePeer);
     probe->transferSize = transferSize;
+    probe->timeoutSeconds = timeoutSeconds;
 
+    probe->onProbeReady = onProbeReady;
+    probe->onProbeReadyArg = onProbeReadyArg;
     probe->onProbeComplete = onProbeComplete;
     probe->onProbeCompleteArg = onProbeCompleteArg;
 
@@ -219,16 +236,18 @@ TorFlowProbe* torflowprobe_new(TorFlowEventManager* manager, guint workerID,
     g_string_printf(idbuf, "Worker%u-Probe", workerID);
     probe->id = g_string_free(idbuf, FALSE);
 
-    message("%s: creating control client to connect to Tor", probe->id);
+    message("%s: building circuit with path %s", probe->id, probe->circuitPath);
 
-    /* set up our torctl instance to get the descriptors before starting probers */
-    probe->torctl = torflowtorctlclient_new(manager, controlPort, workerID,
-            (OnConnectedFunc)_torflowprobe_onConnected, probe);
+    /* the controller is already bootstrapped, so all we need is a circuit */
+    probe->circuit = torflowtorctlclient_commandBuildNewCircuit(torctl, probe->circuitPath,
+            (OnCircuitBuiltFunc)_torflowprobe_onCircuitBuilt,
+            (OnCircuitClosedFunc)_torflowprobe_onCircuitClosed, probe);
 
-    if(probe->torctl == NULL) {
-        warning("%s: can't create Tor controller instance", probe->id);
-        torflowprobe_free(probe);
-        return NULL;
+    if(timeoutSeconds > 0) {
+        /* fail the probe if it does not complete in time */
+        probe->timeoutTimer = torfloweventmanager_createTimer(manager,
+                (GFunc)_torflowprobe_onTimeoutTimerExpired, probe, NULL);
+        torflowtimer_arm(probe->timeoutTimer, timeoutSeconds);
     }
 
     return probe;
@@ -237,11 +256,8 @@ TorFlowProbe* torflowprobe_new(TorFlowEventManager* manager, guint workerID,
 void torflowprobe_free(TorFlowProbe* probe) {
     g_assert(probe);
 
-    if(probe->exitRelayIdentity) {
-        g_free(probe->exitRelayIdentity);
-    }
-    if(probe->entryRelayIdentity) {
-        g_free(probe->entryRelayIdentity);
+    if(probe->timeoutTimer) {
+        torflowtimer_free(probe->timeoutTimer);
     }
 
     if(probe->fileClient) {
@@ -252,11 +268,8 @@ void torflowprobe_free(TorFlowProbe* probe) {
         torflowpeer_unref(probe->filePeer);
     }
 
-    if(probe->torctl) {
-        if(probe->circuitID) {
-            torflowtorctlclient_commandCloseCircuit(probe->torctl, probe->circuitID);
-        }
-        torflowtorctlclient_free(probe->torctl);
+    if(probe->circuit) {
+        torflowtorctlclient_commandCloseCircuit(probe->torctl, probe->circuit);
     }
 
     if(probe->id) {
@@ -275,6 +288,11 @@ in_port_t torflowprobe_getHostClientSocksPort(TorFlowProbe* probe) {
     return clientSocksPort;
 }
 
+gboolean torflowprobe_isStarted(TorFlowProbe* probe) {
+    g_assert(probe);
+    return probe->isStarted;
+}
+
 void torflowprobe_onTimeout(TorFlowProbe* probe) {
     g_assert(probe);
     _torflowprobe_onFileClientComplete(probe, FALSE, 0, 0, 0, 0);
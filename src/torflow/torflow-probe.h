@@ -11,16 +11,23 @@
 
 typedef struct _TorFlowProbe TorFlowProbe;
 
+typedef void (*OnProbeReadyFunc)(gpointer userData, guint workerID);
 typedef void (*OnProbeCompleteFunc)(gpointer userData, guint workerID,
-        gchar* entryIdentity, gchar* exitIdentity, gboolean isSuccess,
+        TorFlowRelayHandle entryRelay, TorFlowRelayHandle exitRelay, gboolean isSuccess,
         gsize contentLength, gsize roundTripTime, gsize payloadTime, gsize totalTime);
 
 TorFlowProbe* torflowprobe_new(TorFlowEventManager* manager, guint workerID,
-        in_port_t controlPort, in_port_t socksPort, TorFlowPeer* filePeer, gsize transferSize,
-        const gchar* entryRelayIdentity, const gchar* exitRelayIdentity,
+        TorFlowTorCtlClient* torctl, in_port_t socksPort, TorFlowPeer* filePeer, gsize transferSize,
+        guint timeoutSeconds, TorFlowRelayTable* relays, TorFlowRelayHandle entryRelay, TorFlowRelayHandle exitRelay,
+        OnProbeReadyFunc onProbeReady, gpointer onProbeReadyArg,
         OnProbeCompleteFunc onProbeComplete, gpointer onProbeCompleteArg);
 void torflowprobe_free(TorFlowProbe* probe);
 
+/* probes build their circuit right away. with a ready callback, they wait once it is built
+ * until they are started, otherwise they start downloading on their own. */
+void torflowprobe_start(TorFlowProbe* probe);
+gboolean torflowprobe_isStarted(TorFlowProbe* probe);
+
 in_port_t torflowprobe_getHostClientSocksPort(TorFlowProbe* probe);
 void torflowprobe_onTimeout(TorFlowProbe* probe);
 
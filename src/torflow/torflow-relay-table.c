@@ -0,0 +1,627 @@
+/*
+ * The Shadow Simulator
+ * See LICENSE for licensing information
+ */
+
+#define TORFLOW_LOG_CATEGORY TORFLOW_LOG_DATABASE
+#include "torflow.h"
+
+/* how many relays we make room for at first, the table doubles when it fills */
+#define TORFLOW_RELAY_TABLE_INITIAL_CAPACITY 1024
+
+/* the aggregation kernel works on this many relays at a time, so its temporaries stay in L1 */
+#define TORFLOW_RELAY_TABLE_KERNEL_BLOCK 256
+
+#define TORFLOW_RELAY_FLAG_RUNNING (1 << 0)
+#define TORFLOW_RELAY_FLAG_FAST (1 << 1)
+#define TORFLOW_RELAY_FLAG_EXIT (1 << 2)
+
+/* one download through the relay, kept together so a scan touches one cache line per sample */
+typedef struct _TorFlowRelayMeasurement TorFlowRelayMeasurement;
+struct _TorFlowRelayMeasurement {
+    guint64 contentLength;
+    guint32 roundTripTime;
+    guint32 totalTime;
+};
+
+/* every relay attribute lives in its own array indexed by the relay handle,
+ * so a pass over one attribute of all relays reads contiguous memory */
+struct _TorFlowRelayTable {
+    /* the number of relays, and how many fit in the arrays. slot 0 is never used. */
+    guint numRelays;
+    guint capacity;
+
+    guint8* fingerprints;
+    gchar* nicknames;
+    guint8* flags;
+
+    guint* v3Bandwidths;
+    guint* descriptorBandwidths;
+    guint* advertisedBandwidths;
+    /* estimates from an earlier scan, which stand in for a relay until it has measurements */
+    guint* priorBandwidths;
+
+    /* a ring of the newest ringSize measurements per relay. it holds exactly the measurements we
+     * aggregate, and the oldest one is overwritten when it is full, so memory stays the same across rounds. */
+    guint ringSize;
+    TorFlowRelayMeasurement* measurements;
+    guint8* nextMeasurements;
+    guint8* numMeasurements;
+
+    /* bytes per millisecond of every measurement, divided once when it is added. stored by ring
+     * slot first, i.e., slot i of every relay is in row i, so the kernel can work on many relays
+     * at once with plain vector loads. */
+    gdouble* sampleBandwidths;
+
+    /* every relay's mean and filtered bandwidth over its ring, updated as measurements land */
+    guint* meanBandwidths;
+    guint* filteredBandwidths;
+
+    /* running sums of the above over the measureable relays */
+    TorFlowRelayTotals totals;
+
+    /* open addressing hash index from fingerprint to handle, 0 marks an empty slot */
+    TorFlowRelayHandle* index;
+    guint indexSize;
+};
+
+static guint _torflowrelaytable_hash(const guint8* fingerprint) {
+    /* fingerprints are hashes already, so any 4 bytes of them are as good as it gets */
+    guint32 hash;
+    memcpy(&hash, fingerprint, sizeof(hash));
+    return (guint)hash;
+}
+
+static const guint8* _torflowrelaytable_fingerprint(TorFlowRelayTable* table, TorFlowRelayHandle relay) {
+    return &table->fingerprints[(gsize)relay * TORFLOW_RELAY_FINGERPRINT_SIZE];
+}
+
+static guint _torflowrelaytable_findSlot(TorFlowRelayTable* table, const guint8* fingerprint) {
+    guint mask = table->indexSize - 1;
+    guint slot = _torflowrelaytable_hash(fingerprint) & mask;
+
+    /* the index is never more than half full, so we always hit an empty slot */
+    while(table->index[slot] != TORFLOW_RELAY_INVALID_HANDLE) {
+        const guint8* stored = _torflowrelaytable_fingerprint(table, table->index[slot]);
+        if(!memcmp(stored, fingerprint, TORFLOW_RELAY_FINGERPRINT_SIZE)) {
+            break;
+        }
+        slot = (slot + 1) & mask;
+    }
+
+    return slot;
+}
+
+static void _torflowrelaytable_rebuildIndex(TorFlowRelayTable* table, guint indexSize) {
+    g_free(table->index);
+
+    table->indexSize = indexSize;
+    table->index = g_new0(TorFlowRelayHandle, indexSize);
+
+    for(TorFlowRelayHandle relay = 1; relay <= table->numRelays; relay++) {
+        guint slot = _torflowrelaytable_findSlot(table, _torflowrelaytable_fingerprint(table, relay));
+        table->index[slot] = relay;
+    }
+}
+
+#define _TORFLOW_RELAY_TABLE_GROW(array, oldCapacity, newCapacity, stride) do { \
+    (array) = g_realloc((array), (gsize)(newCapacity) * (stride) * sizeof(*(array))); \
+    memset(&(array)[(gsize)(oldCapacity) * (stride)], 0, \
+            (gsize)((newCapacity) - (oldCapacity)) * (stride) * sizeof(*(array))); \
+} while(0)
+
+static void _torflowrelaytable_grow(TorFlowRelayTable* table, guint capacity) {
+    guint oldCapacity = table->capacity;
+
+    _TORFLOW_RELAY_TABLE_GROW(table->fingerprints, oldCapacity, capacity, TORFLOW_RELAY_FINGERPRINT_SIZE);
+    _TORFLOW_RELAY_TABLE_GROW(table->nicknames, oldCapacity, capacity, TORFLOW_RELAY_NICKNAME_SIZE);
+    _TORFLOW_RELAY_TABLE_GROW(table->flags, oldCapacity, capacity, 1);
+    _TORFLOW_RELAY_TABLE_GROW(table->v3Bandwidths, oldCapacity, capacity, 1);
+    _TORFLOW_RELAY_TABLE_GROW(table->descriptorBandwidths, oldCapacity, capacity, 1);
+    _TORFLOW_RELAY_TABLE_GROW(table->advertisedBandwidths, oldCapacity, capacity, 1);
+    _TORFLOW_RELAY_TABLE_GROW(table->priorBandwidths, oldCapacity, capacity, 1);
+    _TORFLOW_RELAY_TABLE_GROW(table->measurements, oldCapacity, capacity, table->ringSize);
+    _TORFLOW_RELAY_TABLE_GROW(table->nextMeasurements, oldCapacity, capacity, 1);
+    _TORFLOW_RELAY_TABLE_GROW(table->numMeasurements, oldCapacity, capacity, 1);
+
+    /* the rows get longer, so every row has to move */
+    gdouble* sampleBandwidths = g_new0(gdouble, (gsize)capacity * table->ringSize);
+    for(guint i = 0; oldCapacity > 0 && i < table->ringSize; i++) {
+        memcpy(&sampleBandwidths[(gsize)i * capacity], &table->sampleBandwidths[(gsize)i * oldCapacity],
+                oldCapacity * sizeof(gdouble));
+    }
+    g_free(table->sampleBandwidths);
+    table->sampleBandwidths = sampleBandwidths;
+    _TORFLOW_RELAY_TABLE_GROW(table->meanBandwidths, oldCapacity, capacity, 1);
+    _TORFLOW_RELAY_TABLE_GROW(table->filteredBandwidths, oldCapacity, capacity, 1);
+
+    table->capacity = capacity;
+
+    /* keep the index at most half full */
+    _torflowrelaytable_rebuildIndex(table, 2 * capacity);
+}
+
+static void _torflowrelaytable_setFlag(TorFlowRelayTable* table, TorFlowRelayHandle relay,
+        guint8 flag, gboolean isSet) {
+    if(isSet) {
+        table->flags[relay] |= flag;
+    } else {
+        table->flags[relay] &= ~flag;
+    }
+}
+
+static inline gboolean _torflowrelaytable_isMeasureable(TorFlowRelayTable* table, TorFlowRelayHandle relay) {
+    // we should try to measure all relays; Fast and Running flags are only used to compute
+    // the fraction of measured relays for logging purposes in the real torflow
+    // https://gitweb.torproject.org/torflow.git/tree/NetworkScanners/BwAuthority/aggregate.py#n810
+    //return (table->flags[relay] & TORFLOW_RELAY_FLAG_RUNNING) ? TRUE : FALSE;
+    return TRUE;
+}
+
+/* recomputes one relay's bandwidths exactly like torflowrelaytable_computeBandwidths
+ * does, and moves the running totals along with them */
+static void _torflowrelaytable_updateBandwidths(TorFlowRelayTable* table, TorFlowRelayHandle relay) {
+    guint count = table->numMeasurements[relay];
+
+    gdouble sum = 0.0;
+    for(guint i = 0; i < table->ringSize; i++) {
+        sum += table->sampleBandwidths[(gsize)i * table->capacity + relay];
+    }
+    gint meanBW = (gint)(sum / (gdouble)(count + (count == 0)));
+
+    gdouble cutoff = (gdouble)meanBW;
+    gdouble filteredSum = 0.0;
+    guint numFiltered = 0;
+    for(guint i = 0; i < count; i++) {
+        gdouble sample = table->sampleBandwidths[(gsize)i * table->capacity + relay];
+        if(sample >= cutoff) {
+            filteredSum += sample;
+            numFiltered++;
+        }
+    }
+    gint filteredBW = (gint)(filteredSum / (gdouble)(numFiltered + (numFiltered == 0)));
+
+    if(_torflowrelaytable_isMeasureable(table, relay)) {
+        table->totals.totalMeanBW -= table->meanBandwidths[relay];
+        table->totals.totalMeanBW += (guint)meanBW;
+        table->totals.totalFilteredBW -= table->filteredBandwidths[relay];
+        table->totals.totalFilteredBW += (guint)filteredBW;
+    }
+
+    table->meanBandwidths[relay] = (guint)meanBW;
+    table->filteredBandwidths[relay] = (guint)filteredBW;
+}
+
+TorFlowRelayTable* torflowrelaytable_new(guint numMeasurementsPerRelay) {
+    g_assert(numMeasurementsPerRelay > 0 && numMeasurementsPerRelay <= TORFLOW_RELAY_MAX_MEASUREMENTS);
+
+    TorFlowRelayTable* table = g_new0(TorFlowRelayTable, 1);
+
+    table->ringSize = numMeasurementsPerRelay;
+
+    _torflowrelaytable_grow(table, TORFLOW_RELAY_TABLE_INITIAL_CAPACITY);
+
+    return table;
+}
+
+void torflowrelaytable_free(TorFlowRelayTable* table) {
+    g_assert(table);
+
+    g_free(table->fingerprints);
+    g_free(table->nicknames);
+    g_free(table->flags);
+    g_free(table->v3Bandwidths);
+    g_free(table->descriptorBandwidths);
+    g_free(table->advertisedBandwidths);
+    g_free(table->priorBandwidths);
+    g_free(table->measurements);
+    g_free(table->nextMeasurements);
+    g_free(table->numMeasurements);
+    g_free(table->sampleBandwidths);
+    g_free(table->meanBandwidths);
+    g_free(table->filteredBandwidths);
+    g_free(table->index);
+
+    g_free(table);
+}
+
+TorFlowRelayHandle torflowrelaytable_intern(TorFlowRelayTable* table, const guint8* fingerprint) {
+    g_assert(table);
+    g_assert(fingerprint);
+
+    guint slot = _torflowrelaytable_findSlot(table, fingerprint);
+    if(table->index[slot] != TORFLOW_RELAY_INVALID_HANDLE) {
+        return table->index[slot];
+    }
+
+    /* a new relay, make sure there is room for it. slot 0 is unused, hence the +1. */
+    if(table->numRelays + 1 >= table->capacity) {
+        _torflowrelaytable_grow(table, 2 * table->capacity);
+        slot = _torflowrelaytable_findSlot(table, fingerprint);
+    }
+
+    TorFlowRelayHandle relay = ++table->numRelays;
+    memcpy((guint8*)_torflowrelaytable_fingerprint(table, relay), fingerprint, TORFLOW_RELAY_FINGERPRINT_SIZE);
+    table->index[slot] = relay;
+
+    /* it has no measurements yet, so it adds nothing but itself to the totals */
+    if(_torflowrelaytable_isMeasureable(table, relay)) {
+        table->totals.numMeasuredRelays++;
+    }
+
+    return relay;
+}
+
+TorFlowRelayHandle torflowrelaytable_lookup(TorFlowRelayTable* table, const guint8* fingerprint) {
+    g_assert(table);
+    g_assert(fingerprint);
+
+    guint slot = _torflowrelaytable_findSlot(table, fingerprint);
+    return table->index[slot];
+}
+
+TorFlowRelayHandle torflowrelaytable_lookupIdentity(TorFlowRelayTable* table, const gchar* identity) {
+    g_assert(table);
+
+    if(!identity) {
+        return TORFLOW_RELAY_INVALID_HANDLE;
+    }
+
+    guint8 fingerprint[TORFLOW_RELAY_FINGERPRINT_SIZE];
+    if(!torflowrelaytable_parseIdentity(identity, fingerprint)) {
+        return TORFLOW_RELAY_INVALID_HANDLE;
+    }
+
+    return torflowrelaytable_lookup(table, fingerprint);
+}
+
+gboolean torflowrelaytable_parseIdentity(const gchar* identity, guint8* fingerprint) {
+    g_assert(identity);
+    g_assert(fingerprint);
+
+    /* tor writes identities with or without the leading '$' */
+    if(identity[0] == '$') {
+        identity++;
+    }
+
+    for(gint i = 0; i < TORFLOW_RELAY_FINGERPRINT_SIZE; i++) {
+        gint high = g_ascii_xdigit_value(identity[2*i]);
+        gint low = high < 0 ? -1 : g_ascii_xdigit_value(identity[2*i + 1]);
+        if(low < 0) {
+            return FALSE;
+        }
+        fingerprint[i] = (guint8)((high << 4) | low);
+    }
+
+    return TRUE;
+}
+
+guint torflowrelaytable_getNumRelays(TorFlowRelayTable* table) {
+    g_assert(table);
+    return table->numRelays;
+}
+
+gboolean torflowrelaytable_isMeasureable(TorFlowRelayTable* table, TorFlowRelayHandle relay) {
+    g_assert(table);
+    g_assert(relay > 0 && relay <= table->numRelays);
+    return _torflowrelaytable_isMeasureable(table, relay);
+}
+
+void torflowrelaytable_addMeasurement(TorFlowRelayTable* table, TorFlowRelayHandle relay,
+        gsize contentLength, gsize roundTripTime, gsize payloadTime, gsize totalTime) {
+    g_assert(table);
+    g_assert(relay > 0 && relay <= table->numRelays);
+
+    /* the ring fills from slot 0, so the valid slots are always the first numMeasurements */
+    guint next = table->nextMeasurements[relay];
+    TorFlowRelayMeasurement* measurement = &table->measurements[(gsize)relay * table->ringSize + next];
+    measurement->contentLength = (guint64)contentLength;
+    measurement->roundTripTime = (guint32)MIN(roundTripTime, G_MAXUINT32);
+    measurement->totalTime = (guint32)MIN(totalTime, G_MAXUINT32);
+
+    table->sampleBandwidths[(gsize)next * table->capacity + relay] = (gdouble)contentLength / (gdouble)MAX(totalTime, 1);
+
+    table->nextMeasurements[relay] = (guint8)((next + 1) % table->ringSize);
+    if(table->numMeasurements[relay] < table->ringSize) {
+        table->numMeasurements[relay]++;
+    }
+
+    _torflowrelaytable_updateBandwidths(table, relay);
+}
+
+void torflowrelaytable_computeBandwidths(TorFlowRelayTable* table, TorFlowRelayTotals* totals) {
+    g_assert(table);
+
+    guint64 totalMeanBW = 0;
+    guint64 totalFilteredBW = 0;
+    guint numMeasuredRelays = 0;
+
+    /* locals, so the compiler knows our stores don't change them */
+    const guint numRelays = table->numRelays;
+    const guint ringSize = table->ringSize;
+    const gsize rowLength = table->capacity;
+    const gdouble* sampleBandwidths = table->sampleBandwidths;
+
+    gdouble sums[TORFLOW_RELAY_TABLE_KERNEL_BLOCK];
+    gdouble cutoffs[TORFLOW_RELAY_TABLE_KERNEL_BLOCK];
+    gdouble filteredSums[TORFLOW_RELAY_TABLE_KERNEL_BLOCK];
+    guint numFiltered[TORFLOW_RELAY_TABLE_KERNEL_BLOCK];
+
+    /* every loop below runs across relays and has no branches, so the compiler turns them
+     * into vector code. relay handles start at 1, and so does the first block. */
+    for(guint first = 1; first <= numRelays; first += TORFLOW_RELAY_TABLE_KERNEL_BLOCK) {
+        guint length = MIN(TORFLOW_RELAY_TABLE_KERNEL_BLOCK, numRelays + 1 - first);
+        const guint8* numSamples = &table->numMeasurements[first];
+        guint* meanBWs = &table->meanBandwidths[first];
+        guint* filteredBWs = &table->filteredBandwidths[first];
+
+        /* mean bandwidth is the full mean bandwidth, i.e., no minimum required cutoff.
+         * slots we did not fill yet are zero, so they don't change the sum. */
+        for(guint r = 0; r < length; r++) {
+            sums[r] = 0.0;
+            filteredSums[r] = 0.0;
+            numFiltered[r] = 0;
+        }
+        for(guint i = 0; i < ringSize; i++) {
+            const gdouble* samples = &sampleBandwidths[i * rowLength + first];
+            for(guint r = 0; r < length; r++) {
+                sums[r] += samples[r];
+            }
+        }
+        /* a relay without samples has a sum of 0, so dividing by 1 instead of 0 is enough. we
+         * convert through gint because that has a vector instruction, and no relay does 2^31 bytes
+         * per millisecond. */
+        for(guint r = 0; r < length; r++) {
+            guint count = numSamples[r];
+            gint meanBW = (gint)(sums[r] / (gdouble)(count + (count == 0)));
+            meanBWs[r] = (guint)meanBW;
+            cutoffs[r] = (gdouble)meanBW;
+        }
+
+        /* filtered bandwidth implies compute the mean of only the bandwidths above the mean */
+        for(guint i = 0; i < ringSize; i++) {
+            const gdouble* samples = &sampleBandwidths[i * rowLength + first];
+            for(guint r = 0; r < length; r++) {
+                guint isAbove = (i < numSamples[r]) & (samples[r] >= cutoffs[r]);
+                filteredSums[r] += isAbove ? samples[r] : 0.0;
+                numFiltered[r] += isAbove;
+            }
+        }
+        for(guint r = 0; r < length; r++) {
+            guint count = numFiltered[r];
+            filteredBWs[r] = (guint)(gint)(filteredSums[r] / (gdouble)(count + (count == 0)));
+        }
+
+        for(guint r = 0; r < length; r++) {
+            if(_torflowrelaytable_isMeasureable(table, first + r)) {
+                totalMeanBW += meanBWs[r];
+                totalFilteredBW += filteredBWs[r];
+                numMeasuredRelays++;
+            }
+        }
+    }
+
+    table->totals.numMeasuredRelays = numMeasuredRelays;
+    table->totals.totalMeanBW = totalMeanBW;
+    table->totals.totalFilteredBW = totalFilteredBW;
+
+    if(totals) {
+        *totals = table->totals;
+    }
+}
+
+void torflowrelaytable_getTotals(TorFlowRelayTable* table, TorFlowRelayTotals* totals) {
+    g_assert(table);
+    g_assert(totals);
+    *totals = table->totals;
+}
+
+guint64 torflowrelaytable_computeV3Bandwidths(TorFlowRelayTable* table, gdouble avgMeanBW, gdouble avgFilteredBW) {
+    g_assert(table);
+
+    /* the ratio is the better of the mean and filtered ratios. an average of 0 drops out
+     * of the max because its ratio is 0, and if both are 0 the ratio is 1 so the
+     * advertised bandwidth is kept. */
+    gboolean isRatioSet = (avgMeanBW > 0 || avgFilteredBW > 0) ? TRUE : FALSE;
+    gdouble meanScale = avgMeanBW > 0 ? 1.0 / avgMeanBW : 0.0;
+    gdouble filteredScale = avgFilteredBW > 0 ? 1.0 / avgFilteredBW : 0.0;
+    gdouble minRatio = isRatioSet ? 0.0 : 1.0;
+
+    const guint numRelays = table->numRelays;
+    const guint* advertisedBWs = table->advertisedBandwidths;
+    const guint* priorBWs = table->priorBandwidths;
+    const guint8* numMeasurements = table->numMeasurements;
+    const guint* meanBWs = table->meanBandwidths;
+    const guint* filteredBWs = table->filteredBandwidths;
+    guint* v3BWs = table->v3Bandwidths;
+
+    guint64 totalBW = 0;
+
+    for(TorFlowRelayHandle relay = 1; relay <= numRelays; relay++) {
+        guint advertisedBW = advertisedBWs[relay];
+        gdouble meanRatio = meanBWs[relay] * meanScale;
+        gdouble filteredRatio = filteredBWs[relay] * filteredScale;
+        gdouble ratio = MAX(MAX(meanRatio, filteredRatio), minRatio);
+
+        guint v3BW = (guint)(advertisedBW * ratio);
+        /* relays we did not measure yet keep their earlier estimate, if we have one */
+        v3BW = (numMeasurements[relay] == 0 && priorBWs[relay] > 0) ? priorBWs[relay] : v3BW;
+        v3BW = _torflowrelaytable_isMeasureable(table, relay) ? v3BW : 0;
+
+        v3BWs[relay] = v3BW;
+        totalBW += v3BW;
+    }
+
+    return totalBW;
+}
+
+void torflowrelaytable_clampV3Bandwidths(TorFlowRelayTable* table, guint minBandwidth, guint maxBandwidth) {
+    g_assert(table);
+
+    const guint numRelays = table->numRelays;
+    guint* v3BWs = table->v3Bandwidths;
+
+    for(TorFlowRelayHandle relay = 1; relay <= numRelays; relay++) {
+        guint v3BW = v3BWs[relay];
+        v3BW = (v3BW < minBandwidth) ? minBandwidth : v3BW;
+        v3BW = (v3BW > maxBandwidth) ? maxBandwidth : v3BW;
+        v3BWs[relay] = v3BW;
+    }
+}
+
+void torflowrelaytable_getBandwidths(TorFlowRelayTable* table, TorFlowRelayHandle relay,
+        guint* meanBW, guint* filteredBW) {
+    g_assert(table);
+    g_assert(relay > 0 && relay <= table->numRelays);
+
+    if(meanBW) {
+        *meanBW = table->meanBandwidths[relay];
+    }
+    if(filteredBW) {
+        *filteredBW = table->filteredBandwidths[relay];
+    }
+}
+
+static inline guint _torflowrelaytable_getSortBandwidth(TorFlowRelayTable* table, TorFlowRelayHandle relay) {
+    /* an earlier estimate beats the descriptor until the relay has measurements of its own */
+    guint prior = table->priorBandwidths[relay];
+    return (table->numMeasurements[relay] == 0 && prior > 0) ? prior : table->descriptorBandwidths[relay];
+}
+
+/* Compare function to sort in descending order by bandwidth. */
+gint torflowrelaytable_compare(TorFlowRelayHandle relayA, TorFlowRelayHandle relayB, TorFlowRelayTable* table) {
+    g_assert(table);
+
+    /* compare instead of subtracting, the difference of two guints does not fit a gint */
+    guint bandwidthA = _torflowrelaytable_getSortBandwidth(table, relayA);
+    guint bandwidthB = _torflowrelaytable_getSortBandwidth(table, relayB);
+    return (bandwidthA < bandwidthB) - (bandwidthA > bandwidthB);
+}
+
+void torflowrelaytable_setNickname(TorFlowRelayTable* table, TorFlowRelayHandle relay, const gchar* nickname) {
+    g_assert(table);
+    g_assert(relay > 0 && relay <= table->numRelays);
+    g_strlcpy(&table->nicknames[(gsize)relay * TORFLOW_RELAY_NICKNAME_SIZE],
+            nickname ? nickname : "", TORFLOW_RELAY_NICKNAME_SIZE);
+}
+
+void torflowrelaytable_setIsRunning(TorFlowRelayTable* table, TorFlowRelayHandle relay, gboolean isRunning) {
+    g_assert(table);
+    g_assert(relay > 0 && relay <= table->numRelays);
+    _torflowrelaytable_setFlag(table, relay, TORFLOW_RELAY_FLAG_RUNNING, isRunning);
+}
+
+void torflowrelaytable_setIsFast(TorFlowRelayTable* table, TorFlowRelayHandle relay, gboolean isFast) {
+    g_assert(table);
+    g_assert(relay > 0 && relay <= table->numRelays);
+    _torflowrelaytable_setFlag(table, relay, TORFLOW_RELAY_FLAG_FAST, isFast);
+}
+
+void torflowrelaytable_setIsExit(TorFlowRelayTable* table, TorFlowRelayHandle relay, gboolean isExit) {
+    g_assert(table);
+    g_assert(relay > 0 && relay <= table->numRelays);
+    _torflowrelaytable_setFlag(table, relay, TORFLOW_RELAY_FLAG_EXIT, isExit);
+}
+
+void torflowrelaytable_setV3Bandwidth(TorFlowRelayTable* table, TorFlowRelayHandle relay, guint v3Bandwidth) {
+    g_assert(table);
+    g_assert(relay > 0 && relay <= table->numRelays);
+    table->v3Bandwidths[relay] = v3Bandwidth;
+}
+
+void torflowrelaytable_setDescriptorBandwidth(TorFlowRelayTable* table, TorFlowRelayHandle relay, guint descriptorBandwidth) {
+    g_assert(table);
+    g_assert(relay > 0 && relay <= table->numRelays);
+    table->descriptorBandwidths[relay] = descriptorBandwidth;
+}
+
+void torflowrelaytable_setAdvertisedBandwidth(TorFlowRelayTable* table, TorFlowRelayHandle relay, guint advertisedBandwidth) {
+    g_assert(table);
+    g_assert(relay > 0 && relay <= table->numRelays);
+    table->advertisedBandwidths[relay] = advertisedBandwidth;
+}
+
+void torflowrelaytable_setPriorBandwidth(TorFlowRelayTable* table, TorFlowRelayHandle relay, guint priorBandwidth) {
+    g_assert(table);
+    g_assert(relay > 0 && relay <= table->numRelays);
+    table->priorBandwidths[relay] = priorBandwidth;
+}
+
+gchar* torflowrelaytable_encodeFingerprint(const guint8* fingerprint, gchar* hex) {
+    g_assert(fingerprint);
+    g_assert(hex);
+
+    static const gchar hexDigits[] = "0123456789abcdef";
+
+    for(gint i = 0; i < TORFLOW_RELAY_FINGERPRINT_SIZE; i++) {
+        *hex++ = hexDigits[fingerprint[i] >> 4];
+        *hex++ = hexDigits[fingerprint[i] & 0xf];
+    }
+
+    return hex;
+}
+
+const gchar* torflowrelaytable_formatIdentity(TorFlowRelayTable* table, TorFlowRelayHandle relay, gchar* identity) {
+    g_assert(table);
+    g_assert(identity);
+    g_assert(relay > 0 && relay <= table->numRelays);
+
+    gchar* end = torflowrelaytable_encodeFingerprint(_torflowrelaytable_fingerprint(table, relay), identity);
+    *end = 0x0;
+
+    return identity;
+}
+
+const guint8* torflowrelaytable_getFingerprint(TorFlowRelayTable* table, TorFlowRelayHandle relay) {
+    g_assert(table);
+    g_assert(relay > 0 && relay <= table->numRelays);
+    return _torflowrelaytable_fingerprint(table, relay);
+}
+
+const gchar* torflowrelaytable_getNickname(TorFlowRelayTable* table, TorFlowRelayHandle relay) {
+    g_assert(table);
+    g_assert(relay > 0 && relay <= table->numRelays);
+    return (const gchar*)&table->nicknames[(gsize)relay * TORFLOW_RELAY_NICKNAME_SIZE];
+}
+
+gboolean torflowrelaytable_getIsRunning(TorFlowRelayTable* table, TorFlowRelayHandle relay) {
+    g_assert(table);
+    g_assert(relay > 0 && relay <= table->numRelays);
+    return (table->flags[relay] & TORFLOW_RELAY_FLAG_RUNNING) ? TRUE : FALSE;
+}
+
+gboolean torflowrelaytable_getIsFast(TorFlowRelayTable* table, TorFlowRelayHandle relay) {
+    g_assert(table);
+    g_assert(relay > 0 && relay <= table->numRelays);
+    return (table->flags[relay] & TORFLOW_RELAY_FLAG_FAST) ? TRUE : FALSE;
+}
+
+gboolean torflowrelaytable_getIsExit(TorFlowRelayTable* table, TorFlowRelayHandle relay) {
+    g_assert(table);
+    g_assert(relay > 0 && relay <= table->numRelays);
+    return (table->flags[relay] & TORFLOW_RELAY_FLAG_EXIT) ? TRUE : FALSE;
+}
+
+guint torflowrelaytable_getDescriptorBandwidth(TorFlowRelayTable* table, TorFlowRelayHandle relay) {
+    g_assert(table);
+    g_assert(relay > 0 && relay <= table->numRelays);
+    return table->descriptorBandwidths[relay];
+}
+
+guint torflowrelaytable_getAdvertisedBandwidth(TorFlowRelayTable* table, TorFlowRelayHandle relay) {
+    g_assert(table);
+    g_assert(relay > 0 && relay <= table->numRelays);
+    return table->advertisedBandwidths[relay];
+}
+
+guint torflowrelaytable_getPriorBandwidth(TorFlowRelayTable* table, TorFlowRelayHandle relay) {
+    g_assert(table);
+    g_assert(relay > 0 && relay <= table->numRelays);
+    return table->priorBandwidths[relay];
+}
+
+guint torflowrelaytable_getV3Bandwidth(TorFlowRelayTable* table, TorFlowRelayHandle relay) {
+    g_assert(table);
+    g_assert(relay > 0 && relay <= table->numRelays);
+    return table->v3Bandwidths[relay];
+}
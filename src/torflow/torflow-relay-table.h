@@ -0,0 +1,97 @@
+/*
+ * The Shadow Simulator
+ * See LICENSE for licensing information
+ */
+
+
+#ifndef SRC_TORFLOW_TORFLOW_RELAY_TABLE_H_
+#define SRC_TORFLOW_TORFLOW_RELAY_TABLE_H_
+
+#include <glib.h>
+
+/* the number of newest measurements each relay keeps, which is also
+ * the largest supported NumProbesPerRelay */
+#define TORFLOW_RELAY_MAX_MEASUREMENTS 16
+
+/* a relay identity is the 20 byte fingerprint, printed as 40 hex digits */
+#define TORFLOW_RELAY_FINGERPRINT_SIZE 20
+#define TORFLOW_RELAY_IDENTITY_SIZE (2*TORFLOW_RELAY_FINGERPRINT_SIZE + 1)
+
+/* tor nicknames have at most 19 characters */
+#define TORFLOW_RELAY_NICKNAME_SIZE 20
+
+/* relays are referred to by a dense handle that stays valid as long as the table exists.
+ * handle 0 is never used, so it can mean "no relay". */
+typedef guint32 TorFlowRelayHandle;
+#define TORFLOW_RELAY_INVALID_HANDLE 0
+
+typedef struct _TorFlowRelayTable TorFlowRelayTable;
+
+/* network wide sums over the measureable relays, kept up to date as measurements land */
+typedef struct _TorFlowRelayTotals TorFlowRelayTotals;
+struct _TorFlowRelayTotals {
+    guint numMeasuredRelays;
+    guint64 totalMeanBW;
+    guint64 totalFilteredBW;
+};
+
+/* each relay keeps its newest numMeasurementsPerRelay measurements */
+TorFlowRelayTable* torflowrelaytable_new(guint numMeasurementsPerRelay);
+void torflowrelaytable_free(TorFlowRelayTable* table);
+
+/* returns the handle of the relay with the given fingerprint, adding it if we don't know it yet */
+TorFlowRelayHandle torflowrelaytable_intern(TorFlowRelayTable* table, const guint8* fingerprint);
+TorFlowRelayHandle torflowrelaytable_lookup(TorFlowRelayTable* table, const guint8* fingerprint);
+TorFlowRelayHandle torflowrelaytable_lookupIdentity(TorFlowRelayTable* table, const gchar* identity);
+/* decodes a hex identity, with or without the leading '$', into a fingerprint */
+gboolean torflowrelaytable_parseIdentity(const gchar* identity, guint8* fingerprint);
+
+/* the largest valid handle, relays are numbered 1 to getNumRelays */
+guint torflowrelaytable_getNumRelays(TorFlowRelayTable* table);
+
+gboolean torflowrelaytable_isMeasureable(TorFlowRelayTable* table, TorFlowRelayHandle relay);
+void torflowrelaytable_addMeasurement(TorFlowRelayTable* table, TorFlowRelayHandle relay,
+        gsize contentLength, gsize roundTripTime, gsize payloadTime, gsize totalTime);
+
+/* adding a measurement updates the relay's mean and filtered bandwidth and the totals right away.
+ * computeBandwidths recomputes all of them from the samples, which is only needed after bulk changes. */
+void torflowrelaytable_computeBandwidths(TorFlowRelayTable* table, TorFlowRelayTotals* totals);
+void torflowrelaytable_getTotals(TorFlowRelayTable* table, TorFlowRelayTotals* totals);
+void torflowrelaytable_getBandwidths(TorFlowRelayTable* table, TorFlowRelayHandle relay,
+        guint* meanBW, guint* filteredBW);
+
+/* the rest of the aggregation, run in this order. the first sets v3 bandwidths from the network
+ * averages and returns their sum, and the second clamps v3 bandwidths into the given range.
+ * relays without measurements get their prior bandwidth instead, if they have one. */
+guint64 torflowrelaytable_computeV3Bandwidths(TorFlowRelayTable* table, gdouble avgMeanBW, gdouble avgFilteredBW);
+void torflowrelaytable_clampV3Bandwidths(TorFlowRelayTable* table, guint minBandwidth, guint maxBandwidth);
+
+/* orders relays by decreasing bandwidth */
+gint torflowrelaytable_compare(TorFlowRelayHandle relayA, TorFlowRelayHandle relayB, TorFlowRelayTable* table);
+
+void torflowrelaytable_setNickname(TorFlowRelayTable* table, TorFlowRelayHandle relay, const gchar* nickname);
+void torflowrelaytable_setIsRunning(TorFlowRelayTable* table, TorFlowRelayHandle relay, gboolean isRunning);
+void torflowrelaytable_setIsFast(TorFlowRelayTable* table, TorFlowRelayHandle relay, gboolean isFast);
+void torflowrelaytable_setIsExit(TorFlowRelayTable* table, TorFlowRelayHandle relay, gboolean isExit);
+void torflowrelaytable_setV3Bandwidth(TorFlowRelayTable* table, TorFlowRelayHandle relay, guint v3Bandwidth);
+void torflowrelaytable_setDescriptorBandwidth(TorFlowRelayTable* table, TorFlowRelayHandle relay, guint descriptorBandwidth);
+void torflowrelaytable_setAdvertisedBandwidth(TorFlowRelayTable* table, TorFlowRelayHandle relay, guint advertisedBandwidth);
+/* an estimate from an earlier scan, used for sorting and v3 bandwidths until the relay is measured */
+void torflowrelaytable_setPriorBandwidth(TorFlowRelayTable* table, TorFlowRelayHandle relay, guint priorBandwidth);
+
+/* writes the 2*TORFLOW_RELAY_FINGERPRINT_SIZE lowercase hex digits of the fingerprint,
+ * without a terminator, and returns the position after the last one */
+gchar* torflowrelaytable_encodeFingerprint(const guint8* fingerprint, gchar* hex);
+/* writes the hex identity into a buffer of TORFLOW_RELAY_IDENTITY_SIZE bytes and returns it */
+const gchar* torflowrelaytable_formatIdentity(TorFlowRelayTable* table, TorFlowRelayHandle relay, gchar* identity);
+const guint8* torflowrelaytable_getFingerprint(TorFlowRelayTable* table, TorFlowRelayHandle relay);
+const gchar* torflowrelaytable_getNickname(TorFlowRelayTable* table, TorFlowRelayHandle relay);
+gboolean torflowrelaytable_getIsRunning(TorFlowRelayTable* table, TorFlowRelayHandle relay);
+gboolean torflowrelaytable_getIsFast(TorFlowRelayTable* table, TorFlowRelayHandle relay);
+gboolean torflowrelaytable_getIsExit(TorFlowRelayTable* table, TorFlowRelayHandle relay);
+guint torflowrelaytable_getDescriptorBandwidth(TorFlowRelayTable* table, TorFlowRelayHandle relay);
+guint torflowrelaytable_getAdvertisedBandwidth(TorFlowRelayTable* table, TorFlowRelayHandle relay);
+guint torflowrelaytable_getPriorBandwidth(TorFlowRelayTable* table, TorFlowRelayHandle relay);
+guint torflowrelaytable_getV3Bandwidth(TorFlowRelayTable* table, TorFlowRelayHandle relay);
+
+#endif /* SRC_TORFLOW_TORFLOW_RELAY_TABLE_H_ */
@@ -3,77 +3,166 @@
  * See LICENSE for licensing information
  */
 
+#define TORFLOW_LOG_CATEGORY TORFLOW_LOG_SLICE
 #include "torflow.h"
 
+/* a relay and the number of probes it was part of this round */
+typedef struct _TorFlowSliceRelay TorFlowSliceRelay;
+struct _TorFlowSliceRelay {
+    TorFlowRelayHandle relay;
+    guint numProbes;
+};
+
+/* the entries or the exits of a slice, ordered by their probe counts so that the least
+ * probed relays are always in front. bucketEnds[n] is one past the last relay that was
+ * probed at most n times, so the candidates for the next probe are the relays in front
+ * of bucketEnds[minProbes]. */
+typedef struct _TorFlowSliceRelays TorFlowSliceRelays;
+struct _TorFlowSliceRelays {
+    TorFlowSliceRelay* relays;
+    guint length;
+    guint capacity;
+
+    guint* bucketEnds;
+    guint numBuckets;
+    guint bucketCapacity;
+
+    /* relays added since we last ordered them */
+    gboolean isSorted;
+};
+
 struct _TorFlowSlice {
     guint sliceID;
     gdouble percentile;
     guint numProbesPerRelay;
     guint totalProbesRemaining;
 
-    gchar* relayIDSearch;
-    gboolean relayIDFound;
+    /* probes we chose relays for that did not report back yet, and those that did */
+    guint numProbesRunning;
+    guint numProbesComplete;
+
+    /* state of our own generator, so slices don't share the global rand() sequence */
+    guint64 randomState;
 
-    GHashTable* entries;
-    GHashTable* exits;
+    TorFlowSliceRelays entries;
+    TorFlowSliceRelays exits;
 };
 
-static void _torflowslice_computeMinProbes(gchar* key, gpointer value, guint* minProbes) {
-    guint probes = GPOINTER_TO_UINT(value);
-    *minProbes = MIN(*minProbes, probes);
+static guint _torflowslice_nextRandom(TorFlowSlice* slice) {
+    /* xorshift64*, see https://doi.org/10.1145/2845077 */
+    guint64 state = slice->randomState;
+    state ^= state >> 12;
+    state ^= state << 25;
+    state ^= state >> 27;
+    slice->randomState = state;
+    return (guint)((state * G_GUINT64_CONSTANT(2685821657736338717)) >> 32);
 }
 
-static GQueue* _torflowslice_getCandidates(TorFlowSlice* slice, GHashTable* table) {
-    g_assert(slice);
-    g_assert(table);
-
-    /* the strategy here is to choose among the relay that have been measured the least
-       number of times when selecting for the next measurement. */
-
-    /* first get the minimum number of probes that we have for any relay */
-    guint minProbes = G_MAXUINT;
-    g_hash_table_foreach(table, (GHFunc)_torflowslice_computeMinProbes, &minProbes);
-
-    /* now collect all relays that have the same minimum value */
-    GQueue* candidates = g_queue_new();
-
-    GHashTableIter iter;
-    gpointer key, value;
-    g_hash_table_iter_init(&iter, table);
-    while(g_hash_table_iter_next(&iter, &key, &value)) {
-        /* the val is the number of probes, the key is the gchar* relay identity */
-        guint numProbes = GPOINTER_TO_UINT(value);
-        if(numProbes == minProbes) {
-            g_queue_push_tail(candidates, key);
+static guint _torflowslice_randomIndex(TorFlowSlice* slice, guint numElements) {
+    if(numElements <= 0) {
+        return 0;
+    }
+
+    /* scales the 32 random bits to 0...numElements-1 without a division */
+    return (guint)(((guint64)_torflowslice_nextRandom(slice) * numElements) >> 32);
+}
+
+/* new buckets are empty, so they end where the buckets before them end */
+static void _torflowslice_ensureBucket(TorFlowSliceRelays* relays, guint numProbes, guint end) {
+    while(numProbes >= relays->numBuckets) {
+        if(relays->numBuckets >= relays->bucketCapacity) {
+            relays->bucketCapacity = MAX(8, 2 * relays->bucketCapacity);
+            relays->bucketEnds = g_renew(guint, relays->bucketEnds, relays->bucketCapacity);
         }
+
+        relays->bucketEnds[relays->numBuckets++] = end;
     }
+}
 
-    return candidates;
+static gint _torflowslice_compareRelays(gconstpointer a, gconstpointer b) {
+    const TorFlowSliceRelay* relayA = a;
+    const TorFlowSliceRelay* relayB = b;
+    return (relayA->numProbes > relayB->numProbes) - (relayA->numProbes < relayB->numProbes);
 }
 
-static guint _torflowslice_randomIndex(guint numElements) {
-    if(numElements <= 0) {
-        return 0;
+static void _torflowslice_sortRelays(TorFlowSliceRelays* relays) {
+    /* only needed once after the slice was filled, choosing relays keeps the order */
+    qsort(relays->relays, relays->length, sizeof(TorFlowSliceRelay), _torflowslice_compareRelays);
+
+    relays->numBuckets = 0;
+    for(guint i = 0; i < relays->length; i++) {
+        _torflowslice_ensureBucket(relays, relays->relays[i].numProbes, i);
+        relays->bucketEnds[relays->relays[i].numProbes] = i + 1;
+    }
+
+    relays->isSorted = TRUE;
+}
+
+static void _torflowslice_addToRelays(TorFlowSliceRelays* relays, TorFlowRelayHandle relay, guint numProbes) {
+    if(relays->length >= relays->capacity) {
+        relays->capacity = MAX(16, 2 * relays->capacity);
+        relays->relays = g_renew(TorFlowSliceRelay, relays->relays, relays->capacity);
     }
 
-    /* get the random values */
-    gint rInt = rand();
-    gdouble rDouble = (gdouble)(((gdouble)rInt) / ((gdouble)RAND_MAX));
+    relays->relays[relays->length].relay = relay;
+    relays->relays[relays->length].numProbes = numProbes;
+    relays->length++;
 
-    /* the range 0...1 counts for index 0, 1...2 counts for index 1, n...n+1 counts for n
-     * this leaves n=numElements as an outlier, which we need to adjust down. */
-    gdouble rIndex = rDouble * ((gdouble)(numElements));
-    guint randomIndex = (guint)(floor(rIndex));
-    return randomIndex >= numElements ? (numElements-1) : randomIndex;
+    relays->isSorted = FALSE;
 }
 
-static void _torflowslice_countProbesRemaining(gchar* key, gpointer value, TorFlowSlice* slice) {
+static TorFlowRelayHandle _torflowslice_chooseFrom(TorFlowSlice* slice, TorFlowSliceRelays* relays,
+        guint* numCandidates, guint* numProbes) {
     g_assert(slice);
+    g_assert(relays->length > 0);
+
+    if(!relays->isSorted) {
+        _torflowslice_sortRelays(relays);
+    }
+
+    /* the strategy here is to choose among the relays that have been measured the least
+       number of times when selecting for the next measurement. they are all in front. */
+    guint minProbes = relays->relays[0].numProbes;
+    guint candidates = relays->bucketEnds[minProbes];
+    guint position = _torflowslice_randomIndex(slice, candidates);
 
-    guint numProbes = GPOINTER_TO_UINT(value);
-    guint remaining = numProbes >= slice->numProbesPerRelay ? 0 : slice->numProbesPerRelay - numProbes;
+    /* move the chosen relay to the end of the least probed relays, where it becomes the
+     * first relay of the next bucket once we count its probe */
+    guint last = candidates - 1;
+    TorFlowSliceRelay chosen = relays->relays[position];
+    relays->relays[position] = relays->relays[last];
 
-    slice->totalProbesRemaining += remaining;
+    if(chosen.numProbes < slice->numProbesPerRelay) {
+        slice->totalProbesRemaining--;
+    }
+    chosen.numProbes++;
+
+    relays->relays[last] = chosen;
+    relays->bucketEnds[minProbes]--;
+    /* every relay was probed at most as often as a new largest count */
+    _torflowslice_ensureBucket(relays, chosen.numProbes, relays->length);
+
+    *numCandidates = candidates;
+    *numProbes = chosen.numProbes;
+    return chosen.relay;
+}
+
+static gboolean _torflowslice_containsIn(TorFlowSliceRelays* relays, TorFlowRelayHandle relay) {
+    for(guint i = 0; i < relays->length; i++) {
+        if(relays->relays[i].relay == relay) {
+            return TRUE;
+        }
+    }
+    return FALSE;
+}
+
+static void _torflowslice_clearRelays(TorFlowSliceRelays* relays) {
+    if(relays->relays) {
+        g_free(relays->relays);
+    }
+    if(relays->bucketEnds) {
+        g_free(relays->bucketEnds);
+    }
 }
 
 TorFlowSlice* torflowslice_new(guint sliceID, gdouble percentile, guint numProbesPerRelay) {
@@ -83,8 +172,8 @@ TorFlowSlice* torflowslice_new(guint sliceID, gdouble percentile, guint numProbe
     slice->percentile = percentile;
     slice->numProbesPerRelay = numProbesPerRelay;
 
-    slice->entries = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, NULL);
-    slice->exits = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, NULL);
+    /* seeded from rand(), so runs stay as reproducible as they were. must not be 0. */
+    slice->randomState = ((((guint64)rand()) << 32) ^ ((guint64)rand()) ^ ((guint64)sliceID << 16)) | 1;
 
     return slice;
 }
@@ -92,48 +181,30 @@ TorFlowSlice* torflowslice_new(guint sliceID, gdouble percentile, guint numProbe
 void torflowslice_free(TorFlowSlice* slice) {
     g_assert(slice);
 
-    if(slice->entries) {
-        g_hash_table_destroy(slice->entries);
-    }
-
-    if(slice->exits) {
-        g_hash_table_destroy(slice->exits);
-    }
-
-    if(slice->relayIDSearch) {
-        g_free(slice->relayIDSearch);
-        slice->relayIDSearch = NULL;
-    }
+    _torflowslice_clearRelays(&slice->entries);
+    _torflowslice_clearRelays(&slice->exits);
 
     g_free(slice);
 }
 
-void torflowslice_addRelay(TorFlowSlice* slice, TorFlowRelay* relay) {
+void torflowslice_addRelay(TorFlowSlice* slice, TorFlowRelayHandle relay, gboolean isExit, guint numProbes) {
     g_assert(slice);
-    g_assert(relay);
+    g_assert(relay != TORFLOW_RELAY_INVALID_HANDLE);
 
-    gchar* relayID = g_strdup(torflowrelay_getIdentity(relay));
-    guint numProbes = 0;
+    _torflowslice_addToRelays(isExit ? &slice->exits : &slice->entries, relay, numProbes);
 
-    if(torflowrelay_getIsExit(relay)) {
-        g_hash_table_replace(slice->exits, relayID, GUINT_TO_POINTER(numProbes));
-    } else {
-        g_hash_table_replace(slice->entries, relayID, GUINT_TO_POINTER(numProbes));
+    if(numProbes < slice->numProbesPerRelay) {
+        slice->totalProbesRemaining += slice->numProbesPerRelay - numProbes;
     }
 }
 
 guint torflowslice_getLength(TorFlowSlice* slice) {
     g_assert(slice);
-    return g_hash_table_size(slice->exits) + g_hash_table_size(slice->entries);
+    return slice->exits.length + slice->entries.length;
 }
 
 guint torflowslice_getNumProbesRemaining(TorFlowSlice* slice) {
     g_assert(slice);
-
-    slice->totalProbesRemaining = 0;
-    g_hash_table_foreach(slice->entries, (GHFunc)_torflowslice_countProbesRemaining, slice);
-    g_hash_table_foreach(slice->exits, (GHFunc)_torflowslice_countProbesRemaining, slice);
-
     return slice->totalProbesRemaining;
 }
 
@@ -180,139 +251,86 @@ gsize torflowslice_getTransferSize(TorFlowSlice* slice) {
     return transferSize;
 }
 
-gboolean torflowslice_chooseRelayPair(TorFlowSlice* slice, gchar** entryRelayIdentity, gchar** exitRelayIdentity) {
+gboolean torflowslice_chooseRelayPair(TorFlowSlice* slice, TorFlowRelayHandle* entryRelay, TorFlowRelayHandle* exitRelay) {
     g_assert(slice);
 
     /* return false if we have already measured all relays */
-    guint remaining = torflowslice_getNumProbesRemaining(slice);
-    if(remaining <= 0) {
+    if(slice->totalProbesRemaining <= 0) {
         return FALSE;
     }
 
-    /* choose an entry and exit among entries and exits with the lowest measurement counts */
-    GQueue* candidateEntries = _torflowslice_getCandidates(slice, slice->entries);
-    GQueue* candidateExits = _torflowslice_getCandidates(slice, slice->exits);
-
     /* make sure we have at least one entry and one exit */
-    if(g_queue_is_empty(candidateEntries) && g_queue_is_empty(candidateExits)) {
-        warning("slice %u: problem choosing relay pair: found %u candidates of %u entries and %u candidates of %u exits",
-                slice->sliceID,
-                g_queue_get_length(candidateEntries), g_hash_table_size(slice->entries),
-                g_queue_get_length(candidateExits), g_hash_table_size(slice->exits));
-
-        g_queue_free(candidateEntries);
-        g_queue_free(candidateExits);
-
+    if(slice->entries.length == 0 || slice->exits.length == 0) {
+        warning("slice %u: problem choosing relay pair: found %u entries and %u exits",
+                slice->sliceID, slice->entries.length, slice->exits.length);
         return FALSE;
     }
 
-    /* choose uniformly from all candidates */
-    guint entryPosition = _torflowslice_randomIndex(g_queue_get_length(candidateEntries));
-    guint exitPosition = _torflowslice_randomIndex(g_queue_get_length(candidateExits));
-
-    gchar* entryID = g_queue_peek_nth(candidateEntries, entryPosition);
-    gchar* exitID = g_queue_peek_nth(candidateExits, exitPosition);
-
-    if(entryID == NULL || exitID == NULL) {
-        error("slice %u: we had candidate exits and entries, but found NULL ids: entry=%s exit=%s", slice->sliceID, entryID, exitID);
-
-        g_queue_free(candidateEntries);
-        g_queue_free(candidateExits);
-
-        return FALSE;
-    }
-
-    /* update the measurement count for the chosen relays */
-    gpointer entryProbeCount = g_hash_table_lookup(slice->entries, entryID);
-    gpointer exitProbeCount = g_hash_table_lookup(slice->exits, exitID);
-
-    /* steal the keys so we don't free them */
-    g_hash_table_steal(slice->entries, entryID);
-    g_hash_table_steal(slice->exits, exitID);
-
-    /* increment the measurement counts */
-    guint newEntryCount = GPOINTER_TO_UINT(entryProbeCount);
-    guint newExitCount = GPOINTER_TO_UINT(exitProbeCount);
-    newEntryCount++;
-    newExitCount++;
-
-    /* store them in the table again */
-    g_hash_table_replace(slice->entries, entryID, GUINT_TO_POINTER(newEntryCount));
-    g_hash_table_replace(slice->exits, exitID, GUINT_TO_POINTER(newExitCount));
+    /* choose uniformly among the entries and exits with the lowest measurement counts,
+     * which also counts the new probe for both of them */
+    guint numEntryCandidates = 0, numExitCandidates = 0;
+    guint newEntryCount = 0, newExitCount = 0;
+    TorFlowRelayHandle entryID = _torflowslice_chooseFrom(slice, &slice->entries, &numEntryCandidates, &newEntryCount);
+    TorFlowRelayHandle exitID = _torflowslice_chooseFrom(slice, &slice->exits, &numExitCandidates, &newExitCount);
 
     info("slice %u: choosing relay pair: found %u candidates of %u entries and %u candidates of %u exits, "
-            "choosing entry %s at position %u and exit %s at position %u, "
+            "choosing entry relay %u and exit relay %u, "
             "new entry probe count is %u and exit probe count is %u",
             slice->sliceID,
-            g_queue_get_length(candidateEntries), g_hash_table_size(slice->entries),
-            g_queue_get_length(candidateExits), g_hash_table_size(slice->exits),
-            entryID, entryPosition, exitID, exitPosition, newEntryCount, newExitCount);
+            numEntryCandidates, slice->entries.length,
+            numExitCandidates, slice->exits.length,
+            entryID, exitID, newEntryCount, newExitCount);
 
-    /* cleanup the queues */
-    g_queue_free(candidateEntries);
-    g_queue_free(candidateExits);
+    slice->numProbesRunning++;
 
     /* return values */
-    if(entryRelayIdentity) {
-        *entryRelayIdentity = entryID;
+    if(entryRelay) {
+        *entryRelay = entryID;
     }
-    if(exitRelayIdentity) {
-        *exitRelayIdentity = exitID;
+    if(exitRelay) {
+        *exitRelay = exitID;
     }
     return TRUE;
 }
 
-void torflowslice_logStatus(TorFlowSlice* slice) {
+void torflowslice_onProbeComplete(TorFlowSlice* slice) {
     g_assert(slice);
+    g_assert(slice->numProbesRunning > 0);
 
-    guint numEntries = g_hash_table_size(slice->entries);
-    guint numExits = g_hash_table_size(slice->exits);
-    guint remaining = torflowslice_getNumProbesRemaining(slice);
-
-    info("slice %u: we have %u entries and %u exits, and %u probes remaining",
-            slice->sliceID, numEntries, numExits, remaining);
+    slice->numProbesRunning--;
+    slice->numProbesComplete++;
 }
 
-static void _torflowslice_FindRelayID(gchar* key, gpointer value, TorFlowSlice* slice) {
-    if(key) {
-        if(!g_ascii_strcasecmp(key, slice->relayIDSearch)) {
-            slice->relayIDFound = TRUE;
-        }
-    }
+guint torflowslice_getNumProbesRunning(TorFlowSlice* slice) {
+    g_assert(slice);
+    return slice->numProbesRunning;
 }
 
-gboolean torflowslice_contains(TorFlowSlice* slice, const gchar* relayID) {
+guint torflowslice_getNumProbesComplete(TorFlowSlice* slice) {
     g_assert(slice);
+    return slice->numProbesComplete;
+}
 
-    if(!relayID) {
-        return FALSE;
-    }
-
-    /* check if cache exists */
-    if(slice->relayIDSearch) {
-        /* cache exists, do we have a cache hit? */
-        if(!g_ascii_strcasecmp(relayID, slice->relayIDSearch)) {
-            /* cache hit, return cached result */
-            return slice->relayIDFound;
-        } else {
-            /* cache miss, we need to refresh cache */
-            g_free(slice->relayIDSearch);
-            slice->relayIDSearch = NULL;
-            slice->relayIDFound = FALSE;
-        }
-    }
+guint torflowslice_getID(TorFlowSlice* slice) {
+    g_assert(slice);
+    return slice->sliceID;
+}
 
-    g_assert(!slice->relayIDSearch);
+void torflowslice_logStatus(TorFlowSlice* slice) {
+    g_assert(slice);
 
-    /* do search and cache result */
-    slice->relayIDSearch = g_strdup(relayID);
-    slice->relayIDFound = FALSE;
+    info("slice %u: we have %u entries and %u exits, and %u probes remaining",
+            slice->sliceID, slice->entries.length, slice->exits.length, slice->totalProbesRemaining);
+}
 
-    g_hash_table_foreach(slice->entries, (GHFunc)_torflowslice_FindRelayID, slice);
+gboolean torflowslice_contains(TorFlowSlice* slice, TorFlowRelayHandle relay) {
+    g_assert(slice);
 
-    if(!slice->relayIDFound) {
-        g_hash_table_foreach(slice->exits, (GHFunc)_torflowslice_FindRelayID, slice);
+    if(relay == TORFLOW_RELAY_INVALID_HANDLE) {
+        return FALSE;
     }
 
-    return slice->relayIDFound;
+    /* nothing on the probe path asks this, so a scan is fine */
+    return (_torflowslice_containsIn(&slice->entries, relay) ||
+            _torflowslice_containsIn(&slice->exits, relay)) ? TRUE : FALSE;
 }
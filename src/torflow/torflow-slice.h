@@ -14,15 +14,21 @@ typedef struct _TorFlowSlice TorFlowSlice;
 TorFlowSlice* torflowslice_new(guint sliceID, gdouble percentile, guint numProbesPerRelay);
 void torflowslice_free(TorFlowSlice* slice);
 
-void torflowslice_addRelay(TorFlowSlice* slice, TorFlowRelay* relay);
-gboolean torflowslice_chooseRelayPair(TorFlowSlice* slice, gchar** entryRelayIdentity, gchar** exitRelayIdentity);
+/* numProbes is how often the relay was already probed this round, which is 0 unless we resume a round */
+void torflowslice_addRelay(TorFlowSlice* slice, TorFlowRelayHandle relay, gboolean isExit, guint numProbes);
+gboolean torflowslice_chooseRelayPair(TorFlowSlice* slice, TorFlowRelayHandle* entryRelay, TorFlowRelayHandle* exitRelay);
+/* every pair chosen above counts as a running probe until it is reported here */
+void torflowslice_onProbeComplete(TorFlowSlice* slice);
 
 void torflowslice_logStatus(TorFlowSlice* slice);
 
+guint torflowslice_getID(TorFlowSlice* slice);
 guint torflowslice_getLength(TorFlowSlice* slice);
 guint torflowslice_getNumProbesRemaining(TorFlowSlice* slice);
+guint torflowslice_getNumProbesRunning(TorFlowSlice* slice);
+guint torflowslice_getNumProbesComplete(TorFlowSlice* slice);
 gsize torflowslice_getTransferSize(TorFlowSlice* slice);
 
-gboolean torflowslice_contains(TorFlowSlice* slice, const gchar* relayID);
+gboolean torflowslice_contains(TorFlowSlice* slice, TorFlowRelayHandle relay);
 
 #endif /* SRC_TORFLOW_TORFLOW_SLICE_H_ */
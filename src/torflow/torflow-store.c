@@ -0,0 +1,308 @@
+/*
+ * The Shadow Simulator
+ * See LICENSE for licensing information
+ */
+
+#define TORFLOW_LOG_CATEGORY TORFLOW_LOG_DATABASE
+#include "torflow.h"
+
+#define TORFLOW_STORE_MAGIC 0x54465354 /* "TSFT" in a little endian file */
+#define TORFLOW_STORE_VERSION 1
+#define TORFLOW_STORE_INITIAL_CAPACITY 1024
+
+typedef struct _TorFlowStoreHeader TorFlowStoreHeader;
+struct _TorFlowStoreHeader {
+    guint32 magic;
+    guint32 version;
+    guint32 numMeasurementsPerRelay;
+    guint32 numRelays;
+    guint32 capacity;
+    guint32 roundNumber;
+    guint32 isRoundComplete;
+    guint32 reserved;
+};
+
+/* fixed size, so a record stays where it is no matter how many measurements we keep */
+typedef struct _TorFlowStoreRecord TorFlowStoreRecord;
+struct _TorFlowStoreRecord {
+    guint8 fingerprint[TORFLOW_RELAY_FINGERPRINT_SIZE];
+    guint8 numMeasurements;
+    guint8 nextMeasurement;
+    /* probes this relay was part of in the current round */
+    guint16 numProbes;
+    TorFlowStoreMeasurement measurements[TORFLOW_RELAY_MAX_MEASUREMENTS];
+};
+
+struct _TorFlowStore {
+    gchar* path;
+    gint descriptor;
+    guint ringSize;
+
+    /* the whole file is mapped. records follow the header, and record 0 is unused like handle 0. */
+    gsize mappedSize;
+    TorFlowStoreHeader* header;
+    TorFlowStoreRecord* records;
+};
+
+static gsize _torflowstore_getFileSize(guint capacity) {
+    return sizeof(TorFlowStoreHeader) + (gsize)capacity * sizeof(TorFlowStoreRecord);
+}
+
+static gboolean _torflowstore_map(TorFlowStore* store, guint capacity) {
+    g_assert(store);
+
+    gsize size = _torflowstore_getFileSize(capacity);
+
+    /* growing the file fills the new records with zeros */
+    if(size > store->mappedSize && ftruncate(store->descriptor, (off_t)size) < 0) {
+        warning("unable to resize measurement store %s to %zu bytes: error %i: %s",
+                store->path, size, errno, g_strerror(errno));
+        return FALSE;
+    }
+
+    /* map the new size before we let go of the old one, so a failure leaves us usable */
+    gpointer map = mmap(NULL, size, PROT_READ|PROT_WRITE, MAP_SHARED, store->descriptor, 0);
+    if(map == MAP_FAILED) {
+        warning("unable to map measurement store %s: error %i: %s", store->path, errno, g_strerror(errno));
+        return FALSE;
+    }
+
+    if(store->header) {
+        munmap(store->header, store->mappedSize);
+    }
+
+    store->header = map;
+    store->records = (TorFlowStoreRecord*)&store->header[1];
+    store->mappedSize = size;
+
+    return TRUE;
+}
+
+static gboolean _torflowstore_readHeader(TorFlowStore* store, TorFlowStoreHeader* header) {
+    struct stat fileStat;
+    if(fstat(store->descriptor, &fileStat) < 0 || (gsize)fileStat.st_size < sizeof(TorFlowStoreHeader)) {
+        return FALSE;
+    }
+
+    if(pread(store->descriptor, header, sizeof(TorFlowStoreHeader), 0) != (gssize)sizeof(TorFlowStoreHeader)) {
+        return FALSE;
+    }
+
+    if(header->magic != TORFLOW_STORE_MAGIC || header->version != TORFLOW_STORE_VERSION ||
+            header->capacity == 0 || header->numRelays >= header->capacity ||
+            (gsize)fileStat.st_size < _torflowstore_getFileSize(header->capacity)) {
+        warning("measurement store %s is not valid, starting a new one", store->path);
+        return FALSE;
+    }
+
+    /* the ring layout depends on its size, so we can't reuse the records */
+    if(header->numMeasurementsPerRelay != store->ringSize) {
+        message("measurement store %s keeps %u measurements per relay instead of %u, starting a new one",
+                store->path, header->numMeasurementsPerRelay, store->ringSize);
+        return FALSE;
+    }
+
+    return TRUE;
+}
+
+TorFlowStore* torflowstore_new(const gchar* path, guint numMeasurementsPerRelay) {
+    g_assert(path);
+    g_assert(numMeasurementsPerRelay > 0 && numMeasurementsPerRelay <= TORFLOW_RELAY_MAX_MEASUREMENTS);
+
+    TorFlowStore* store = g_new0(TorFlowStore, 1);
+    store->path = g_strdup(path);
+    store->ringSize = numMeasurementsPerRelay;
+
+    store->descriptor = open(path, O_RDWR|O_CREAT|O_CLOEXEC, 0644);
+    if(store->descriptor < 0) {
+        warning("unable to open measurement store %s: error %i: %s", path, errno, g_strerror(errno));
+        torflowstore_free(store);
+        return NULL;
+    }
+
+    TorFlowStoreHeader header;
+    gboolean isValid = _torflowstore_readHeader(store, &header);
+
+    if(!isValid && ftruncate(store->descriptor, 0) < 0) {
+        warning("unable to clear measurement store %s: error %i: %s", path, errno, g_strerror(errno));
+        torflowstore_free(store);
+        return NULL;
+    }
+
+    if(!_torflowstore_map(store, isValid ? header.capacity : TORFLOW_STORE_INITIAL_CAPACITY)) {
+        torflowstore_free(store);
+        return NULL;
+    }
+
+    if(isValid) {
+        message("loaded measurement store %s with %u relays, round %u is %s", path,
+                store->header->numRelays, store->header->roundNumber,
+                store->header->isRoundComplete ? "complete" : "unfinished");
+    } else {
+        store->header->magic = TORFLOW_STORE_MAGIC;
+        store->header->version = TORFLOW_STORE_VERSION;
+        store->header->numMeasurementsPerRelay = (guint32)numMeasurementsPerRelay;
+        store->header->numRelays = 0;
+        store->header->capacity = TORFLOW_STORE_INITIAL_CAPACITY;
+        store->header->roundNumber = 0;
+        store->header->isRoundComplete = TRUE;
+
+        message("created measurement store %s", path);
+    }
+
+    return store;
+}
+
+void torflowstore_free(TorFlowStore* store) {
+    g_assert(store);
+
+    /* the mapping is shared, so everything we wrote is in the file once we unmap it */
+    if(store->header) {
+        munmap(store->header, store->mappedSize);
+    }
+
+    if(store->descriptor >= 0) {
+        close(store->descriptor);
+    }
+
+    if(store->path) {
+        g_free(store->path);
+    }
+
+    g_free(store);
+}
+
+guint torflowstore_getNumRelays(TorFlowStore* store) {
+    g_assert(store);
+    return store->header->numRelays;
+}
+
+const guint8* torflowstore_getFingerprint(TorFlowStore* store, TorFlowRelayHandle relay) {
+    g_assert(store);
+    g_assert(relay > 0 && relay <= store->header->numRelays);
+    return store->records[relay].fingerprint;
+}
+
+guint torflowstore_getMeasurements(TorFlowStore* store, TorFlowRelayHandle relay,
+        TorFlowStoreMeasurement* measurements) {
+    g_assert(store);
+    g_assert(measurements);
+    g_assert(relay > 0 && relay <= store->header->numRelays);
+
+    TorFlowStoreRecord* record = &store->records[relay];
+    guint numMeasurements = MIN(record->numMeasurements, store->ringSize);
+
+    /* the oldest measurement is numMeasurements slots behind the next one */
+    guint slot = (record->nextMeasurement % store->ringSize + store->ringSize - numMeasurements) % store->ringSize;
+    for(guint i = 0; i < numMeasurements; i++) {
+        measurements[i] = record->measurements[slot];
+        slot = (slot + 1) % store->ringSize;
+    }
+
+    return numMeasurements;
+}
+
+guint torflowstore_getNumProbes(TorFlowStore* store, TorFlowRelayHandle relay) {
+    g_assert(store);
+
+    if(relay == TORFLOW_RELAY_INVALID_HANDLE || relay > store->header->numRelays) {
+        return 0;
+    }
+    return store->records[relay].numProbes;
+}
+
+guint torflowstore_getUnfinishedRound(TorFlowStore* store) {
+    g_assert(store);
+    return store->header->isRoundComplete ? 0 : store->header->roundNumber;
+}
+
+void torflowstore_setRelay(TorFlowStore* store, TorFlowRelayHandle relay, const guint8* fingerprint) {
+    g_assert(store);
+    g_assert(fingerprint);
+    g_assert(relay != TORFLOW_RELAY_INVALID_HANDLE);
+
+    if(relay >= store->header->capacity) {
+        guint capacity = store->header->capacity;
+        while(relay >= capacity) {
+            capacity *= 2;
+        }
+
+        if(!_torflowstore_map(store, capacity)) {
+            return;
+        }
+        store->header->capacity = capacity;
+    }
+
+    TorFlowStoreRecord* record = &store->records[relay];
+    if(memcmp(record->fingerprint, fingerprint, TORFLOW_RELAY_FINGERPRINT_SIZE) != 0) {
+        memset(record, 0, sizeof(TorFlowStoreRecord));
+        memcpy(record->fingerprint, fingerprint, TORFLOW_RELAY_FINGERPRINT_SIZE);
+    }
+
+    store->header->numRelays = MAX(store->header->numRelays, relay);
+}
+
+void torflowstore_addMeasurement(TorFlowStore* store, TorFlowRelayHandle relay,
+        gsize contentLength, gsize roundTripTime, gsize totalTime) {
+    g_assert(store);
+
+    if(relay == TORFLOW_RELAY_INVALID_HANDLE || relay > store->header->numRelays) {
+        return;
+    }
+
+    /* the same ring as the relay table keeps */
+    TorFlowStoreRecord* record = &store->records[relay];
+    guint next = record->nextMeasurement % store->ringSize;
+    TorFlowStoreMeasurement* measurement = &record->measurements[next];
+    measurement->contentLength = (guint64)contentLength;
+    measurement->roundTripTime = (guint32)MIN(roundTripTime, G_MAXUINT32);
+    measurement->totalTime = (guint32)MIN(totalTime, G_MAXUINT32);
+
+    record->nextMeasurement = (guint8)((next + 1) % store->ringSize);
+    if(record->numMeasurements < store->ringSize) {
+        record->numMeasurements++;
+    }
+}
+
+void torflowstore_addProbe(TorFlowStore* store, TorFlowRelayHandle relay) {
+    g_assert(store);
+
+    if(relay == TORFLOW_RELAY_INVALID_HANDLE || relay > store->header->numRelays) {
+        return;
+    }
+
+    TorFlowStoreRecord* record = &store->records[relay];
+    if(record->numProbes < G_MAXUINT16) {
+        record->numProbes++;
+    }
+}
+
+void torflowstore_beginRound(TorFlowStore* store, guint roundNumber) {
+    g_assert(store);
+
+    guint numRelays = store->header->numRelays;
+    for(TorFlowRelayHandle relay = 1; relay <= numRelays; relay++) {
+        store->records[relay].numProbes = 0;
+    }
+
+    store->header->roundNumber = (guint32)roundNumber;
+    store->header->isRoundComplete = FALSE;
+
+    torflowstore_checkpoint(store);
+}
+
+void torflowstore_finishRound(TorFlowStore* store) {
+    g_assert(store);
+    store->header->isRoundComplete = TRUE;
+    torflowstore_checkpoint(store);
+}
+
+void torflowstore_checkpoint(TorFlowStore* store) {
+    g_assert(store);
+
+    /* our writes already live in the page cache, which survives us crashing.
+     * this only starts the write back, so a machine crash loses less. */
+    if(msync(store->header, store->mappedSize, MS_ASYNC) < 0) {
+        warning("unable to sync measurement store %s: error %i: %s", store->path, errno, g_strerror(errno));
+    }
+}
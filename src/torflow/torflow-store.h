@@ -0,0 +1,51 @@
+/*
+ * The Shadow Simulator
+ * See LICENSE for licensing information
+ */
+
+
+#ifndef SRC_TORFLOW_TORFLOW_STORE_H_
+#define SRC_TORFLOW_TORFLOW_STORE_H_
+
+#include <glib.h>
+
+/* a memory mapped file that keeps the measurements of every relay and the progress of
+ * the current round, so that a restarted scanner can pick up where it stopped.
+ * records are addressed by the relay handle of the table they mirror. */
+typedef struct _TorFlowStore TorFlowStore;
+
+typedef struct _TorFlowStoreMeasurement TorFlowStoreMeasurement;
+struct _TorFlowStoreMeasurement {
+    guint64 contentLength;
+    guint32 roundTripTime;
+    guint32 totalTime;
+};
+
+/* opens or creates the store at path. returns NULL if the file can't be mapped. */
+TorFlowStore* torflowstore_new(const gchar* path, guint numMeasurementsPerRelay);
+void torflowstore_free(TorFlowStore* store);
+
+/* the largest relay handle with a record */
+guint torflowstore_getNumRelays(TorFlowStore* store);
+const guint8* torflowstore_getFingerprint(TorFlowStore* store, TorFlowRelayHandle relay);
+/* copies the relay's measurements oldest first into a buffer of TORFLOW_RELAY_MAX_MEASUREMENTS */
+guint torflowstore_getMeasurements(TorFlowStore* store, TorFlowRelayHandle relay,
+        TorFlowStoreMeasurement* measurements);
+guint torflowstore_getNumProbes(TorFlowStore* store, TorFlowRelayHandle relay);
+
+/* returns the round that was in progress when the store was last written, or 0 if there is none */
+guint torflowstore_getUnfinishedRound(TorFlowStore* store);
+
+void torflowstore_setRelay(TorFlowStore* store, TorFlowRelayHandle relay, const guint8* fingerprint);
+void torflowstore_addMeasurement(TorFlowStore* store, TorFlowRelayHandle relay,
+        gsize contentLength, gsize roundTripTime, gsize totalTime);
+void torflowstore_addProbe(TorFlowStore* store, TorFlowRelayHandle relay);
+
+/* starting a round clears the probe counts of all relays */
+void torflowstore_beginRound(TorFlowStore* store, guint roundNumber);
+void torflowstore_finishRound(TorFlowStore* store);
+
+/* asks the kernel to write back what changed, without waiting for it */
+void torflowstore_checkpoint(TorFlowStore* store);
+
+#endif /* SRC_TORFLOW_TORFLOW_STORE_H_ */
@@ -3,68 +3,145 @@
  * See LICENSE for licensing information
  */
 
+#define TORFLOW_LOG_CATEGORY TORFLOW_LOG_EVENTMANAGER
 #include "torflow.h"
 
+/* each level of the wheel has 64 slots, and a slot on level n covers 64^n ticks
+ * (milliseconds). 6 levels let us arm timers up to 2^36 milliseconds (~795 days)
+ * into the future; longer timeouts are clamped and re-linked as the wheel turns. */
+#define TORFLOW_TIMERWHEEL_LEVEL_BITS 6
+#define TORFLOW_TIMERWHEEL_NUM_SLOTS (1 << TORFLOW_TIMERWHEEL_LEVEL_BITS)
+#define TORFLOW_TIMERWHEEL_SLOT_MASK ((guint64)(TORFLOW_TIMERWHEEL_NUM_SLOTS - 1))
+#define TORFLOW_TIMERWHEEL_NUM_LEVELS 6
+#define TORFLOW_TIMERWHEEL_MAX_DELTA (((guint64)1 << (TORFLOW_TIMERWHEEL_LEVEL_BITS*TORFLOW_TIMERWHEEL_NUM_LEVELS)) - 1)
+
 struct _TorFlowTimer {
+    TorFlowTimerWheel* wheel;
+
     GFunc notifyTimerExpired;
     gpointer arg1;
     gpointer arg2;
-    gint timerFD;
+
+    /* where we are linked into the wheel while armed */
+    gboolean isArmed;
+    guint64 expireTick;
+    guint level;
+    guint slot;
+    TorFlowTimer* prev;
+    TorFlowTimer* next;
 };
 
-TorFlowTimer* torflowtimer_new(GFunc func, gpointer arg1, gpointer arg2) {
-    /* store the data in the timer table */
-    TorFlowTimer* timer = g_new0(TorFlowTimer, 1);
-    timer->notifyTimerExpired = func;
-    timer->arg1 = arg1;
-    timer->arg2 = arg2;
+struct _TorFlowTimerWheel {
+    /* the next tick that has not yet been processed */
+    guint64 currentTick;
+    guint numArmed;
 
-    /* create new timerfd */
-    timer->timerFD = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK);
+    /* one bit per slot, set if the slot holds at least one timer */
+    gulong occupied[TORFLOW_TIMERWHEEL_NUM_LEVELS];
+    TorFlowTimer* slots[TORFLOW_TIMERWHEEL_NUM_LEVELS][TORFLOW_TIMERWHEEL_NUM_SLOTS];
+};
 
-    return timer;
+static guint64 _torflowtimer_getNowMillis() {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return ((guint64)now.tv_sec * 1000) + ((guint64)now.tv_nsec / 1000000);
 }
 
-void torflowtimer_arm(TorFlowTimer* timer, guint timeoutSeconds) {
-    g_assert(timer && timer->timerFD > 0);
+static void _torflowtimerwheel_link(TorFlowTimerWheel* wheel, TorFlowTimer* timer) {
+    g_assert(wheel && timer);
 
-    /* create the timer info */
-    struct itimerspec arm;
+    /* timers that are already due go into the slot we process next */
+    guint64 tick = MAX(timer->expireTick, wheel->currentTick);
+    guint64 delta = tick - wheel->currentTick;
 
-    guint64 seconds = (guint64) timeoutSeconds;
-    guint64 nanoseconds = (guint64) 0;
+    if(delta > TORFLOW_TIMERWHEEL_MAX_DELTA) {
+        /* it will be re-linked closer to its expiration when we cascade */
+        delta = TORFLOW_TIMERWHEEL_MAX_DELTA;
+        tick = wheel->currentTick + delta;
+    }
 
-    /* a timer with 0 delay will cause timerfd to disarm, so we use a 1 nano
-     * delay instead, in order to execute the event as close to now as possible */
-    if(seconds == 0 && nanoseconds == 0) {
-        nanoseconds = 1;
+    /* find the lowest level whose range covers the delta */
+    guint level = 0;
+    while(level < TORFLOW_TIMERWHEEL_NUM_LEVELS-1 &&
+            delta >= ((guint64)1 << ((level+1)*TORFLOW_TIMERWHEEL_LEVEL_BITS))) {
+        level++;
     }
 
-    /* set the initial expiration */
-    arm.it_value.tv_sec = seconds;
-    arm.it_value.tv_nsec = nanoseconds;
+    guint slot = (guint)((tick >> (level*TORFLOW_TIMERWHEEL_LEVEL_BITS)) & TORFLOW_TIMERWHEEL_SLOT_MASK);
 
-    /* timer never repeats */
-    arm.it_interval.tv_sec = 0;
-    arm.it_interval.tv_nsec = 0;
+    /* push onto the head of the slot list */
+    timer->level = level;
+    timer->slot = slot;
+    timer->prev = NULL;
+    timer->next = wheel->slots[level][slot];
+    if(timer->next) {
+        timer->next->prev = timer;
+    }
+    wheel->slots[level][slot] = timer;
+    wheel->occupied[level] |= (1UL << slot);
+}
+
+static void _torflowtimerwheel_unlink(TorFlowTimerWheel* wheel, TorFlowTimer* timer) {
+    g_assert(wheel && timer);
+
+    if(timer->prev) {
+        timer->prev->next = timer->next;
+    } else {
+        wheel->slots[timer->level][timer->slot] = timer->next;
+    }
+    if(timer->next) {
+        timer->next->prev = timer->prev;
+    }
 
-    /* arm the timer, flags=0 -> relative time, NULL -> ignore previous setting */
-    gint result = timerfd_settime(timer->timerFD, 0, &arm, NULL);
+    if(wheel->slots[timer->level][timer->slot] == NULL) {
+        wheel->occupied[timer->level] &= ~(1UL << timer->slot);
+    }
+
+    timer->prev = NULL;
+    timer->next = NULL;
 }
 
-static gboolean _torflowtimer_didExpire(TorFlowTimer* timer) {
-    g_assert(timer);
+static void _torflowtimerwheel_cascade(TorFlowTimerWheel* wheel) {
+    g_assert(wheel);
 
-    /* clear the event from the descriptor */
-    guint64 numExpirations = 0;
-    ssize_t result = read(timer->timerFD, &numExpirations, sizeof(guint64));
+    /* we are at the start of a new rotation of level 0. pull down the timers from the
+     * matching slot on each higher level, stopping at the first level that did not wrap. */
+    for(guint level = 1; level < TORFLOW_TIMERWHEEL_NUM_LEVELS; level++) {
+        guint slot = (guint)((wheel->currentTick >> (level*TORFLOW_TIMERWHEEL_LEVEL_BITS)) & TORFLOW_TIMERWHEEL_SLOT_MASK);
 
-    /* return TRUE if read succeeded and the timer expired at least once */
-    if(result > 0 && numExpirations > 0) {
-        return TRUE;
-    } else {
-        return FALSE;
+        TorFlowTimer* timer = wheel->slots[level][slot];
+        wheel->slots[level][slot] = NULL;
+        wheel->occupied[level] &= ~(1UL << slot);
+
+        while(timer) {
+            TorFlowTimer* next = timer->next;
+            _torflowtimerwheel_link(wheel, timer);
+            timer = next;
+        }
+
+        if(slot != 0) {
+            break;
+        }
+    }
+}
+
+static guint64 _torflowtimerwheel_getNextTick(TorFlowTimerWheel* wheel, guint64 nowTick) {
+    g_assert(wheel);
+
+    guint64 next = wheel->currentTick + 1;
+    guint slot = (guint)(next & TORFLOW_TIMERWHEEL_SLOT_MASK);
+
+    if(slot != 0) {
+        /* skip empty slots up to the next occupied one, or to the next rotation where we cascade */
+        gint nextSlot = g_bit_nth_lsf(wheel->occupied[0], (gint)slot - 1);
+        if(nextSlot >= 0) {
+            next += (guint64)(nextSlot - (gint)slot);
+        } else {
+            next = (next | TORFLOW_TIMERWHEEL_SLOT_MASK) + 1;
+        }
     }
+
+    return MIN(next, nowTick + 1);
 }
 
 static void _torflowtimer_callNotify(TorFlowTimer* timer) {
@@ -76,27 +153,152 @@ static void _torflowtimer_callNotify(TorFlowTimer* timer) {
     }
 }
 
-gboolean torflowtimer_check(TorFlowTimer* timer) {
-    g_assert(timer);
+TorFlowTimerWheel* torflowtimerwheel_new() {
+    TorFlowTimerWheel* wheel = g_new0(TorFlowTimerWheel, 1);
+    wheel->currentTick = _torflowtimer_getNowMillis();
+    return wheel;
+}
 
-    /* if the timer expired, execute the callback function; otherwise do nothing */
-    if(_torflowtimer_didExpire(timer)) {
-        _torflowtimer_callNotify(timer);
-        return TRUE;
-    } else {
+void torflowtimerwheel_free(TorFlowTimerWheel* wheel) {
+    g_assert(wheel);
+
+    /* the timers are owned by the components that created them, just detach them */
+    for(guint level = 0; level < TORFLOW_TIMERWHEEL_NUM_LEVELS; level++) {
+        for(guint slot = 0; slot < TORFLOW_TIMERWHEEL_NUM_SLOTS; slot++) {
+            TorFlowTimer* timer = wheel->slots[level][slot];
+            while(timer) {
+                TorFlowTimer* next = timer->next;
+                timer->isArmed = FALSE;
+                timer->wheel = NULL;
+                timer->prev = NULL;
+                timer->next = NULL;
+                timer = next;
+            }
+        }
+    }
+
+    g_free(wheel);
+}
+
+guint torflowtimerwheel_advance(TorFlowTimerWheel* wheel) {
+    g_assert(wheel);
+
+    guint64 nowTick = _torflowtimer_getNowMillis();
+    guint numExpired = 0;
+
+    while(wheel->currentTick <= nowTick) {
+        guint slot = (guint)(wheel->currentTick & TORFLOW_TIMERWHEEL_SLOT_MASK);
+
+        if(slot == 0) {
+            _torflowtimerwheel_cascade(wheel);
+        }
+
+        /* the notify functions may arm new timers into this slot, or free
+         * the timer that is expiring, so never touch a timer after notifying */
+        while(wheel->slots[0][slot] != NULL) {
+            TorFlowTimer* timer = wheel->slots[0][slot];
+            _torflowtimerwheel_unlink(wheel, timer);
+            timer->isArmed = FALSE;
+            wheel->numArmed--;
+            numExpired++;
+            _torflowtimer_callNotify(timer);
+        }
+
+        wheel->currentTick = _torflowtimerwheel_getNextTick(wheel, nowTick);
+    }
+
+    return numExpired;
+}
+
+gboolean torflowtimerwheel_getNextExpiration(TorFlowTimerWheel* wheel, guint64* expireMillis) {
+    g_assert(wheel);
+
+    if(wheel->numArmed == 0) {
         return FALSE;
     }
+
+    guint64 nextTick = G_MAXUINT64;
+
+    for(guint level = 0; level < TORFLOW_TIMERWHEEL_NUM_LEVELS; level++) {
+        if(!wheel->occupied[level]) {
+            continue;
+        }
+
+        /* the first block of this level that we have not yet processed */
+        guint shift = level*TORFLOW_TIMERWHEEL_LEVEL_BITS;
+        guint64 block = (wheel->currentTick + ((guint64)1 << shift) - 1) >> shift;
+        guint slot = (guint)(block & TORFLOW_TIMERWHEEL_SLOT_MASK);
+
+        /* level 0 slots expire, higher level slots cascade, at the start of their block */
+        gint nextSlot = g_bit_nth_lsf(wheel->occupied[level], (gint)slot - 1);
+        if(nextSlot < 0) {
+            /* wrap around into the next rotation */
+            nextSlot = g_bit_nth_lsf(wheel->occupied[level], -1) + TORFLOW_TIMERWHEEL_NUM_SLOTS;
+        }
+
+        guint64 nextBlock = (block & ~TORFLOW_TIMERWHEEL_SLOT_MASK) + (guint64)nextSlot;
+        nextTick = MIN(nextTick, nextBlock << shift);
+    }
+
+    if(expireMillis) {
+        *expireMillis = nextTick;
+    }
+    return TRUE;
+}
+
+TorFlowTimer* torflowtimer_new(TorFlowTimerWheel* wheel, GFunc func, gpointer arg1, gpointer arg2) {
+    g_assert(wheel);
+
+    TorFlowTimer* timer = g_new0(TorFlowTimer, 1);
+    timer->wheel = wheel;
+    timer->notifyTimerExpired = func;
+    timer->arg1 = arg1;
+    timer->arg2 = arg2;
+
+    return timer;
+}
+
+void torflowtimer_armMillis(TorFlowTimer* timer, guint64 timeoutMillis) {
+    g_assert(timer && timer->wheel);
+
+    /* re-arming moves the expiration */
+    torflowtimer_cancel(timer);
+
+    /* a timer with 0 delay expires the next time the wheel is advanced */
+    timer->expireTick = _torflowtimer_getNowMillis() + timeoutMillis;
+    _torflowtimerwheel_link(timer->wheel, timer);
+
+    timer->isArmed = TRUE;
+    timer->wheel->numArmed++;
 }
 
-gint torflowtimer_getFD(TorFlowTimer* timer) {
+void torflowtimer_arm(TorFlowTimer* timer, guint timeoutSeconds) {
+    torflowtimer_armMillis(timer, ((guint64)timeoutSeconds) * 1000);
+}
+
+gboolean torflowtimer_cancel(TorFlowTimer* timer) {
     g_assert(timer);
 
-    return timer->timerFD;
+    if(!timer->isArmed || !timer->wheel) {
+        return FALSE;
+    }
+
+    _torflowtimerwheel_unlink(timer->wheel, timer);
+    timer->isArmed = FALSE;
+    timer->wheel->numArmed--;
+
+    return TRUE;
+}
+
+gboolean torflowtimer_isArmed(TorFlowTimer* timer) {
+    g_assert(timer);
+    return timer->isArmed;
 }
 
 void torflowtimer_free(TorFlowTimer* timer) {
     g_assert(timer);
 
-    close(timer->timerFD);
+    /* make sure the wheel does not hold on to a dangling timer */
+    torflowtimer_cancel(timer);
     g_free(timer);
 }
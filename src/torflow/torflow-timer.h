@@ -11,10 +11,26 @@
 
 typedef struct _TorFlowTimer TorFlowTimer;
 
-TorFlowTimer* torflowtimer_new(GFunc func, gpointer arg1, gpointer arg2);
+/* a hierarchical timing wheel with millisecond ticks. arming and canceling a
+ * timer are O(1), and all timers share the single timerfd of the event manager. */
+typedef struct _TorFlowTimerWheel TorFlowTimerWheel;
+
+TorFlowTimerWheel* torflowtimerwheel_new();
+void torflowtimerwheel_free(TorFlowTimerWheel* wheel);
+
+/* runs the notify function of every timer that expired up until now.
+ * returns the number of timers that expired. */
+guint torflowtimerwheel_advance(TorFlowTimerWheel* wheel);
+
+/* returns TRUE and sets expireMillis to the CLOCK_MONOTONIC time (in milliseconds)
+ * at which the wheel next needs to be advanced, or FALSE if no timer is armed. */
+gboolean torflowtimerwheel_getNextExpiration(TorFlowTimerWheel* wheel, guint64* expireMillis);
+
+TorFlowTimer* torflowtimer_new(TorFlowTimerWheel* wheel, GFunc func, gpointer arg1, gpointer arg2);
 void torflowtimer_arm(TorFlowTimer* timer, guint timeoutSeconds);
-gboolean torflowtimer_check(TorFlowTimer* timer);
-gint torflowtimer_getFD(TorFlowTimer* timer);
+void torflowtimer_armMillis(TorFlowTimer* timer, guint64 timeoutMillis);
+gboolean torflowtimer_cancel(TorFlowTimer* timer);
+gboolean torflowtimer_isArmed(TorFlowTimer* timer);
 void torflowtimer_free(TorFlowTimer* timer);
 
 #endif /* SRC_TORFLOW_TORFLOW_TIMER_H_ */
@@ -3,12 +3,55 @@
  * See LICENSE for licensing information
  */
 
+#define TORFLOW_LOG_CATEGORY TORFLOW_LOG_TORCTL
 #include "torflow.h"
 
+/* the receive buffer grows if a single line does not fit */
+#define TORFLOW_TORCTL_RECEIVE_BUFFER_SIZE 16384
+/* the most queued commands we hand to a single writev */
+#define TORFLOW_TORCTL_MAX_COMMANDS_PER_WRITE 64
+
 typedef enum {
     CTL_NONE, CTL_AUTHENTICATE, CTL_BOOTSTRAP, CTL_PROCESSING
 } TorFlowControlState;
 
+/* what the reply to a command means to us */
+typedef enum {
+    CTL_REPLY_NONE, CTL_REPLY_AUTHENTICATE, CTL_REPLY_BOOTSTRAP, CTL_REPLY_DESCRIPTORS,
+    CTL_REPLY_EXTENDCIRCUIT, CTL_REPLY_ATTACHSTREAM
+} TorFlowControlReplyType;
+
+typedef struct _TorFlowControlReply TorFlowControlReply;
+struct _TorFlowControlReply {
+    TorFlowControlReplyType type;
+    /* the circuit that an EXTENDCIRCUIT reply gives us the id of */
+    TorFlowTorCtlCircuit* circuit;
+};
+
+struct _TorFlowTorCtlCircuit {
+    /* 0 until tor replies to our EXTENDCIRCUIT */
+    gint circuitID;
+    gchar* path;
+
+    gboolean isPending;
+    gboolean isBuilt;
+    /* tor closed it, or never built it */
+    gboolean isClosed;
+    /* our owner is done with it, but tor did not tell us its id yet */
+    gboolean isReleased;
+
+    /* streams from this client port belong to the owner of the circuit */
+    in_port_t streamSourcePort;
+
+    OnCircuitBuiltFunc onCircuitBuilt;
+    OnCircuitClosedFunc onCircuitClosed;
+    gpointer onCircuitArg;
+    OnStreamNewFunc onStreamNew;
+    gpointer onStreamNewArg;
+    OnStreamSucceededFunc onStreamSucceeded;
+    gpointer onStreamSucceededArg;
+};
+
 struct _TorFlowTorCtlClient {
     TorFlowEventManager* manager;
 
@@ -16,21 +59,31 @@ struct _TorFlowTorCtlClient {
     gint descriptor;
     TorFlowControlState state;
     GQueue* commands;
+    /* tor replies to commands in the order we sent them, so the oldest
+     * entry here tells us what the next reply is for */
+    GQueue* replies;
 
     /* flags */
-    gboolean waitingMeasurementCircuit;
-    gint cachedCircId;
-    gchar* cachedCircPath;
     gboolean isStatusEventSet;
 
-    gboolean waitingGetDescriptorsResponse;
-    GQueue* descriptorLines;
-
-    gboolean waitingAttachStreamResponse;
-
-    GString* receiveLineBuffer;
-
-    in_port_t streamFilterPort;
+    /* circuits we built and tor gave us an id for. every probe shares this connection,
+     * so events get to the right probe through the circuit they are about. */
+    GHashTable* circuits;
+    /* the circuits whose owners wait for a stream from a client port, by that port */
+    GHashTable* streamSourcePorts;
+
+    /* descriptors come as the ns/all response or in NS and NEWCONSENSUS events.
+     * after the data lines we wait for the OK that ends the reply. */
+    gboolean isReceivingDescriptors;
+    gboolean isFinishingDescriptors;
+    gboolean isDescriptorEvent;
+    gboolean isFullConsensus;
+
+    /* we receive into this buffer and parse each line where it is. only the partial line
+     * at the end of a read is moved to the front, where the next read completes it. */
+    gchar* receiveBuffer;
+    gsize receiveBufferSize;
+    gsize receiveLength;
 
     OnConnectedFunc onConnected;
     gpointer onConnectedArg;
@@ -38,369 +91,596 @@ struct _TorFlowTorCtlClient {
     gpointer onAuthenticatedArg;
     OnBootstrappedFunc onBootstrapped;
     gpointer onBootstrappedArg;
+    OnDescriptorsBeginFunc onDescriptorsBegin;
+    OnDescriptorLineFunc onDescriptorLine;
     OnDescriptorsReceivedFunc onDescriptorsReceived;
+    OnDescriptorsFailedFunc onDescriptorsFailed;
     gpointer onDescriptorsReceivedArg;
-    OnCircuitBuiltFunc onCircuitBuilt;
-    gpointer onCircuitBuiltArg;
     OnStreamNewFunc onStreamNew;
     gpointer onStreamNewArg;
-    OnStreamSucceededFunc onStreamSucceeded;
-    gpointer onStreamSucceededArg;
 
     gchar* id;
 };
 
-static gint _torflowtorctlclient_parseCode(gchar* line) {
-    gchar** parts1 = g_strsplit(line, " ", 0);
-    gchar** parts2 = g_strsplit_set(parts1[0], "-+", 0);
-    gint code = atoi(parts2[0]);
-    g_strfreev(parts1);
-    g_strfreev(parts2);
-    return code;
+/* splits a received line into space separated tokens in place, by terminating each
+ * token where it ends. the tokens point into the receive buffer, so nothing is copied. */
+typedef struct _TorFlowControlTokenizer TorFlowControlTokenizer;
+struct _TorFlowControlTokenizer {
+    gchar* cursor;
+    gchar* end;
+};
+
+static void _torflowtorctlclient_tokenize(TorFlowControlTokenizer* tokenizer, gchar* line, gsize length) {
+    tokenizer->cursor = line;
+    tokenizer->end = &line[length];
+}
+
+static gchar* _torflowtorctlclient_nextToken(TorFlowControlTokenizer* tokenizer) {
+    while(tokenizer->cursor < tokenizer->end && *tokenizer->cursor == ' ') {
+        tokenizer->cursor++;
+    }
+
+    if(tokenizer->cursor >= tokenizer->end) {
+        return NULL;
+    }
+
+    gchar* token = tokenizer->cursor;
+    gchar* space = memchr(token, ' ', (gsize)(tokenizer->end - token));
+
+    if(space) {
+        *space = '\0';
+        tokenizer->cursor = space + 1;
+    } else {
+        /* the line itself is terminated */
+        tokenizer->cursor = tokenizer->end;
+    }
+
+    return token;
+}
+
+/* returns the value if the token is KEY=VALUE for the given key */
+static gchar* _torflowtorctlclient_parseValue(gchar* token, const gchar* key, gsize keyLength) {
+    if(!g_ascii_strncasecmp(token, key, keyLength) && token[keyLength] == '=') {
+        return &token[keyLength + 1];
+    }
+    return NULL;
 }
 
-static gint _torflowtorctlclient_parseBootstrapProgress(gchar* line) {
+/* splits ADDRESS:PORT in place */
+static void _torflowtorctlclient_parseAddress(gchar* token, gchar** address, in_port_t* port) {
+    gchar* colon = strrchr(token, ':');
+    if(colon) {
+        *colon = '\0';
+        *address = token;
+        *port = (in_port_t)atoi(colon + 1);
+    }
+}
+
+static gint _torflowtorctlclient_parseCode(const gchar* line, gsize length) {
+    /* every reply line starts with a three digit status code */
+    if(length < 3 || !g_ascii_isdigit(line[0]) || !g_ascii_isdigit(line[1]) || !g_ascii_isdigit(line[2])) {
+        return 0;
+    }
+    return (line[0] - '0') * 100 + (line[1] - '0') * 10 + (line[2] - '0');
+}
+
+static gint _torflowtorctlclient_parseBootstrapProgress(gchar* line, gsize length) {
     gint progress = -1;
-    gchar** parts = g_strsplit(line, " ", 0);
-    gchar* part = NULL;
     gboolean foundBootstrap = FALSE;
-    for(gint j = 0; (part = parts[j]) != NULL; j++) {
-        gchar** subparts = g_strsplit(part, "=", 0);
-        if(!g_ascii_strncasecmp(subparts[0], "BOOTSTRAP", 9)) {
+
+    TorFlowControlTokenizer tokenizer;
+    _torflowtorctlclient_tokenize(&tokenizer, line, length);
+
+    gchar* token = NULL;
+    while((token = _torflowtorctlclient_nextToken(&tokenizer)) != NULL) {
+        gchar* value = NULL;
+        if(!g_ascii_strncasecmp(token, "BOOTSTRAP", 9)) {
             foundBootstrap = TRUE;
-        } else if(foundBootstrap && !g_ascii_strncasecmp(subparts[0], "PROGRESS", 8)) {
-            progress = atoi(subparts[1]);
+        } else if(foundBootstrap && (value = _torflowtorctlclient_parseValue(token, "PROGRESS", 8)) != NULL) {
+            progress = atoi(value);
         }
-        g_strfreev(subparts);
     }
-    g_strfreev(parts);
+
     return progress;
 }
 
-static void _torflowtorctlclient_processDescriptorLine(TorFlowTorCtlClient* torctl, GString* linebuf) {
-    /* handle descriptor info */
-    if(!torctl->descriptorLines && g_strstr_len(linebuf->str, linebuf->len, "250+ns/all=")) {
+/* necessary forward declaration */
+static void _torflowtorctlclient_flushCommands(TorFlowTorCtlClient* torctl, TorFlowEventFlag eventType);
+
+static void _torflowtorctlclient_queueCommand(TorFlowTorCtlClient* torctl, GString* command,
+        TorFlowControlReplyType replyType, TorFlowTorCtlCircuit* circuit) {
+    g_assert(torctl);
+    g_assert(command);
+
+    TorFlowControlReply* reply = g_new0(TorFlowControlReply, 1);
+    reply->type = replyType;
+    reply->circuit = circuit;
+
+    g_queue_push_tail(torctl->commands, command);
+    g_queue_push_tail(torctl->replies, reply);
+}
+
+static void _torflowtorctlclient_freeCircuit(TorFlowTorCtlCircuit* circuit) {
+    g_assert(circuit);
+
+    if(circuit->path) {
+        g_free(circuit->path);
+    }
+    g_free(circuit);
+}
+
+static void _torflowtorctlclient_clearStreamSourcePort(TorFlowTorCtlClient* torctl, TorFlowTorCtlCircuit* circuit) {
+    g_assert(torctl);
+    g_assert(circuit);
+
+    if(circuit->streamSourcePort > 0) {
+        gpointer key = GUINT_TO_POINTER((guint)circuit->streamSourcePort);
+        if(g_hash_table_lookup(torctl->streamSourcePorts, key) == circuit) {
+            g_hash_table_remove(torctl->streamSourcePorts, key);
+        }
+        circuit->streamSourcePort = 0;
+    }
+}
+
+static void _torflowtorctlclient_closeCircuit(TorFlowTorCtlClient* torctl, TorFlowTorCtlCircuit* circuit) {
+    g_assert(torctl);
+    g_assert(circuit);
+
+    _torflowtorctlclient_clearStreamSourcePort(torctl, circuit);
+
+    if(circuit->circuitID > 0) {
+        if(g_hash_table_lookup(torctl->circuits, GINT_TO_POINTER(circuit->circuitID)) == circuit) {
+            g_hash_table_remove(torctl->circuits, GINT_TO_POINTER(circuit->circuitID));
+        }
+
+        /* tor already forgot about circuits that closed or failed */
+        if(!circuit->isClosed) {
+            GString* command = g_string_new(NULL);
+            g_string_printf(command, "CLOSECIRCUIT %i\r\n", circuit->circuitID);
+            _torflowtorctlclient_queueCommand(torctl, command, CTL_REPLY_NONE, NULL);
+            _torflowtorctlclient_flushCommands(torctl, TORFLOW_EV_NONE);
+
+            debug("%s: queued a CLOSECIRCUIT command for %i", torctl->id, circuit->circuitID);
+        }
+    }
+
+    _torflowtorctlclient_freeCircuit(circuit);
+}
+
+static void _torflowtorctlclient_beginDescriptors(TorFlowTorCtlClient* torctl,
+        gboolean isDescriptorEvent, gboolean isFullConsensus) {
+    torctl->isReceivingDescriptors = TRUE;
+    torctl->isFinishingDescriptors = FALSE;
+    torctl->isDescriptorEvent = isDescriptorEvent;
+    torctl->isFullConsensus = isFullConsensus;
+
+    if(torctl->onDescriptorsBegin) {
+        torctl->onDescriptorsBegin(torctl->onDescriptorsReceivedArg, isFullConsensus);
+    }
+}
+
+static void _torflowtorctlclient_finishDescriptors(TorFlowTorCtlClient* torctl) {
+    torctl->isFinishingDescriptors = FALSE;
+
+    if(torctl->onDescriptorsReceived) {
+        torctl->onDescriptorsReceived(torctl->onDescriptorsReceivedArg, torctl->isFullConsensus);
+    }
+}
+
+static void _torflowtorctlclient_processDescriptorLine(TorFlowTorCtlClient* torctl, gchar* line, gsize length,
+        gint code, gboolean isEndOfReply) {
+    /* the descriptor lines themselves never get here, we hand them over as they arrive */
+    if(g_strstr_len(line, length, "250+ns/all=")) {
         info("%s: 'GETINFO ns/all\\r\\n' command successful, descriptor response coming next", torctl->id);
-        torctl->descriptorLines = g_queue_new();
+        _torflowtorctlclient_beginDescriptors(torctl, FALSE, TRUE);
+    } else if(isEndOfReply && torctl->isFinishingDescriptors && !torctl->isDescriptorEvent && code == 250) {
+        /* all done with descriptors */
+        info("%s: got descriptor response success code '%s'", torctl->id, line);
+        _torflowtorctlclient_finishDescriptors(torctl);
+    } else if(code != 250) {
+        warning("%s: descriptor request failed with '%s'", torctl->id, line);
+        /* the owner decides whether to ask again */
+        if(isEndOfReply && torctl->onDescriptorsFailed) {
+            torctl->onDescriptorsFailed(torctl->onDescriptorsReceivedArg);
+        }
     }
+}
 
-    if(torctl->descriptorLines) {
-        /* descriptors coming */
-        if(g_strstr_len(linebuf->str, linebuf->len, "250+ns/all=")) {
-            /* header */
-            info("%s: got descriptor response header '%s'", torctl->id, linebuf->str);
-        } else if(linebuf->str[0] == '.') {
-            /* footer */
-            info("%s: got descriptor response footer '%s'", torctl->id, linebuf->str);
-        } else if(g_strstr_len(linebuf->str, linebuf->len, "250 OK")) {
-            /* all done with descriptors */
-            info("%s: got descriptor response success code '%s'", torctl->id, linebuf->str);
+static void _torflowtorctlclient_processDescriptorData(TorFlowTorCtlClient* torctl,
+        const gchar* line, gsize length) {
+    if(length == 1 && line[0] == '.') {
+        /* footer */
+        info("%s: got descriptor response footer '.'", torctl->id);
+        torctl->isReceivingDescriptors = FALSE;
+        torctl->isFinishingDescriptors = TRUE;
+        return;
+    }
 
-            torctl->waitingGetDescriptorsResponse = FALSE;
+    /* data lines that start with a '.' are escaped with another one */
+    if(length > 0 && line[0] == '.') {
+        line++;
+        length--;
+    }
 
-            if(torctl->onDescriptorsReceived) {
-                torctl->onDescriptorsReceived(torctl->onDescriptorsReceivedArg, torctl->descriptorLines);
-            }
+    if(torctl->onDescriptorLine) {
+        torctl->onDescriptorLine(torctl->onDescriptorsReceivedArg, line, length);
+    }
+}
 
-            /* clean up any leftover lines */
-            while(g_queue_get_length(torctl->descriptorLines) > 0) {
-                g_free(g_queue_pop_head(torctl->descriptorLines));
+static void _torflowtorctlclient_processBootstrapLine(TorFlowTorCtlClient* torctl, gchar* line, gsize length) {
+    /* we will be getting all client status events, not all of them have bootstrap status */
+    gint progress = _torflowtorctlclient_parseBootstrapProgress(line, length);
+    if(progress >= 0) {
+        debug("%s: successfully received bootstrap phase response with progress %i", torctl->id, progress);
+        if(progress >= 100) {
+            message("%s: torflow client is now ready (Bootstrapped 100)", torctl->id);
+
+            torctl->isStatusEventSet = FALSE;
+            torctl->state = CTL_PROCESSING;
+
+            if(torctl->onBootstrapped) {
+                torctl->onBootstrapped(torctl->onBootstrappedArg);
             }
-            g_queue_free(torctl->descriptorLines);
-            torctl->descriptorLines = NULL;
-        } else {
-            /* real descriptor lines */
-            g_queue_push_tail(torctl->descriptorLines, g_strdup(linebuf->str));
+        } else if(!(torctl->isStatusEventSet)) {
+            /* not yet at 100%, register the async status event to wait for it */
+            _torflowtorctlclient_queueCommand(torctl, g_string_new("SETEVENTS EXTENDED STATUS_CLIENT\r\n"),
+                    CTL_REPLY_NONE, NULL);
+            torctl->isStatusEventSet = TRUE;
+            _torflowtorctlclient_flushCommands(torctl, TORFLOW_EV_NONE);
         }
     }
 }
 
-static void _torflowtorctlclient_processLineSync(TorFlowTorCtlClient* torctl, GString* linebuf) {
-    /*
-     * '250 OK' msgs are fine. the only thing we want to extract info from
-     * is when we are building a new measurement circuit
-     * or when we are getting descriptor information and need to stop.
+static void _torflowtorctlclient_processExtendedLine(TorFlowTorCtlClient* torctl,
+        TorFlowTorCtlCircuit* circuit, gchar* line, gsize length, gint code) {
+    g_assert(circuit);
+
+    /* response to EXTENDCIRCUIT:
+     * '250 EXTENDED circid'
      */
-    if(g_strstr_len(linebuf->str, linebuf->len, "250 EXTENDED ")) {
-        /* are we waiting for a circuit we built? */
-        if(torctl->waitingMeasurementCircuit && !torctl->cachedCircId) {
-            /* response to EXTENDCIRCUIT:
-             * '250 EXTENDED circid'
-             */
-            gchar** parts = g_strsplit(linebuf->str, " ", 0);
-            torctl->cachedCircId = atoi(parts[2]);
-            g_strfreev(parts);
-
-            if(torctl->cachedCircId <= 0) {
-                warning("%s: measurement circuit build failure '%s'", torctl->id, torctl->cachedCircPath);
+    gint circuitID = 0;
+    if(code == 250 && g_str_has_prefix(line, "250 EXTENDED ")) {
+        circuitID = atoi(&line[13]);
+    }
+
+    circuit->isPending = FALSE;
+
+    if(circuitID <= 0) {
+        warning("%s: measurement circuit build failure '%s': '%s'", torctl->id, circuit->path, line);
+        circuit->isClosed = TRUE;
+    } else {
+        info("%s: started building measurement circuit '%i' with path '%s'", torctl->id,
+                circuitID, circuit->path);
+        circuit->circuitID = circuitID;
+        g_hash_table_replace(torctl->circuits, GINT_TO_POINTER(circuitID), circuit);
+    }
+
+    /* the probe gave up on it while we waited for its id */
+    if(circuit->isReleased) {
+        _torflowtorctlclient_closeCircuit(torctl, circuit);
+    } else if(circuit->isClosed && circuit->onCircuitClosed) {
+        /* the owner may close the circuit from here, so we are done with it */
+        circuit->onCircuitClosed(circuit->onCircuitArg, circuitID);
+    }
+}
+
+static void _torflowtorctlclient_processReply(TorFlowTorCtlClient* torctl, TorFlowControlReply* reply,
+        gchar* line, gsize length, gint code, gboolean isEndOfReply) {
+    switch(reply->type) {
+        case CTL_REPLY_AUTHENTICATE: {
+            if(code == 250) {
+                info("%s: successfully received auth response '%s'", torctl->id, line);
+
+                if(isEndOfReply && torctl->onAuthenticated) {
+                    torctl->onAuthenticated(torctl->onAuthenticatedArg);
+                }
             } else {
-                info("%s: started building measurement circuit '%i' with path '%s'", torctl->id,
-                        torctl->cachedCircId, torctl->cachedCircPath);
+                critical("%s: received failed auth response '%s'", torctl->id, line);
             }
+            break;
         }
-    } else if (torctl->waitingGetDescriptorsResponse) {
-        _torflowtorctlclient_processDescriptorLine(torctl, linebuf);
-    } else if(torctl->waitingAttachStreamResponse) {
-        /* got response for attach stream */
-        torctl->waitingAttachStreamResponse = FALSE;
 
-        gint code = _torflowtorctlclient_parseCode(linebuf->str);
-        gboolean isSuccess = (code == 250) ? TRUE : FALSE;
+        case CTL_REPLY_BOOTSTRAP: {
+            if(torctl->state == CTL_BOOTSTRAP) {
+                _torflowtorctlclient_processBootstrapLine(torctl, line, length);
+            }
+            break;
+        }
 
-        if(isSuccess) {
-            info("%s: stream was successfully attached to circuit", torctl->id);
-        } else {
-            /* failure attaching stream */
-            warning("%s: error %i from Tor when trying to attach stream", torctl->id, code);
+        case CTL_REPLY_DESCRIPTORS: {
+            _torflowtorctlclient_processDescriptorLine(torctl, line, length, code, isEndOfReply);
+            break;
+        }
+
+        case CTL_REPLY_EXTENDCIRCUIT: {
+            if(isEndOfReply) {
+                _torflowtorctlclient_processExtendedLine(torctl, reply->circuit, line, length, code);
+            }
+            break;
+        }
+
+        case CTL_REPLY_ATTACHSTREAM: {
+            if(code == 250) {
+                info("%s: stream was successfully attached to circuit", torctl->id);
+            } else {
+                /* failure attaching stream */
+                warning("%s: error %i from Tor when trying to attach stream", torctl->id, code);
+            }
+            break;
+        }
+
+        case CTL_REPLY_NONE:
+        default: {
+            /* '250 OK' msgs are fine */
+            if(code == 250) {
+                info_limited("%s: ignoring synchronous response '%s'", torctl->id, line);
+            } else {
+                info_limited("%s: command failed with response '%s'", torctl->id, line);
+            }
+            break;
         }
-    } else {
-        info("%s: ignoring synchronous response '%s'", torctl->id, linebuf->str);
     }
 }
 
-static void _torflowtorctlclient_processCircuitLine(TorFlowTorCtlClient* torctl, const gchar* line) {
+static void _torflowtorctlclient_processCircuitLine(TorFlowTorCtlClient* torctl, gchar* line, gsize length) {
     /* responses:
      *   650 CIRC 21 BUILT ...
      *   650 CIRC 3 CLOSED ...
      */
-    gchar** parts = g_strsplit(line, " ", 0);
-    gint circuitID = atoi(parts[2]);
+    TorFlowControlTokenizer tokenizer;
+    _torflowtorctlclient_tokenize(&tokenizer, line, length);
+
+    /* skip the code and the event name */
+    _torflowtorctlclient_nextToken(&tokenizer);
+    _torflowtorctlclient_nextToken(&tokenizer);
+    gchar* circuitToken = _torflowtorctlclient_nextToken(&tokenizer);
+    gchar* status = _torflowtorctlclient_nextToken(&tokenizer);
+
+    if(!circuitToken || !status) {
+        return;
+    }
 
-    /* we only care about our circuit here */
-    if(circuitID == torctl->cachedCircId) {
+    gint circuitID = atoi(circuitToken);
+
+    /* we only care about the circuits we built */
+    TorFlowTorCtlCircuit* circuit = g_hash_table_lookup(torctl->circuits, GINT_TO_POINTER(circuitID));
+
+    if(circuit) {
         /* check the status */
-        if(g_strstr_len(parts[3], 5, "BUILT")) {
+        if(g_strstr_len(status, 5, "BUILT")) {
             /* a circuit was built, is it one we tried to build? */
-            if(torctl->waitingMeasurementCircuit) {
+            if(!circuit->isBuilt) {
                 /* this was the circuit we built */
                 info("%s: successfully built new requested circuit '%i' with path '%s'",
-                        torctl->id, circuitID, torctl->cachedCircPath);
+                        torctl->id, circuitID, circuit->path);
 
                 /* we are no longer waiting for a circuit */
-                torctl->waitingMeasurementCircuit = FALSE;
+                circuit->isBuilt = TRUE;
 
-                if(torctl->onCircuitBuilt) {
-                    torctl->onCircuitBuilt(torctl->onCircuitBuiltArg, circuitID);
+                /* the owner may close the circuit from here, so we are done with it */
+                if(circuit->onCircuitBuilt) {
+                    circuit->onCircuitBuilt(circuit->onCircuitArg, circuitID);
                 }
             } else {
                 info("%s: built circuit '%i' after circuit was already built??", torctl->id, circuitID);
             }
-        } else if(g_strstr_len(parts[3], 6, "CLOSED")) {
-            /* did it close prematurely? */
-            if(torctl->waitingMeasurementCircuit) {
-                /* CLOSED came before we got a BUILT */
-                torctl->waitingMeasurementCircuit = FALSE;
+        } else if(g_strstr_len(status, 6, "CLOSED") || g_strstr_len(status, 6, "FAILED")) {
+            gboolean isFailed = g_strstr_len(status, 6, "FAILED") ? TRUE : FALSE;
+
+            gboolean isTimeout = FALSE;
+            gchar* token = NULL;
+            while((token = _torflowtorctlclient_nextToken(&tokenizer)) != NULL) {
+                gchar* reason = _torflowtorctlclient_parseValue(token, "REASON", 6);
+                if(reason && !g_ascii_strcasecmp(reason, "TIMEOUT")) {
+                    isTimeout = TRUE;
+                }
+            }
 
-                info("%s: requested circuit '%i' with path '%s' was closed before it finished building",
-                        torctl->id, circuitID, torctl->cachedCircPath);
-            } else {
+            /* did it close prematurely? */
+            if(!circuit->isBuilt) {
+                /* CLOSED or FAILED came before we got a BUILT */
+                info("%s: requested circuit '%i' with path '%s' %s before it finished building",
+                        torctl->id, circuitID, circuit->path, isFailed ? "failed" : "was closed");
+            } else if(!isFailed) {
                 /* it CLOSED after it was BUILT */
                 info("%s: requested circuit '%i' with path '%s' was closed after it was built",
-                        torctl->id, circuitID, torctl->cachedCircPath);
+                        torctl->id, circuitID, circuit->path);
+            } else if(isTimeout) {
+                /* failed because of a timeout */
+                message("%s: requested circuit '%i' with path '%s' has timed out after it was built",
+                        torctl->id, circuitID, circuit->path);
+            } else {
+                /* failed for another reason */
+                message("%s: requested circuit '%i' with path '%s' has failed after it was built for a reason that we didn't parse",
+                        torctl->id, circuitID, circuit->path);
             }
-        } else if(g_strstr_len(parts[3], 6, "FAILED")) {
-            /* did it close prematurely? */
-            if(torctl->waitingMeasurementCircuit) {
-                /* FAILED came before we got a BUILT */
-                torctl->waitingMeasurementCircuit = FALSE;
 
-                info("%s: requested circuit '%i' with path '%s' failed before it finished building",
-                        torctl->id, circuitID, torctl->cachedCircPath);
-            } else {
-                /* it FAILED after it was BUILT */
-                if(g_strstr_len(parts[7], 14, "REASON=TIMEOUT")) {
-                    /* failed because of a timeout */
-                    message("%s: requested circuit '%i' with path '%s' has timed out after it was built",
-                            torctl->id, circuitID, torctl->cachedCircPath);
-
-//                if(tfb->eventHandlers.onFileServerTimeout) {
-//                    tfb->eventHandlers.onFileServerTimeout(tfb);
-//                }
-                } else {
-                    /* failed for another reason */
-                    message("%s: requested circuit '%i' with path '%s' has failed after it was built for a reason that we didn't parse",
-                            torctl->id, circuitID, torctl->cachedCircPath);
-                }
+            /* tor is done with it, so events about this id are not for us anymore */
+            circuit->isClosed = TRUE;
+            g_hash_table_remove(torctl->circuits, GINT_TO_POINTER(circuitID));
+
+            /* the owner may close the circuit from here, so we are done with it */
+            if(circuit->onCircuitClosed) {
+                circuit->onCircuitClosed(circuit->onCircuitArg, circuitID);
             }
         } else {
-            info("%s: ignoring status on requested circuit '%i' with path '%s'",
-                    torctl->id, circuitID, torctl->cachedCircPath);
+            info_limited("%s: ignoring status on requested circuit '%i' with path '%s'",
+                    torctl->id, circuitID, circuit->path);
         }
     } else {
-        info("%s: ignoring event on unrequested circuit '%i'", torctl->id, circuitID);
+        info_limited("%s: ignoring event on unrequested circuit '%i'", torctl->id, circuitID);
     }
-
-    g_strfreev(parts);
 }
 
-static void _torflowtorctlclient_processStreamLine(TorFlowTorCtlClient* torctl, const gchar* line) {
+static void _torflowtorctlclient_processStreamLine(TorFlowTorCtlClient* torctl, gchar* line, gsize length) {
     /* responses:
      *   650 STREAM 21 NEW 0 52.1.0.0:80 ...
      *   650 STREAM 21 SUCCEEDED 22 52.1.0.0:80
      *   650 STREAM 18 CLOSED 5 53.1.0.0:9111 ...
      */
-    gchar** parts = g_strsplit(line, " ", 0);
+    TorFlowControlTokenizer tokenizer;
+    _torflowtorctlclient_tokenize(&tokenizer, line, length);
+
+    /* skip the code and the event name */
+    _torflowtorctlclient_nextToken(&tokenizer);
+    _torflowtorctlclient_nextToken(&tokenizer);
+    gchar* streamToken = _torflowtorctlclient_nextToken(&tokenizer);
+    gchar* status = _torflowtorctlclient_nextToken(&tokenizer);
+    gchar* circuitToken = _torflowtorctlclient_nextToken(&tokenizer);
+    gchar* targetToken = _torflowtorctlclient_nextToken(&tokenizer);
+
+    if(!streamToken || !status || !circuitToken || !targetToken) {
+        return;
+    }
 
-    gint streamID = atoi(parts[2]);
-    gint circuitID = atoi(parts[4]);
+    gint streamID = atoi(streamToken);
+    gint circuitID = atoi(circuitToken);
 
+    /* the addresses point into the line, so they are only valid during the callbacks */
     gchar* targetAddress = NULL;
     in_port_t targetPort = 0;
-    {
-        gchar** targetParts = g_strsplit(parts[5], ":", 0);
-
-        if(targetParts[0] && targetParts[1]) {
-            targetAddress = g_strdup(targetParts[0]);
-            targetPort = (in_port_t)atoi(targetParts[1]);
-        }
-
-        g_strfreev(targetParts);
-    }
+    _torflowtorctlclient_parseAddress(targetToken, &targetAddress, &targetPort);
 
     gchar* sourceAddress = NULL;
     in_port_t sourcePort = 0;
-    {
-        for(gint i = 6; parts[i]; i++) {
-            if(!g_ascii_strncasecmp(parts[i], "SOURCE_ADDR=", 12)) {
-                gchar** sourceParts = g_strsplit(&parts[i][12], ":", 0);
-
-                if(sourceParts[0] && sourceParts[1]) {
-                    sourceAddress = g_strdup(sourceParts[0]);
-                    sourcePort = (in_port_t)atoi(sourceParts[1]);
-                }
-
-                g_strfreev(sourceParts);
-            }
+    gchar* token = NULL;
+    while((token = _torflowtorctlclient_nextToken(&tokenizer)) != NULL) {
+        gchar* source = _torflowtorctlclient_parseValue(token, "SOURCE_ADDR", 11);
+        if(source) {
+            _torflowtorctlclient_parseAddress(source, &sourceAddress, &sourcePort);
         }
     }
 
-    if(g_strstr_len(parts[3], 3, "NEW")) {
+    if(g_strstr_len(status, 3, "NEW")) {
         info("%s: new stream %i with source %s:%u and target %s:%u", torctl->id, streamID,
                 sourceAddress, sourcePort, targetAddress, targetPort);
 
-        if(torctl->streamFilterPort == 0 || torctl->streamFilterPort == sourcePort) {
-            if(torctl->onStreamNew) {
-                torctl->onStreamNew(torctl->onStreamNewArg, streamID,
-                        sourceAddress, sourcePort, targetAddress, targetPort);
-            }
-        } else {
-            info("%s: new stream %i with source %s:%u and target %s:%u was filtered", torctl->id, streamID,
+        /* streams from a port someone registered go to the owner of that circuit */
+        TorFlowTorCtlCircuit* circuit = sourcePort > 0 ?
+                g_hash_table_lookup(torctl->streamSourcePorts, GUINT_TO_POINTER((guint)sourcePort)) : NULL;
+
+        if(circuit && circuit->onStreamNew) {
+            circuit->onStreamNew(circuit->onStreamNewArg, streamID,
+                    sourceAddress, sourcePort, targetAddress, targetPort);
+        } else if(torctl->onStreamNew) {
+            torctl->onStreamNew(torctl->onStreamNewArg, streamID,
                     sourceAddress, sourcePort, targetAddress, targetPort);
         }
-
     } else {
-        if(circuitID == torctl->cachedCircId) {
-            if(g_strstr_len(parts[3], 9, "SUCCEEDED")) {
+        TorFlowTorCtlCircuit* circuit = circuitID > 0 ?
+                g_hash_table_lookup(torctl->circuits, GINT_TO_POINTER(circuitID)) : NULL;
+
+        if(circuit) {
+            if(g_strstr_len(status, 9, "SUCCEEDED")) {
                 info("%s: attached stream %i on circuit %i with source %s:%u has succeeded connecting to target %s:%u",
                         torctl->id, streamID, circuitID,
                         sourceAddress, sourcePort, targetAddress, targetPort);
 
-                if(torctl->onStreamSucceeded && circuitID == torctl->cachedCircId) {
-                    torctl->onStreamSucceeded(torctl->onStreamSucceededArg, streamID, circuitID,
+                if(circuit->onStreamSucceeded) {
+                    circuit->onStreamSucceeded(circuit->onStreamSucceededArg, streamID, circuitID,
                             sourceAddress, sourcePort, targetAddress, targetPort);
                 }
-            } else if(g_strstr_len(parts[3], 6, "CLOSED")) {
+            } else if(g_strstr_len(status, 6, "CLOSED")) {
                 info("%s: closed stream %i on circuit %i with source %s:%u and target %s:%u",
                         torctl->id, streamID, circuitID,
                         sourceAddress, sourcePort, targetAddress, targetPort);
             } else {
-                info("%s: got unhandled event for stream %i on circuit %i "
+                info_limited("%s: got unhandled event for stream %i on circuit %i "
                         "with source %s:%u and target %s:%u",
                         torctl->id, streamID, circuitID,
                         sourceAddress, sourcePort, targetAddress, targetPort);
             }
         } else {
-            info("%s: ignoring stream %i on unrequested circuit %i "
+            info_limited("%s: ignoring stream %i on unrequested circuit %i "
                     "with source %s:%u and target %s:%u",
                     torctl->id, streamID, circuitID,
                     sourceAddress, sourcePort, targetAddress, targetPort);
         }
     }
+}
 
-    if(targetAddress) {
-        g_free(targetAddress);
+static void _torflowtorctlclient_processLineASync(TorFlowTorCtlClient* torctl, gchar* line, gsize length) {
+    /* consensus events carry the same router status lines as ns/all:
+     *   650+NEWCONSENSUS  (the whole new consensus)
+     *   650+NS            (only the entries that changed)
+     */
+    if(g_str_has_prefix(line, "650+NEWCONSENSUS") || g_str_has_prefix(line, "650+NS")) {
+        gboolean isFullConsensus = g_str_has_prefix(line, "650+NEWCONSENSUS");
+        info("%s: got %s event", torctl->id, isFullConsensus ? "NEWCONSENSUS" : "NS");
+        _torflowtorctlclient_beginDescriptors(torctl, TRUE, isFullConsensus);
+        return;
+    } else if(torctl->isFinishingDescriptors && torctl->isDescriptorEvent &&
+            g_str_has_prefix(line, "650 OK")) {
+        _torflowtorctlclient_finishDescriptors(torctl);
+        return;
     }
-    if(sourceAddress) {
-        g_free(sourceAddress);
+
+    /* ignore internal .exit circuits */
+    if(g_strstr_len(line, length, ".exit")) {
+        info_limited("%s: ignoring tor-internal response '%s'", torctl->id, line);
+        return;
     }
 
-    g_strfreev(parts);
+    if(g_strstr_len(line, length, " CIRC ")) {
+        _torflowtorctlclient_processCircuitLine(torctl, line, length);
+    } else if(g_strstr_len(line, length, " STREAM ")) {
+        _torflowtorctlclient_processStreamLine(torctl, line, length);
+    } else {
+        info_limited("%s: ignoring asynchronous response '%s'", torctl->id, line);
+    }
 }
 
-static void _torflowtorctlclient_processLineASync(TorFlowTorCtlClient* torctl, GString* linebuf) {
-    gboolean isConsumed = FALSE;
+static void _torflowtorctlclient_processLine(TorFlowTorCtlClient* torctl, gchar* line, gsize length) {
+    gint code = _torflowtorctlclient_parseCode(line, length);
 
-    /* ignore internal .exit circuits */
-    if(g_strstr_len(linebuf->str, linebuf->len, ".exit")) {
-        info("%s: ignoring tor-internal response '%s'", torctl->id, linebuf->str);
+    if(code == 650) {
+        /* asynchronous events. while we bootstrap, the status events tell us the progress. */
+        if(torctl->state == CTL_BOOTSTRAP) {
+            _torflowtorctlclient_processBootstrapLine(torctl, line, length);
+        } else if(torctl->state == CTL_PROCESSING) {
+            _torflowtorctlclient_processLineASync(torctl, line, length);
+        }
         return;
     }
 
-    if(g_strstr_len(linebuf->str, linebuf->len, " CIRC ")) {
-        _torflowtorctlclient_processCircuitLine(torctl, linebuf->str);
-    } else if(g_strstr_len(linebuf->str, linebuf->len, " STREAM ")) {
-        _torflowtorctlclient_processStreamLine(torctl, linebuf->str);
-    } else {
-        info("%s: ignoring asynchronous response '%s'", torctl->id, linebuf->str);
+    /* everything else is part of the reply to our oldest command. a space after the code
+     * marks the last line of a reply, '-' and '+' mark the lines before it. */
+    TorFlowControlReply* reply = g_queue_peek_head(torctl->replies);
+    if(!reply) {
+        info_limited("%s: ignoring unexpected response '%s'", torctl->id, line);
+        return;
     }
-}
 
-static void _torflowtorctlclient_processLine(TorFlowTorCtlClient* torctl, GString* linebuf) {
-    switch(torctl->state) {
+    gboolean isEndOfReply = (length >= 4 && line[3] == ' ') ? TRUE : FALSE;
 
-        case CTL_AUTHENTICATE: {
-            gint code = _torflowtorctlclient_parseCode(linebuf->str);
-            if(code == 250) {
-                info("%s: successfully received auth response '%s'", torctl->id, linebuf->str);
+    /* pop it first, so the replies to commands that the handlers send queue up behind */
+    if(isEndOfReply) {
+        g_queue_pop_head(torctl->replies);
+    }
 
-                if(torctl->onAuthenticated) {
-                    torctl->onAuthenticated(torctl->onAuthenticatedArg);
-                }
-            } else {
-                critical("%s: received failed auth response '%s'", torctl->id, linebuf->str);
-            }
-            break;
-        }
+    _torflowtorctlclient_processReply(torctl, reply, line, length, code, isEndOfReply);
 
-        case CTL_BOOTSTRAP: {
-            /* we will be getting all client status events, not all of them have bootstrap status */
-            gint progress = _torflowtorctlclient_parseBootstrapProgress(linebuf->str);
-            if(progress >= 0) {
-                debug("%s: successfully received bootstrap phase response '%s'", torctl->id, linebuf->str);
-                if(progress >= 100) {
-                    message("%s: torflow client is now ready (Bootstrapped 100)", torctl->id);
-
-                    torctl->isStatusEventSet = FALSE;
-                    torctl->state = CTL_PROCESSING;
-
-                    if(torctl->onBootstrapped) {
-                        torctl->onBootstrapped(torctl->onBootstrappedArg);
-                    }
-                } else if(!(torctl->isStatusEventSet)) {
-                    /* not yet at 100%, register the async status event to wait for it */
-                    g_queue_push_tail(torctl->commands, g_string_new("SETEVENTS EXTENDED STATUS_CLIENT\r\n"));
-                    torctl->isStatusEventSet = TRUE;
-                }
-            }
-            break;
-        }
+    if(isEndOfReply) {
+        g_free(reply);
+    }
+}
 
-        case CTL_PROCESSING: {
-            gint code = _torflowtorctlclient_parseCode(linebuf->str);
+static void _torflowtorctlclient_processReceivedLine(TorFlowTorCtlClient* torctl, gchar* line, gsize length) {
+    if(length > 0 && line[length-1] == '\r') {
+        length--;
+    }
 
-            if(code == 650) {/* asynchronous responses */
-                _torflowtorctlclient_processLineASync(torctl, linebuf);
-            } else {/* synchronous responses */
-                _torflowtorctlclient_processLineSync(torctl, linebuf);
-            }
-            break;
-        }
+    /* terminate the line where its CR or LF was */
+    line[length] = '\0';
 
-        case CTL_NONE:
-        default:
-            /* this should never happen */
-            g_assert(FALSE);
-            break;
+    if(torctl->isReceivingDescriptors) {
+        /* the consensus is by far our biggest response, parse it in place */
+        _torflowtorctlclient_processDescriptorData(torctl, line, length);
+    } else if(length > 0) {
+        /* we have a full line in our buffer */
+        info_limited("%s: received '%s'", torctl->id, line);
+
+        _torflowtorctlclient_processLine(torctl, line, length);
     }
 }
 
@@ -410,52 +690,44 @@ static void _torflowtorctlclient_receiveLines(TorFlowTorCtlClient* torctl, TorFl
     if(eventType & TORFLOW_EV_READ) {
         debug("%s: descriptor %i is readable", torctl->id, torctl->descriptor);
 
-        gchar recvbuf[10240];
-        memset(recvbuf, 0, 10240);
-        gssize bytes = 0;
+        while(TRUE) {
+            /* a line longer than the whole buffer, make room for the rest of it */
+            if(torctl->receiveLength == torctl->receiveBufferSize) {
+                torctl->receiveBufferSize *= 2;
+                torctl->receiveBuffer = g_realloc(torctl->receiveBuffer, torctl->receiveBufferSize);
+            }
 
-        while((bytes = recv(torctl->descriptor, recvbuf, 10000, 0)) > 0) {
-            recvbuf[bytes] = '\0';
-            debug("%s: recvbuf:%s", torctl->id, recvbuf);
+            gchar* received = &torctl->receiveBuffer[torctl->receiveLength];
+            gssize bytes = recv(torctl->descriptor, received, torctl->receiveBufferSize - torctl->receiveLength, 0);
 
-            gboolean isLastLineIncomplete = FALSE;
-            if(bytes < 2 || recvbuf[bytes-2] != '\r' || recvbuf[bytes-1] != '\n') {
-                isLastLineIncomplete = TRUE;
+            if(bytes <= 0) {
+                break;
             }
 
-            //Check for corner case where first element is \r\n
-            gboolean isStartCRLF = FALSE;
-            if(recvbuf[0] == '\r' && recvbuf[1] == '\n') {
-                isStartCRLF = TRUE;
-            }
+            debug("%s: recvbuf:%.*s", torctl->id, (gint)bytes, received);
 
-            gchar** lines = g_strsplit(recvbuf, "\r\n", 0);
-            gchar* line = NULL;
-            for(gint i = 0; (line = lines[i]) != NULL; i++) {
-                if(!torctl->receiveLineBuffer) {
-                    torctl->receiveLineBuffer = g_string_new(line);
-                } else if (isStartCRLF && i == 0 &&
-                        !g_ascii_strcasecmp(line, "")) {
-                    /* do nothing; we want to process the line in buffer already */
-                } else {
-                    g_string_append_printf(torctl->receiveLineBuffer, "%s", line);
-                }
+            /* only the new bytes can end the partial line we already have */
+            gchar* line = torctl->receiveBuffer;
+            gchar* cursor = received;
+            gchar* end = &received[bytes];
 
-                if(!(isStartCRLF && i == 0) && (!g_ascii_strcasecmp(line, "") ||
-                        (isLastLineIncomplete && lines[i+1] == NULL))) {
-                    /* this is '', or the last line, and its not all here yet */
-                    continue;
-                } else {
-                    /* we have a full line in our buffer */
-                    info("%s: received '%s'", torctl->id, torctl->receiveLineBuffer->str);
+            while(cursor < end) {
+                gchar* newline = memchr(cursor, '\n', (gsize)(end - cursor));
 
-                    _torflowtorctlclient_processLine(torctl, torctl->receiveLineBuffer);
-
-                    g_string_free(torctl->receiveLineBuffer, TRUE);
-                    torctl->receiveLineBuffer = NULL;
+                if(!newline) {
+                    /* the rest of this line is not here yet */
+                    break;
                 }
+
+                _torflowtorctlclient_processReceivedLine(torctl, line, (gsize)(newline - line));
+                line = cursor = newline + 1;
+            }
+
+            /* keep what we have of the next line */
+            torctl->receiveLength = (gsize)(end - line);
+            if(torctl->receiveLength > 0 && line != torctl->receiveBuffer) {
+                memmove(torctl->receiveBuffer, line, torctl->receiveLength);
             }
-            g_strfreev(lines);
         }
     }
 }
@@ -463,57 +735,104 @@ static void _torflowtorctlclient_receiveLines(TorFlowTorCtlClient* torctl, TorFl
 static void _torflowtorctlclient_flushCommands(TorFlowTorCtlClient* torctl, TorFlowEventFlag eventType) {
     g_assert(torctl);
 
-    torfloweventmanager_deregister(torctl->manager, torctl->descriptor);
-
-    /* send all queued commands */
+    /* commands are only sent once the descriptor is writable, so everything that gets
+     * queued until then goes out together */
     if(eventType & TORFLOW_EV_WRITE) {
         debug("%s: descriptor %i is writable", torctl->id, torctl->descriptor);
+    }
 
-        while(!g_queue_is_empty(torctl->commands)) {
-            GString* command = g_queue_pop_head(torctl->commands);
+    while((eventType & TORFLOW_EV_WRITE) && !g_queue_is_empty(torctl->commands)) {
+        struct iovec vectors[TORFLOW_TORCTL_MAX_COMMANDS_PER_WRITE];
+        gint numVectors = 0;
 
-            gssize bytes = send(torctl->descriptor, command->str, command->len, 0);
+        for(GList* link = g_queue_peek_head_link(torctl->commands);
+                link && numVectors < TORFLOW_TORCTL_MAX_COMMANDS_PER_WRITE; link = link->next) {
+            GString* command = link->data;
+            vectors[numVectors].iov_base = command->str;
+            vectors[numVectors].iov_len = command->len;
+            numVectors++;
+        }
 
-            if(bytes > 0) {
-                /* at least some parts of the command were sent successfully */
-                GString* sent = g_string_new(command->str);
-                sent = g_string_truncate(sent, bytes);
-                info("%s: sent '%s'", torctl->id, g_strchomp(sent->str));
-                g_string_free(sent, TRUE);
-            }
+        gssize bytes = writev(torctl->descriptor, vectors, numVectors);
 
-            if(bytes == command->len) {
-                g_string_free(command, TRUE);
-            } else {
-                /* partial or no send */
-                command = g_string_erase(command, (gssize)0, (gssize)bytes);
-                g_queue_push_head(torctl->commands, command);
+        if(bytes < 0 && errno == EINTR) {
+            continue;
+        } else if(bytes <= 0) {
+            /* wait until we are writable again */
+            break;
+        }
+
+        /* drop the commands that were sent completely */
+        gsize remaining = (gsize)bytes;
+        while(remaining > 0) {
+            GString* command = g_queue_peek_head(torctl->commands);
+
+            if(remaining < command->len) {
+                /* partial send, keep the rest for the next write */
+                info("%s: sent '%.*s'", torctl->id, (gint)remaining, command->str);
+                g_string_erase(command, (gssize)0, (gssize)remaining);
                 break;
             }
+
+            remaining -= command->len;
+            g_queue_pop_head(torctl->commands);
+
+            info("%s: sent '%s'", torctl->id, g_strchomp(command->str));
+            g_string_free(command, TRUE);
         }
-    }
 
-    gboolean success = TRUE;
+        if(numVectors == TORFLOW_TORCTL_MAX_COMMANDS_PER_WRITE || g_queue_is_empty(torctl->commands)) {
+            /* either we got everything out, or there were more commands than we gathered */
+            continue;
+        }
 
-    if(g_queue_is_empty(torctl->commands)) {
-        /* we wrote all of the commands, go back into reading mode */
-        success = torfloweventmanager_register(torctl->manager, torctl->descriptor, TORFLOW_EV_READ,
-                (TorFlowOnEventFunc)_torflowtorctlclient_receiveLines, torctl);
-    } else {
-        /* we still want to write more */
-        success = torfloweventmanager_register(torctl->manager, torctl->descriptor, TORFLOW_EV_WRITE,
-                (TorFlowOnEventFunc)_torflowtorctlclient_flushCommands, torctl);
+        /* the socket took less than we gave it */
+        break;
+    }
+
+    /* we always read, and we also want to write if we still have commands.
+     * this only costs an epoll_ctl call when the interest actually changes. */
+    TorFlowEventFlag interest = TORFLOW_EV_READ;
+    if(!g_queue_is_empty(torctl->commands)) {
+        interest |= TORFLOW_EV_WRITE;
     }
 
+    gboolean success = torfloweventmanager_setInterest(torctl->manager, torctl->descriptor, interest);
+
     if(!success) {
         warning("%s: Unable to register descriptor %i with event manager", torctl->id, torctl->descriptor);
     }
+}
+
+static void _torflowtorctlclient_onEvent(TorFlowTorCtlClient* torctl, TorFlowEventFlag eventType) {
+    g_assert(torctl);
 
+    if(eventType & TORFLOW_EV_WRITE) {
+        _torflowtorctlclient_flushCommands(torctl, eventType);
+    }
+
+    /* the line handlers may call back into our owner, which might free us,
+     * so we must not touch the torctl after receiving */
+    if(eventType & TORFLOW_EV_READ) {
+        _torflowtorctlclient_receiveLines(torctl, eventType);
+    }
 }
 
 static void _torflowtorctlclient_onConnected(TorFlowTorCtlClient* torctl, TorFlowEventFlag type) {
     g_assert(torctl);
-    torfloweventmanager_deregister(torctl->manager, torctl->descriptor);
+
+    /* keep the same watch for the rest of the connection, we switch to the
+     * regular handler and only wait for replies until commands get queued */
+    gboolean success = torfloweventmanager_register(torctl->manager, torctl->descriptor, TORFLOW_EV_READ,
+            (TorFlowOnEventFunc)_torflowtorctlclient_onEvent, torctl);
+
+    if(!success) {
+        warning("%s: Unable to register descriptor %i with event manager", torctl->id, torctl->descriptor);
+    }
+
+    /* replies and async events drive the probes, so they go before bulk transfers */
+    torfloweventmanager_setPriority(torctl->manager, torctl->descriptor, TORFLOW_PRIORITY_HIGH);
+
     if(torctl->onConnected) {
         torctl->onConnected(torctl->onConnectedArg);
     }
@@ -525,6 +844,11 @@ TorFlowTorCtlClient* torflowtorctlclient_new(TorFlowEventManager* manager, in_po
 
     torctl->manager = manager;
     torctl->commands = g_queue_new();
+    torctl->replies = g_queue_new();
+    torctl->circuits = g_hash_table_new(g_direct_hash, g_direct_equal);
+    torctl->streamSourcePorts = g_hash_table_new(g_direct_hash, g_direct_equal);
+    torctl->receiveBufferSize = TORFLOW_TORCTL_RECEIVE_BUFFER_SIZE;
+    torctl->receiveBuffer = g_malloc(torctl->receiveBufferSize);
 
     /* set our ID string for logging purposes */
     GString* idbuf = g_string_new(NULL);
@@ -572,6 +896,7 @@ TorFlowTorCtlClient* torflowtorctlclient_new(TorFlowEventManager* manager, in_po
     return torctl;
 }
 
+
 void torflowtorctlclient_free(TorFlowTorCtlClient* torctl) {
     g_assert(torctl);
 
@@ -582,8 +907,8 @@ void torflowtorctlclient_free(TorFlowTorCtlClient* torctl) {
         close(torctl->descriptor);
     }
 
-    if(torctl->receiveLineBuffer) {
-        g_string_free(torctl->receiveLineBuffer, TRUE);
+    if(torctl->receiveBuffer) {
+        g_free(torctl->receiveBuffer);
     }
 
     if(torctl->commands) {
@@ -593,8 +918,24 @@ void torflowtorctlclient_free(TorFlowTorCtlClient* torctl) {
         g_queue_free(torctl->commands);
     }
 
-    if(torctl->cachedCircPath) {
-        g_free(torctl->cachedCircPath);
+    if(torctl->replies) {
+        while(!g_queue_is_empty(torctl->replies)) {
+            TorFlowControlReply* reply = g_queue_pop_head(torctl->replies);
+            /* circuits that are still waiting for their id are ours once released */
+            if(reply->circuit && reply->circuit->isReleased) {
+                _torflowtorctlclient_freeCircuit(reply->circuit);
+            }
+            g_free(reply);
+        }
+        g_queue_free(torctl->replies);
+    }
+
+    if(torctl->circuits) {
+        g_hash_table_destroy(torctl->circuits);
+    }
+
+    if(torctl->streamSourcePorts) {
+        g_hash_table_destroy(torctl->streamSourcePorts);
     }
 
     if(torctl->id) {
@@ -604,11 +945,6 @@ void torflowtorctlclient_free(TorFlowTorCtlClient* torctl) {
     g_free(torctl);
 }
 
-const gchar* torflowtorctlclient_getCurrentPath(TorFlowTorCtlClient* torctl) {
-    g_assert(torctl);
-    return torctl->cachedCircPath;
-}
-
 void torflowtorctlclient_commandAuthenticate(TorFlowTorCtlClient* torctl,
         OnAuthenticatedFunc onAuthenticated, gpointer onAuthenticatedArg) {
     g_assert(torctl);
@@ -617,7 +953,8 @@ void torflowtorctlclient_commandAuthenticate(TorFlowTorCtlClient* torctl,
     torctl->onAuthenticatedArg = onAuthenticatedArg;
 
     /* our control socket is connected, authenticate to control port */
-    g_queue_push_tail(torctl->commands, g_string_new("AUTHENTICATE \"password\"\r\n"));
+    _torflowtorctlclient_queueCommand(torctl, g_string_new("AUTHENTICATE \"password\"\r\n"),
+            CTL_REPLY_AUTHENTICATE, NULL);
     torctl->state = CTL_AUTHENTICATE;
 
     /* go into writing mode, write the command, and then go into reading mode */
@@ -631,7 +968,8 @@ void torflowtorctlclient_commandGetBootstrapStatus(TorFlowTorCtlClient* torctl,
     torctl->onBootstrapped = onBootstrapped;
     torctl->onBootstrappedArg = onBootstrappedArg;
 
-    g_queue_push_tail(torctl->commands, g_string_new("GETINFO status/bootstrap-phase\r\n"));
+    _torflowtorctlclient_queueCommand(torctl, g_string_new("GETINFO status/bootstrap-phase\r\n"),
+            CTL_REPLY_BOOTSTRAP, NULL);
     torctl->state = CTL_BOOTSTRAP;
 
     /* go into writing mode, write the command, and then go into reading mode */
@@ -640,104 +978,139 @@ void torflowtorctlclient_commandGetBootstrapStatus(TorFlowTorCtlClient* torctl,
 
 void torflowtorctlclient_commandSetupTorConfig(TorFlowTorCtlClient* torctl) {
     g_assert(torctl);
-    g_queue_push_tail(torctl->commands, g_string_new("SETCONF __LeaveStreamsUnattached=1 __DisablePredictedCircuits=1 MaxCircuitDirtiness=36000 CircuitStreamTimeout=3600\r\n"));
-    g_queue_push_tail(torctl->commands, g_string_new("SIGNAL NEWNYM\r\n"));
+    _torflowtorctlclient_queueCommand(torctl, g_string_new("SETCONF __LeaveStreamsUnattached=1 __DisablePredictedCircuits=1 MaxCircuitDirtiness=36000 CircuitStreamTimeout=3600\r\n"),
+            CTL_REPLY_NONE, NULL);
+    _torflowtorctlclient_queueCommand(torctl, g_string_new("SIGNAL NEWNYM\r\n"), CTL_REPLY_NONE, NULL);
     _torflowtorctlclient_flushCommands(torctl, TORFLOW_EV_NONE);
 }
 
 void torflowtorctlclient_commandEnableEvents(TorFlowTorCtlClient* torctl) {
     g_assert(torctl);
-    g_queue_push_tail(torctl->commands, g_string_new("SETEVENTS CIRC STREAM\r\n"));
+    /* only controllers that store descriptors need to follow consensus changes */
+    if(torctl->onDescriptorLine) {
+        _torflowtorctlclient_queueCommand(torctl, g_string_new("SETEVENTS CIRC STREAM NS NEWCONSENSUS\r\n"),
+                CTL_REPLY_NONE, NULL);
+    } else {
+        _torflowtorctlclient_queueCommand(torctl, g_string_new("SETEVENTS CIRC STREAM\r\n"), CTL_REPLY_NONE, NULL);
+    }
     _torflowtorctlclient_flushCommands(torctl, TORFLOW_EV_NONE);
 }
 
 void torflowtorctlclient_commandDisableEvents(TorFlowTorCtlClient* torctl) {
     g_assert(torctl);
-    g_queue_push_tail(torctl->commands, g_string_new("SETEVENTS\r\n"));
+    _torflowtorctlclient_queueCommand(torctl, g_string_new("SETEVENTS\r\n"), CTL_REPLY_NONE, NULL);
     _torflowtorctlclient_flushCommands(torctl, TORFLOW_EV_NONE);
 }
 
-void torflowtorctlclient_commandGetDescriptorInfo(TorFlowTorCtlClient* torctl,
-        OnDescriptorsReceivedFunc onDescriptorsReceived, gpointer onDescriptorsReceivedArg) {
+void torflowtorctlclient_commandGetDescriptorInfo(TorFlowTorCtlClient* torctl) {
     g_assert(torctl);
 
-    torctl->onDescriptorsReceived = onDescriptorsReceived;
-    torctl->onDescriptorsReceivedArg = onDescriptorsReceivedArg;
-
     GString* command = g_string_new(NULL);
     //g_string_printf(command, "GETINFO dir/status-vote/current/consensus\r\n");
     g_string_printf(command, "GETINFO ns/all\r\n");
-    g_queue_push_tail(torctl->commands, command);
-    torctl->waitingGetDescriptorsResponse = TRUE;
+    _torflowtorctlclient_queueCommand(torctl, command, CTL_REPLY_DESCRIPTORS, NULL);
 
     _torflowtorctlclient_flushCommands(torctl, TORFLOW_EV_NONE);
 
     debug("%s: queued a GETINFO command", torctl->id);
 }
 
-void torflowtorctlclient_commandBuildNewCircuit(TorFlowTorCtlClient* torctl, gchar* path,
-        OnCircuitBuiltFunc onCircuitBuilt, gpointer onCircuitBuiltArg) {
+TorFlowTorCtlCircuit* torflowtorctlclient_commandBuildNewCircuit(TorFlowTorCtlClient* torctl, const gchar* path,
+        OnCircuitBuiltFunc onCircuitBuilt, OnCircuitClosedFunc onCircuitClosed, gpointer onCircuitArg) {
     g_assert(torctl);
     g_assert(path);
 
-    torctl->onCircuitBuilt = onCircuitBuilt;
-    torctl->onCircuitBuiltArg = onCircuitBuiltArg;
+    TorFlowTorCtlCircuit* circuit = g_new0(TorFlowTorCtlCircuit, 1);
+    circuit->path = g_strdup(path);
+    circuit->isPending = TRUE;
+    circuit->onCircuitBuilt = onCircuitBuilt;
+    circuit->onCircuitClosed = onCircuitClosed;
+    circuit->onCircuitArg = onCircuitArg;
 
-    /* build a new circuit with the given path */
+    /* build a new circuit with the given path. the reply tells us its id. */
     GString* command = g_string_new(NULL);
     g_string_printf(command, "EXTENDCIRCUIT 0 %s\r\n", path);
-    g_queue_push_tail(torctl->commands, command);
-
-    /* make sure we will get the correct circuit */
-    torctl->waitingMeasurementCircuit = TRUE;
-
-    if(torctl->cachedCircPath) {
-        g_free(torctl->cachedCircPath);
-    }
-    torctl->cachedCircPath = g_strdup(path);
-    torctl->cachedCircId = 0;
+    _torflowtorctlclient_queueCommand(torctl, command, CTL_REPLY_EXTENDCIRCUIT, circuit);
 
     /* send the commands */
     _torflowtorctlclient_flushCommands(torctl, TORFLOW_EV_NONE);
 
     debug("%s: queued a EXTENDCIRCUIT command for %s", torctl->id, path);
+
+    return circuit;
 }
 
-void torflowtorctlclient_setNewStreamCallback(TorFlowTorCtlClient* torctl, in_port_t clientSocksPort,
+void torflowtorctlclient_setDescriptorCallbacks(TorFlowTorCtlClient* torctl,
+        OnDescriptorsBeginFunc onDescriptorsBegin, OnDescriptorLineFunc onDescriptorLine,
+        OnDescriptorsReceivedFunc onDescriptorsReceived, OnDescriptorsFailedFunc onDescriptorsFailed,
+        gpointer onDescriptorsReceivedArg) {
+    g_assert(torctl);
+
+    torctl->onDescriptorsBegin = onDescriptorsBegin;
+    torctl->onDescriptorLine = onDescriptorLine;
+    torctl->onDescriptorsReceived = onDescriptorsReceived;
+    torctl->onDescriptorsFailed = onDescriptorsFailed;
+    torctl->onDescriptorsReceivedArg = onDescriptorsReceivedArg;
+}
+
+void torflowtorctlclient_setNewStreamCallback(TorFlowTorCtlClient* torctl,
         OnStreamNewFunc onStreamNew, gpointer onStreamNewArg) {
     g_assert(torctl);
 
     torctl->onStreamNew = onStreamNew;
     torctl->onStreamNewArg = onStreamNewArg;
-    torctl->streamFilterPort = clientSocksPort;
+}
+
+void torflowtorctlclient_setCircuitStreamCallback(TorFlowTorCtlClient* torctl, TorFlowTorCtlCircuit* circuit,
+        in_port_t sourcePort, OnStreamNewFunc onStreamNew, gpointer onStreamNewArg) {
+    g_assert(torctl);
+    g_assert(circuit);
+    g_assert(sourcePort > 0);
+
+    _torflowtorctlclient_clearStreamSourcePort(torctl, circuit);
+
+    circuit->streamSourcePort = sourcePort;
+    circuit->onStreamNew = onStreamNew;
+    circuit->onStreamNewArg = onStreamNewArg;
+
+    g_hash_table_replace(torctl->streamSourcePorts, GUINT_TO_POINTER((guint)sourcePort), circuit);
 }
 
 void torflowtorctlclient_commandAttachStreamToCircuit(TorFlowTorCtlClient* torctl, gint streamID, gint circuitID,
         OnStreamSucceededFunc onStreamSucceeded, gpointer onStreamSucceededArg) {
     g_assert(torctl);
 
-    torctl->onStreamSucceeded = onStreamSucceeded;
-    torctl->onStreamSucceededArg = onStreamSucceededArg;
+    /* events about the stream come with the id of the circuit we attach it to */
+    TorFlowTorCtlCircuit* circuit = circuitID > 0 ?
+            g_hash_table_lookup(torctl->circuits, GINT_TO_POINTER(circuitID)) : NULL;
+    if(circuit) {
+        circuit->onStreamSucceeded = onStreamSucceeded;
+        circuit->onStreamSucceededArg = onStreamSucceededArg;
+    }
 
     GString* command = g_string_new(NULL);
     g_string_printf(command, "ATTACHSTREAM %i %i\r\n", streamID, circuitID);
-    g_queue_push_tail(torctl->commands, command);
+    _torflowtorctlclient_queueCommand(torctl, command, CTL_REPLY_ATTACHSTREAM, NULL);
 
     _torflowtorctlclient_flushCommands(torctl, TORFLOW_EV_NONE);
 
-    torctl->waitingAttachStreamResponse = TRUE;
-
     debug("%s: queued a ATTACHSTREAM command for stream %i to circuit %i", torctl->id, streamID, circuitID);
 }
 
-void torflowtorctlclient_commandCloseCircuit(TorFlowTorCtlClient* torctl, gint crcuitID) {
+void torflowtorctlclient_commandCloseCircuit(TorFlowTorCtlClient* torctl, TorFlowTorCtlCircuit* circuit) {
     g_assert(torctl);
+    g_assert(circuit);
+
+    if(circuit->isPending) {
+        /* we can't close it before we know its id, the EXTENDCIRCUIT reply will */
+        _torflowtorctlclient_clearStreamSourcePort(torctl, circuit);
+        circuit->isReleased = TRUE;
+        circuit->onCircuitBuilt = NULL;
+        circuit->onCircuitClosed = NULL;
+        circuit->onStreamNew = NULL;
+        circuit->onStreamSucceeded = NULL;
+        return;
+    }
 
-    GString* command = g_string_new(NULL);
-    g_string_printf(command, "CLOSECIRCUIT %i\r\n", crcuitID);
-    g_queue_push_tail(torctl->commands, command);
-
-    _torflowtorctlclient_flushCommands(torctl, TORFLOW_EV_NONE);
-
-    debug("%s: queued a CLOSECIRCUIT command for %i", torctl->id, crcuitID);
+    _torflowtorctlclient_closeCircuit(torctl, circuit);
 }
@@ -12,12 +12,22 @@
 #include "torflow-event-manager.h"
 
 typedef struct _TorFlowTorCtlClient TorFlowTorCtlClient;
+/* a circuit we asked for. it belongs to whoever built it until they close it. */
+typedef struct _TorFlowTorCtlCircuit TorFlowTorCtlCircuit;
 
 typedef void (*OnConnectedFunc)(gpointer userData);
 typedef void (*OnAuthenticatedFunc)(gpointer userData);
 typedef void (*OnBootstrappedFunc)(gpointer userData);
-typedef void (*OnDescriptorsReceivedFunc)(gpointer userData, GQueue* descriptorLines);
+/* descriptors arrive either as a full consensus, or as the entries that changed since the last one.
+ * lines point into the receive buffer, are not NUL terminated, and are only valid during the call. */
+typedef void (*OnDescriptorsBeginFunc)(gpointer userData, gboolean isFullConsensus);
+typedef void (*OnDescriptorLineFunc)(gpointer userData, const gchar* line, gsize length);
+typedef void (*OnDescriptorsReceivedFunc)(gpointer userData, gboolean isFullConsensus);
+/* the ns/all request was refused, nothing was stored */
+typedef void (*OnDescriptorsFailedFunc)(gpointer userData);
 typedef void (*OnCircuitBuiltFunc)(gpointer userData, gint circuitID);
+/* tor refused, failed, or closed the circuit. the circuit ID is 0 if tor never gave it one. */
+typedef void (*OnCircuitClosedFunc)(gpointer userData, gint circuitID);
 typedef void (*OnStreamNewFunc)(gpointer userData, gint streamID,
         gchar* sourceAddress, in_port_t sourcePort, gchar* targetAddress, in_port_t targetPort);
 typedef void (*OnStreamSucceededFunc)(gpointer userData, gint streamID, gint circuitID,
@@ -32,24 +42,31 @@ void torflowtorctlclient_commandAuthenticate(TorFlowTorCtlClient* torctl,
         OnAuthenticatedFunc onAuthenticated, gpointer onAuthenticatedArg);
 void torflowtorctlclient_commandGetBootstrapStatus(TorFlowTorCtlClient* torctl,
         OnBootstrappedFunc onBootstrapped, gpointer onBootstrappedArg);
-void torflowtorctlclient_commandGetDescriptorInfo(TorFlowTorCtlClient* torctl,
-        OnDescriptorsReceivedFunc onDescriptorsReceived, gpointer onDescriptorsReceivedArg);
-void torflowtorctlclient_commandBuildNewCircuit(TorFlowTorCtlClient* torctl, gchar* path,
-        OnCircuitBuiltFunc onCircuitBuilt, gpointer onCircuitBuiltArg);
+/* the owner still closes the circuit after the closed callback, to free it */
+TorFlowTorCtlCircuit* torflowtorctlclient_commandBuildNewCircuit(TorFlowTorCtlClient* torctl, const gchar* path,
+        OnCircuitBuiltFunc onCircuitBuilt, OnCircuitClosedFunc onCircuitClosed, gpointer onCircuitArg);
+/* the stream callback goes to the circuit, so only events about that circuit trigger it */
 void torflowtorctlclient_commandAttachStreamToCircuit(TorFlowTorCtlClient* torctl, gint streamID, gint circuitID,
         OnStreamSucceededFunc onStreamSucceeded, gpointer onStreamSucceededArg);
 
-void torflowtorctlclient_setNewStreamCallback(TorFlowTorCtlClient* torctl, in_port_t clientSocksPort,
+/* the descriptor callbacks get the ns/all response, and the consensus events once events are enabled */
+void torflowtorctlclient_setDescriptorCallbacks(TorFlowTorCtlClient* torctl,
+        OnDescriptorsBeginFunc onDescriptorsBegin, OnDescriptorLineFunc onDescriptorLine,
+        OnDescriptorsReceivedFunc onDescriptorsReceived, OnDescriptorsFailedFunc onDescriptorsFailed,
+        gpointer onDescriptorsReceivedArg);
+/* new streams go to the circuit registered for their source port, or else to the new stream callback */
+void torflowtorctlclient_setNewStreamCallback(TorFlowTorCtlClient* torctl,
         OnStreamNewFunc onStreamNew, gpointer onStreamNewArg);
+void torflowtorctlclient_setCircuitStreamCallback(TorFlowTorCtlClient* torctl, TorFlowTorCtlCircuit* circuit,
+        in_port_t sourcePort, OnStreamNewFunc onStreamNew, gpointer onStreamNewArg);
 
 /* controller commands without callbacks */
 void torflowtorctlclient_commandSetupTorConfig(TorFlowTorCtlClient* torctl);
+void torflowtorctlclient_commandGetDescriptorInfo(TorFlowTorCtlClient* torctl);
 void torflowtorctlclient_commandEnableEvents(TorFlowTorCtlClient* torctl);
 void torflowtorctlclient_commandDisableEvents(TorFlowTorCtlClient* torctl);
 
-void torflowtorctlclient_commandCloseCircuit(TorFlowTorCtlClient* torctl, gint crcuitID);
-
-/* other funcs */
-const gchar* torflowtorctlclient_getCurrentPath(TorFlowTorCtlClient* tfb);
+/* frees the circuit, it must not be used after this */
+void torflowtorctlclient_commandCloseCircuit(TorFlowTorCtlClient* torctl, TorFlowTorCtlCircuit* circuit);
 
 #endif /* SRC_TORFLOW_TORFLOW_TOR_CONTROL_CLIENT_H_ */
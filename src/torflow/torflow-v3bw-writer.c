@@ -0,0 +1,368 @@
+/*
+ * The Shadow Simulator
+ * See LICENSE for licensing information
+ */
+
+#define TORFLOW_LOG_CATEGORY TORFLOW_LOG_DATABASE
+#include "torflow.h"
+
+/* node_id=$ + 40 hex digits + \tbw= + 10 digits + \tnick= + 19 characters + \n */
+#define TORFLOW_V3BW_WRITER_MAX_LINE_SIZE 96
+
+typedef struct _TorFlowV3BWFile TorFlowV3BWFile;
+struct _TorFlowV3BWFile {
+    TorFlowV3BWLine* lines;
+    guint numLines;
+    gint64 timestamp;
+};
+
+struct _TorFlowV3BWWriter {
+    gchar* path;
+    guint numVersionsKept;
+
+    /* only the writer thread touches these. versions between oldestVersion and
+     * nextVersion may be on disk, including those of earlier runs. */
+    guint oldestVersion;
+    guint nextVersion;
+    GString* buffer;
+
+    /* the newest file that was submitted but not written yet. the lock covers it and isStopping. */
+    GMutex lock;
+    GCond hasWork;
+    TorFlowV3BWFile* pending;
+    gboolean isStopping;
+
+    GThread* thread;
+};
+
+static void _torflowv3bwwriter_freeFile(TorFlowV3BWFile* file) {
+    g_assert(file);
+
+    if(file->lines) {
+        g_free(file->lines);
+    }
+    g_free(file);
+}
+
+static void _torflowv3bwwriter_format(TorFlowV3BWWriter* writer, TorFlowV3BWFile* file) {
+    g_assert(writer);
+    g_assert(file);
+
+    GString* buffer = writer->buffer;
+    g_string_truncate(buffer, 0);
+    g_string_set_size(buffer, 32 + (gsize)file->numLines * TORFLOW_V3BW_WRITER_MAX_LINE_SIZE);
+
+    /*
+     * file format is, where first line value is unix timestamp:
+     * ```
+     * {}\n
+     * node_id=${}\tbw={}\tnick={}\n
+     * [...]
+     * node_id=${}\tbw={}\tnick={}\n
+     * ```
+     * notice there is a newline on the last line.
+     *
+     * see https://gitweb.torproject.org/torflow.git/tree/NetworkScanners/BwAuthority/README.spec.txt#n332
+     */
+    gchar* position = buffer->str;
+    position += g_snprintf(position, 32, "%"G_GINT64_FORMAT"\n", file->timestamp);
+
+    for(guint i = 0; i < file->numLines; i++) {
+        TorFlowV3BWLine* line = &file->lines[i];
+
+        memcpy(position, "node_id=$", 9);
+        position = torflowrelaytable_encodeFingerprint(line->fingerprint, position + 9);
+
+        /* the nickname was copied from a buffer of the same size, so it is terminated */
+        position += g_snprintf(position, TORFLOW_V3BW_WRITER_MAX_LINE_SIZE - 49,
+                "\tbw=%u\tnick=%s\n", line->bandwidth, line->nickname);
+    }
+
+    g_string_truncate(buffer, (gsize)(position - buffer->str));
+}
+
+static void _torflowv3bwwriter_findVersions(TorFlowV3BWWriter* writer) {
+    g_assert(writer);
+
+    gchar* directory = g_path_get_dirname(writer->path);
+    gchar* baseName = g_path_get_basename(writer->path);
+    gchar* prefix = g_strconcat(baseName, ".", NULL);
+    gsize prefixLength = strlen(prefix);
+
+    GDir* dir = g_dir_open(directory, 0, NULL);
+    if(dir) {
+        gboolean isFound = FALSE;
+        guint lowest = 0, highest = 0;
+
+        /* only names that are the prefix followed by nothing but digits are versions */
+        const gchar* name = NULL;
+        while((name = g_dir_read_name(dir)) != NULL) {
+            if(!g_str_has_prefix(name, prefix)) {
+                continue;
+            }
+
+            const gchar* suffix = &name[prefixLength];
+            if(*suffix == '\0' || strspn(suffix, "0123456789") != strlen(suffix)) {
+                continue;
+            }
+
+            guint64 version = g_ascii_strtoull(suffix, NULL, 10);
+            if(version >= G_MAXUINT) {
+                continue;
+            }
+
+            lowest = (!isFound || version < lowest) ? (guint)version : lowest;
+            highest = (!isFound || version > highest) ? (guint)version : highest;
+            isFound = TRUE;
+        }
+        g_dir_close(dir);
+
+        /* continue after the newest version, the link may still point at it */
+        if(isFound) {
+            writer->oldestVersion = lowest;
+            writer->nextVersion = highest + 1;
+            info("found v3bw files %s.%u to %s.%u from an earlier run",
+                    writer->path, lowest, writer->path, highest);
+        }
+    }
+
+    g_free(prefix);
+    g_free(baseName);
+    g_free(directory);
+}
+
+static gboolean _torflowv3bwwriter_writeFile(const gchar* path, const gchar* data, gsize length) {
+    /* the file only appears under its own name once it is complete */
+    gchar* tempPath = g_strconcat(path, ".tmp", NULL);
+
+    gint descriptor = open(tempPath, O_WRONLY|O_CREAT|O_TRUNC|O_CLOEXEC, 0644);
+    if(descriptor < 0) {
+        warning("unable to open v3bw file %s: error %i: %s", tempPath, errno, g_strerror(errno));
+        g_free(tempPath);
+        return FALSE;
+    }
+
+    /* one write for the whole file, unless the kernel takes less */
+    gsize written = 0;
+    while(written < length) {
+        gssize result = write(descriptor, &data[written], length - written);
+        if(result < 0 && errno == EINTR) {
+            continue;
+        } else if(result < 0) {
+            warning("unable to write v3bw file %s: error %i: %s", tempPath, errno, g_strerror(errno));
+            close(descriptor);
+            g_unlink(tempPath);
+            g_free(tempPath);
+            return FALSE;
+        }
+        written += (gsize)result;
+    }
+
+    /* the link must never point at a file that is not fully on disk */
+    if(fsync(descriptor) < 0) {
+        warning("unable to sync v3bw file %s: error %i: %s", tempPath, errno, g_strerror(errno));
+        close(descriptor);
+        g_unlink(tempPath);
+        g_free(tempPath);
+        return FALSE;
+    }
+
+    close(descriptor);
+
+    gboolean isSuccess = TRUE;
+    if(rename(tempPath, path) < 0) {
+        warning("unable to move v3bw file %s to %s: error %i: %s", tempPath, path, errno, g_strerror(errno));
+        g_unlink(tempPath);
+        isSuccess = FALSE;
+    }
+
+    g_free(tempPath);
+    return isSuccess;
+}
+
+static void _torflowv3bwwriter_syncDirectory(const gchar* path) {
+    gchar* directory = g_path_get_dirname(path);
+
+    gint descriptor = open(directory, O_RDONLY|O_DIRECTORY|O_CLOEXEC);
+    if(descriptor >= 0) {
+        fsync(descriptor);
+        close(descriptor);
+    }
+
+    g_free(directory);
+}
+
+static gboolean _torflowv3bwwriter_publish(TorFlowV3BWWriter* writer, const gchar* versionPath) {
+    g_assert(writer);
+    g_assert(versionPath);
+
+    /* a regular file at the configured path is the one we started from. keep it, but under
+     * a name of its own, so the link below can replace it without the path ever missing. */
+    struct stat pathStat;
+    if(lstat(writer->path, &pathStat) == 0 && S_ISREG(pathStat.st_mode)) {
+        gchar* initPath = g_strconcat(writer->path, ".init", NULL);
+        g_unlink(initPath);
+        if(link(writer->path, initPath) < 0) {
+            warning("unable to keep initial v3bw file as %s: error %i: %s", initPath, errno, g_strerror(errno));
+        }
+        g_free(initPath);
+    }
+
+    /* the link should point in the same directory as the link itself */
+    gchar* linkRef = g_path_get_basename(versionPath);
+    gchar* tempPath = g_strconcat(writer->path, ".tmp", NULL);
+
+    g_unlink(tempPath);
+    gboolean isSuccess = FALSE;
+
+    if(symlink(linkRef, tempPath) < 0) {
+        warning("unable to create symlink at %s pointing to %s: error %i: %s",
+                tempPath, linkRef, errno, g_strerror(errno));
+    } else if(rename(tempPath, writer->path) < 0) {
+        warning("unable to move symlink %s to %s: error %i: %s",
+                tempPath, writer->path, errno, g_strerror(errno));
+        g_unlink(tempPath);
+    } else {
+        _torflowv3bwwriter_syncDirectory(writer->path);
+        message("new v3bw file '%s' now linked at '%s'", linkRef, writer->path);
+        isSuccess = TRUE;
+    }
+
+    g_free(tempPath);
+    g_free(linkRef);
+    return isSuccess;
+}
+
+static void _torflowv3bwwriter_prune(TorFlowV3BWWriter* writer, guint publishedVersion) {
+    g_assert(writer);
+
+    if(writer->numVersionsKept == 0 || publishedVersion < writer->numVersionsKept) {
+        return;
+    }
+
+    /* usually this drops one version per publication, but the first one also
+     * drops what earlier runs left beyond the number we keep */
+    guint firstKeptVersion = publishedVersion - writer->numVersionsKept + 1;
+    for(guint version = writer->oldestVersion; version < firstKeptVersion; version++) {
+        gchar* oldPath = g_strdup_printf("%s.%u", writer->path, version);
+        if(g_unlink(oldPath) < 0 && errno != ENOENT) {
+            warning("unable to remove old v3bw file %s: error %i: %s", oldPath, errno, g_strerror(errno));
+        }
+        g_free(oldPath);
+    }
+
+    writer->oldestVersion = MAX(writer->oldestVersion, firstKeptVersion);
+}
+
+static void _torflowv3bwwriter_write(TorFlowV3BWWriter* writer, TorFlowV3BWFile* file) {
+    g_assert(writer);
+    g_assert(file);
+
+    _torflowv3bwwriter_format(writer, file);
+
+    guint version = writer->nextVersion;
+    gchar* versionPath = g_strdup_printf("%s.%u", writer->path, version);
+
+    if(_torflowv3bwwriter_writeFile(versionPath, writer->buffer->str, writer->buffer->len)) {
+        writer->nextVersion++;
+
+        info("wrote %u relays in %zu bytes to %s", file->numLines, writer->buffer->len, versionPath);
+
+        if(_torflowv3bwwriter_publish(writer, versionPath)) {
+            _torflowv3bwwriter_prune(writer, version);
+        }
+    }
+
+    g_free(versionPath);
+}
+
+static gpointer _torflowv3bwwriter_run(TorFlowV3BWWriter* writer) {
+    g_assert(writer);
+
+    /* new versions must not overwrite the ones a previous run published */
+    _torflowv3bwwriter_findVersions(writer);
+
+    g_mutex_lock(&writer->lock);
+
+    while(TRUE) {
+        while(writer->pending == NULL && !writer->isStopping) {
+            g_cond_wait(&writer->hasWork, &writer->lock);
+        }
+
+        /* a stopping writer still writes what was submitted last */
+        TorFlowV3BWFile* file = writer->pending;
+        writer->pending = NULL;
+        if(file == NULL) {
+            break;
+        }
+
+        g_mutex_unlock(&writer->lock);
+
+        _torflowv3bwwriter_write(writer, file);
+        _torflowv3bwwriter_freeFile(file);
+
+        g_mutex_lock(&writer->lock);
+    }
+
+    g_mutex_unlock(&writer->lock);
+
+    return NULL;
+}
+
+TorFlowV3BWWriter* torflowv3bwwriter_new(const gchar* path, guint numVersionsKept) {
+    g_assert(path);
+
+    TorFlowV3BWWriter* writer = g_new0(TorFlowV3BWWriter, 1);
+
+    writer->path = g_strdup(path);
+    writer->numVersionsKept = numVersionsKept;
+    writer->buffer = g_string_new(NULL);
+
+    g_mutex_init(&writer->lock);
+    g_cond_init(&writer->hasWork);
+
+    writer->thread = g_thread_new("torflow-v3bw", (GThreadFunc)_torflowv3bwwriter_run, writer);
+
+    return writer;
+}
+
+void torflowv3bwwriter_free(TorFlowV3BWWriter* writer) {
+    g_assert(writer);
+
+    g_mutex_lock(&writer->lock);
+    writer->isStopping = TRUE;
+    g_cond_signal(&writer->hasWork);
+    g_mutex_unlock(&writer->lock);
+
+    g_thread_join(writer->thread);
+
+    g_cond_clear(&writer->hasWork);
+    g_mutex_clear(&writer->lock);
+
+    g_string_free(writer->buffer, TRUE);
+    g_free(writer->path);
+    g_free(writer);
+}
+
+void torflowv3bwwriter_submit(TorFlowV3BWWriter* writer, TorFlowV3BWLine* lines, guint numLines, gint64 timestamp) {
+    g_assert(writer);
+
+    TorFlowV3BWFile* file = g_new0(TorFlowV3BWFile, 1);
+    file->lines = lines;
+    file->numLines = numLines;
+    file->timestamp = timestamp;
+
+    g_mutex_lock(&writer->lock);
+
+    /* the older file would be replaced right after it was published anyway */
+    TorFlowV3BWFile* replaced = writer->pending;
+    writer->pending = file;
+    g_cond_signal(&writer->hasWork);
+
+    g_mutex_unlock(&writer->lock);
+
+    if(replaced) {
+        debug("dropping a v3bw file that a newer one replaced before it was written");
+        _torflowv3bwwriter_freeFile(replaced);
+    }
+}
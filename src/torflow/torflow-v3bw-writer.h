@@ -0,0 +1,34 @@
+/*
+ * The Shadow Simulator
+ * See LICENSE for licensing information
+ */
+
+
+#ifndef SRC_TORFLOW_TORFLOW_V3BW_WRITER_H_
+#define SRC_TORFLOW_TORFLOW_V3BW_WRITER_H_
+
+#include <glib.h>
+
+/* writes v3bw files on a thread of its own, so the event loop only copies the bandwidths
+ * out of the relay table. each file is written as path.N and published by renaming a
+ * symlink over path, so readers of path always see a complete file. */
+typedef struct _TorFlowV3BWWriter TorFlowV3BWWriter;
+
+typedef struct _TorFlowV3BWLine TorFlowV3BWLine;
+struct _TorFlowV3BWLine {
+    guint8 fingerprint[TORFLOW_RELAY_FINGERPRINT_SIZE];
+    gchar nickname[TORFLOW_RELAY_NICKNAME_SIZE];
+    guint bandwidth;
+};
+
+/* keeps the newest numVersionsKept path.N files, or all of them if it is 0.
+ * N continues after the highest version already on disk. */
+TorFlowV3BWWriter* torflowv3bwwriter_new(const gchar* path, guint numVersionsKept);
+/* waits until the newest submitted file is published */
+void torflowv3bwwriter_free(TorFlowV3BWWriter* writer);
+
+/* takes ownership of the g_new'd lines. if the writer is still busy with an earlier file,
+ * only the newest of the files submitted in the meantime is written. */
+void torflowv3bwwriter_submit(TorFlowV3BWWriter* writer, TorFlowV3BWLine* lines, guint numLines, gint64 timestamp);
+
+#endif /* SRC_TORFLOW_TORFLOW_V3BW_WRITER_H_ */
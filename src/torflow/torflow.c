@@ -4,52 +4,37 @@
 
 #include "torflow.h"
 
-static GLogLevelFlags torflowLogFilterLevel = G_LOG_LEVEL_INFO;
-
-static const gchar* _torflow_logLevelToString(GLogLevelFlags logLevel) {
-    switch (logLevel) {
-        case G_LOG_LEVEL_ERROR:
-            return "error";
-        case G_LOG_LEVEL_CRITICAL:
-            return "critical";
-        case G_LOG_LEVEL_WARNING:
-            return "warning";
-        case G_LOG_LEVEL_MESSAGE:
-            return "message";
-        case G_LOG_LEVEL_INFO:
-            return "info";
-        case G_LOG_LEVEL_DEBUG:
-            return "debug";
-        default:
-            return "default";
+/* an additional event loop thread in FileServer mode. each worker has its own event
+ * manager and listener socket on the shared port, so workers share no state. */
+typedef struct _TorFlowFileServerWorker TorFlowFileServerWorker;
+struct _TorFlowFileServerWorker {
+    guint workerID;
+    in_port_t listenPort;
+    GThread* thread;
+    gboolean isSuccess;
+};
+
+static gpointer _torflow_runFileServerWorker(TorFlowFileServerWorker* worker) {
+    g_assert(worker);
+
+    TorFlowEventManager* manager = torfloweventmanager_new();
+    if(manager == NULL) {
+        critical("Creating event manager for worker %u failed", worker->workerID);
+        return NULL;
     }
-}
 
-void torflow_log(GLogLevelFlags level, const gchar* functionName, const gchar* format, ...) {
-    if(level > torflowLogFilterLevel) {
-        return;
+    TorFlowFileListener* listener = torflowfilelistener_new(manager, worker->workerID, worker->listenPort, TRUE);
+    if(listener == NULL) {
+        critical("Creating listener for worker %u failed", worker->workerID);
+        torfloweventmanager_free(manager);
+        return NULL;
     }
 
-    va_list vargs;
-    va_start(vargs, format);
-
-    GDateTime* dt = g_date_time_new_now_local();
-    GString* newformat = g_string_new(NULL);
-
-    g_string_append_printf(newformat, "%04i-%02i-%02i %02i:%02i:%02i %"G_GINT64_FORMAT".%06i [%s] [%s] %s",
-            g_date_time_get_year(dt), g_date_time_get_month(dt), g_date_time_get_day_of_month(dt),
-            g_date_time_get_hour(dt), g_date_time_get_minute(dt), g_date_time_get_second(dt),
-            g_date_time_to_unix(dt), g_date_time_get_microsecond(dt),
-            _torflow_logLevelToString(level), functionName, format);
+    worker->isSuccess = torfloweventmanager_runMainLoop(manager);
 
-    gchar* message = g_strdup_vprintf(newformat->str, vargs);
-    g_print("%s\n", message);
-    g_free(message);
-
-    g_string_free(newformat, TRUE);
-    g_date_time_unref(dt);
-
-    va_end(vargs);
+    torflowfilelistener_free(listener);
+    torfloweventmanager_free(manager);
+    return NULL;
 }
 
 int main(int argc, char *argv[]) {
@@ -62,22 +47,28 @@ int main(int argc, char *argv[]) {
 	TorFlowConfig* config = torflowconfig_new(argc, argv);
 	if(config == NULL) {
 	    message("Parsing config failed, exiting with failure");
+	    torflow_flushLog();
 	    return EXIT_FAILURE;
 	}
 
-	/* update to the configured log level */
-	torflowLogFilterLevel = torflowconfig_getLogLevel(config);
+	/* update to the configured log levels */
+	for(gint i = 0; i < TORFLOW_LOG_NUM_CATEGORIES; i++) {
+	    torflow_setLogLevel((TorFlowLogCategory)i, torflowconfig_getLogCategoryLevel(config, (TorFlowLogCategory)i));
+	}
 
 	message("Creating event manager to run main loop");
 	TorFlowEventManager* manager = torfloweventmanager_new();
     if(manager == NULL) {
         message("Creating event manager failed, exiting with failure");
+        torflow_flushLog();
         return EXIT_FAILURE;
     }
 
     TorFlowMode mode = torflowconfig_getMode(config);
     TorFlowAuthority* authority = NULL;
     TorFlowFileListener* listener = NULL;
+    TorFlowFileServerWorker* workers = NULL;
+    guint numWorkers = 0;
 
     if(mode == TORFLOW_MODE_TORFLOW) {
         message("Starting in TorFlow mode, creating TorFlow authority");
@@ -85,6 +76,7 @@ int main(int argc, char *argv[]) {
         authority = torflowauthority_new(config, manager);
         if(authority == NULL) {
             message("Creating authority failed, exiting with failure");
+            torflow_flushLog();
             return EXIT_FAILURE;
         }
     } else {
@@ -92,11 +84,27 @@ int main(int argc, char *argv[]) {
 
         message("Starting in FileServer mode, creating file server listener on port %u", ntohs(listenPort));
 
-        listener = torflowfilelistener_new(manager, 0, listenPort);
+        /* we are worker 0, every other worker gets its own thread and listener on the same port */
+        numWorkers = torflowconfig_getNumFileServerThreads(config) - 1;
+
+        listener = torflowfilelistener_new(manager, 0, listenPort, numWorkers > 0);
         if(listener == NULL) {
             message("Creating listener failed, exiting with failure");
+            torflow_flushLog();
             return EXIT_FAILURE;
         }
+
+        if(numWorkers > 0) {
+            message("Starting %u more file server threads on port %u", numWorkers, ntohs(listenPort));
+            workers = g_new0(TorFlowFileServerWorker, numWorkers);
+        }
+
+        for(guint i = 0; i < numWorkers; i++) {
+            workers[i].workerID = i + 1;
+            workers[i].listenPort = listenPort;
+            workers[i].thread = g_thread_new("torflow-fileserver",
+                    (GThreadFunc)_torflow_runFileServerWorker, &workers[i]);
+        }
     }
 
 	/* now the authority should have caused descriptors to get created that are waiting
@@ -105,6 +113,13 @@ int main(int argc, char *argv[]) {
 	gboolean success = torfloweventmanager_runMainLoop(manager);
 
 	message("Main loop returned, cleaning up");
+	for(guint i = 0; i < numWorkers; i++) {
+	    g_thread_join(workers[i].thread);
+	    success = success && workers[i].isSuccess;
+	}
+	if(workers != NULL) {
+	    g_free(workers);
+	}
 	if(authority != NULL) {
         torflowauthority_free(authority);
 	}
@@ -115,5 +130,6 @@ int main(int argc, char *argv[]) {
 	torflowconfig_free(config);
 
 	message("Exiting cleanly with %s code", success ? "success" : "failure");
+	torflow_flushLog();
 	return success ? EXIT_SUCCESS : EXIT_FAILURE;
 }